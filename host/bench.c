@@ -0,0 +1,1873 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * host/bench.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <float.h>
+#include <math.h>
+
+#include "particle.h"
+#include "node.h"
+#include "lsq.h"
+#include "ekf.h"
+#include "grid.h"
+#include "rng.h"
+#include "pool.h"
+#include "lut.h"
+#include "heading.h"
+#include "util.h"
+#include "config.h"
+
+#define BENCH_MIN_TIME_S        0.2
+#define BENCH_MIN_REPS          3
+#define BENCH_SEED              1234
+#define BENCH_RNG_DRAWS         4096
+#define BENCH_THREADS           4
+// updates of a KLD-sampling run, and the smallest amount of particles it may use
+#define BENCH_KLD_UPDATES       50
+#define BENCH_KLD_MIN           50
+// particles of the linear against log-weight comparison
+#define BENCH_LOG_PARTICLES     10000
+// headings turned by the orientation noise, and the amount of turns
+#define BENCH_HEADING_PARTICLES 10000
+#define BENCH_HEADING_TURNS     100
+// simulated time and particles of the motion model spread at several update intervals
+// the area is large enough that no particle reaches its border
+#define BENCH_DT_TIME_S         10.0F
+#define BENCH_DT_PARTICLES      10000
+#define BENCH_DT_AREA           1000.0F
+// simulated time of the AP report stream, the other APs report every second
+// and the streaming filter predicts every second
+#define BENCH_PARTIAL_TIME_S    600.0
+#define BENCH_PARTIAL_PERIOD_S  1.0
+// tracks from a random position with noisy distances, cold and warm started
+#define BENCH_WARM_TRIALS       50
+#define BENCH_WARM_NOISE        0.2F
+// updates of every node before its snapshot is taken, and the snapshots that are timed
+#define BENCH_SNAPSHOT_UPDATES  20
+#define BENCH_SNAPSHOT_REPS     20
+#define BENCH_SNAPSHOT_PATH     SNAPSHOT_DIR "/bench.snap"
+// recorded tracks of a node walking through the area, replayed through every engine
+// the node steps this far in meters every update, and turns by a Gaussian in radians
+#define BENCH_ENGINE_TRACKS     20
+#define BENCH_ENGINE_UPDATES    100
+#define BENCH_ENGINE_STEP       0.2F
+#define BENCH_ENGINE_TURN       0.5F
+// the grid filter is timed on areas with an AP in every corner
+#define BENCH_GRID_APS          4
+
+typedef enum {
+    BENCH_STAGE_PREDICT,
+    BENCH_STAGE_WEIGHT,
+    // weight with the distance lookup table, not part of the update time
+    BENCH_STAGE_WEIGHT_LUT,
+    // weight and sum with log-weights, not part of the update time
+    BENCH_STAGE_WEIGHT_LOG,
+    BENCH_STAGE_MOMENTS,
+    BENCH_STAGE_LOG_MOMENTS,
+    BENCH_STAGE_NORMALIZE,
+    BENCH_STAGE_RESAMPLE,
+    BENCH_STAGE_ESTIMATE,
+    BENCH_STAGE_COUNT
+} bench_stage_t;
+
+static const char *stage_names[BENCH_STAGE_COUNT] = {
+    "predict", "weight", "weight_lut", "weight_log", "moments", "log_moments", "normalize", 
+    "resample", "estimate"
+};
+
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+static const char *layout_name = "soa";
+#else
+static const char *layout_name = "aos";
+#endif
+
+typedef enum {
+    BENCH_RNG_UTIL_RANGE,
+    BENCH_RNG_RANGE,
+    BENCH_RNG_FILL_UNIFORM,
+    BENCH_RNG_UTIL_NORMAL,
+    BENCH_RNG_FILL_BOX_MULLER,
+    BENCH_RNG_NORMAL,
+    BENCH_RNG_FILL_NORMAL,
+    BENCH_RNG_COUNT
+} bench_rng_t;
+
+static const char *rng_names[BENCH_RNG_COUNT] = {
+    "util_sample_range", "rng_range", "rng_fill_uniform", 
+    "util_box_muller", "fill_box_muller", "rng_normal", "rng_fill_normal"
+};
+
+static const int particle_counts[] = {100, 400, 1000, 10000, 50000, 100000};
+static const int ap_counts[] = {3, 4, 8, 16, 32};
+static const int update_counts[] = {10000, 100000, 1000000};
+static const int resample_counts[] = {1000, 10000, 100000};
+static const int kld_counts[] = {1000, 10000, 100000};
+// sharper likelihoods underflow the linear weights
+static const float log_vars[] = {0.8F, 0.1F, 0.02F, 0.005F};
+// update intervals in seconds, from MQTT bursts to a loaded host
+static const float dt_intervals[] = {0.03F, 0.3F, 1.0F, 3.0F};
+// report interval in seconds of the last AP, 0 when it is offline
+static const float slow_periods[] = {1.0F, 2.0F, 5.0F, 0.0F};
+// updates after which the warm start error is reported
+static const int warm_updates[] = {1, 3, 10, 30};
+// deviation in meters of the distances of the replayed tracks
+static const float engine_noises[] = {0.05F, 0.2F, 0.5F};
+// areas and cell sizes in meters the grid filter is timed on, from the default room up
+static const struct {
+    float x;
+    float y;
+    float cell;
+} grid_sizes[] = {
+    {3, 2, 0.2F}, {3, 2, 0.1F}, {3, 2, 0.05F}, {6, 4, 0.1F}, {12, 8, 0.1F}, {24, 16, 0.1F}
+};
+
+static const char *resampler_names[PARTICLE_RESAMPLE_COUNT] = {
+    "systematic", "stratified", "residual", "metropolis"
+};
+
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+    int particles;
+    int aps;
+    double ns_per_particle[BENCH_STAGE_COUNT];
+    double update_ns;
+} bench_result_t;
+
+typedef struct {
+    int particles;
+    double serial_ns;
+    double pool_ns;
+} bench_update_t;
+
+typedef struct {
+    int particles;
+    double ns_per_particle[PARTICLE_RESAMPLE_COUNT];
+    // mean squared error of the copy counts against N * w, per particle
+    double count_mse[PARTICLE_RESAMPLE_COUNT];
+} bench_resample_t;
+
+typedef struct {
+    int particles;
+    double fixed_ns;
+    double kld_ns;
+    // mean amount of particles per update with KLD-sampling
+    double kld_particles;
+} bench_kld_t;
+
+typedef struct {
+    float ap_measurement_var;
+    double linear_ns;
+    double log_ns;
+    // updates after which the set holds weights that are not finite
+    int linear_collapsed;
+    int log_collapsed;
+} bench_log_t;
+
+typedef struct {
+    // ns per turn with theta and cosf/sinf, and with the heading table
+    double trig_ns;
+    double vector_ns;
+    // rms angle between the heading vector and the exact angle after all turns
+    double rms_deg;
+    // largest deviation of the length of a heading vector from 1
+    double norm_err;
+} bench_heading_t;
+
+typedef struct {
+    float dt;
+    // rms distance of the particles from their start after BENCH_DT_TIME_S,
+    // with a fixed step per update and with the step scaled by the interval
+    double fixed_rms;
+    double timed_rms;
+} bench_dt_t;
+
+typedef struct {
+    float slow_period;
+    // updates per second when waiting for every AP, and with partial sets
+    double all_rate;
+    double partial_rate;
+    // mean amount of APs in a partial set
+    double partial_aps;
+} bench_partial_t;
+
+typedef struct {
+    float slow_period;
+    // mean time a measurement waits for its set, a streamed one is used on arrival
+    double set_latency_ms;
+    // compute time per AP measurement of both filters
+    double set_us;
+    double stream_us;
+} bench_stream_t;
+
+typedef struct {
+    int updates;
+    // mean distance between the estimate and the node after the updates
+    double cold_err;
+    double warm_err;
+} bench_warm_t;
+
+typedef struct {
+    int nodes;
+    size_t bytes;
+    // time per snapshot of a full node table
+    double pack_us;
+    double save_us;
+    double load_us;
+    double unpack_us;
+    // the restored filters give the same estimates as the originals
+    int match;
+} bench_snapshot_t;
+
+typedef struct {
+    float noise;
+    // time per update and mean distance between the estimate and the node, per engine
+    double pf_us;
+    double pf_err;
+    double lsq_us;
+    double lsq_err;
+    // mean rms residual of the least-squares fixes
+    double lsq_rms;
+    double ekf_us;
+    double ekf_err;
+    // mean position deviation of the Kalman filter
+    double ekf_sd;
+    double grid_us;
+    double grid_err;
+    // mean deviation of the belief of the grid filter
+    double grid_sd;
+} bench_engine_t;
+
+typedef struct {
+    float area_x;
+    float area_y;
+    float cell;
+    int cells;
+    size_t bytes;
+    double update_us;
+    // cells through predict and correct per second
+    double cells_per_s;
+} bench_grid_t;
+
+typedef struct {
+    double rng_ns[BENCH_RNG_COUNT];
+    bench_result_t *results;
+    int count;
+    bench_update_t updates[ARRAY_SIZE(update_counts)];
+    int threads;
+    bench_resample_t resample[ARRAY_SIZE(resample_counts)];
+    bench_kld_t kld[ARRAY_SIZE(kld_counts)];
+    bench_log_t log[ARRAY_SIZE(log_vars)];
+    bench_heading_t heading;
+    bench_dt_t dt[ARRAY_SIZE(dt_intervals)];
+    bench_partial_t partial[ARRAY_SIZE(slow_periods)];
+    bench_stream_t stream[ARRAY_SIZE(slow_periods)];
+    bench_warm_t warm[ARRAY_SIZE(warm_updates)];
+    bench_snapshot_t snapshot;
+    bench_engine_t engine[ARRAY_SIZE(engine_noises)];
+    bench_grid_t grid[ARRAY_SIZE(grid_sizes)];
+    // size of the distance lookup table with a single AP plane
+    size_t lut_bytes;
+    int lut_cols;
+    int lut_rows;
+} bench_report_t;
+
+static ble_rng_t rng;
+
+/**
+ * \brief Get monotonic time in nanoseconds.
+ * 
+ * \return Time in nanoseconds.
+ */
+static int64_t 
+bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/**
+ * \brief Place APs evenly along the border of the area
+ * and calculate their (noisy) distance to a fixed node position.
+ * 
+ * \param aps Array of APs to fill.
+ * \param ap_count Amount of APs.
+ */
+static void 
+bench_setup_aps(ble_particle_ap_t *aps, int ap_count)
+{
+    float node_x = AREA_X * 0.4F, node_y = AREA_Y * 0.6F;
+    float perimeter = 2.0F * (AREA_X + AREA_Y);
+
+    for (int i = 0; i < ap_count; i++) {
+        // walk along the border of the rectangle
+        float d = perimeter * i / ap_count;
+        float x, y;
+        if (d < AREA_X) {
+            x = d; y = 0;
+        } else if (d < AREA_X + AREA_Y) {
+            x = AREA_X; y = d - AREA_X;
+        } else if (d < 2 * AREA_X + AREA_Y) {
+            x = AREA_X - (d - AREA_X - AREA_Y); y = AREA_Y;
+        } else {
+            x = 0; y = AREA_Y - (d - 2 * AREA_X - AREA_Y);
+        }
+        aps[i].id = i + 1;
+        aps[i].pos.x = x;
+        aps[i].pos.y = y;
+        aps[i].node_distance = sqrtf(powf(x - node_x, 2) + powf(y - node_y, 2)) + 
+            ble_rng_range(&rng, -0.2F, 0.2F);
+    }
+}
+
+/**
+ * \brief Run a single stage on the particle set.
+ * 
+ * \param stage Stage to run.
+ * \param pf Filter.
+ * \param aps Array of APs.
+ * \param ap_count Amount of APs.
+ * \param lut Distance lookup table with a plane for every AP.
+ * \param log_weight Log-weights of the particles, only used by the log-weight stages.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_run_stage(bench_stage_t stage, ble_particle_filter_t *pf, 
+    ble_particle_ap_t *aps, int ap_count, ble_lut_t *lut, float *log_weight)
+{
+    ble_particle_node_t node;
+
+    switch (stage) {
+    case BENCH_STAGE_PREDICT:
+        ble_particle_state_predict(pf);
+        break;
+    case BENCH_STAGE_WEIGHT:
+        ble_particle_weight(pf, aps, ap_count);
+        break;
+    case BENCH_STAGE_WEIGHT_LUT:
+        pf->lut = lut;
+        ble_particle_weight(pf, aps, ap_count);
+        pf->lut = NULL;
+        break;
+    case BENCH_STAGE_WEIGHT_LOG:
+        pf->log_weight = log_weight;
+        ble_particle_weight(pf, aps, ap_count);
+        pf->log_weight = NULL;
+        break;
+    case BENCH_STAGE_MOMENTS:
+        // keep the result alive so the loop is not optimized away
+        if (ble_particle_moments(pf) < 0)
+            return -1;
+        break;
+    case BENCH_STAGE_LOG_MOMENTS:
+    {
+        pf->log_weight = log_weight;
+        float n_eff = ble_particle_moments(pf);
+        pf->log_weight = NULL;
+        if (n_eff < 0)
+            return -1;
+        break;
+    }
+    case BENCH_STAGE_NORMALIZE:
+        ble_particle_normalize(pf);
+        break;
+    case BENCH_STAGE_RESAMPLE:
+        ble_particle_resample(pf);
+        break;
+    case BENCH_STAGE_ESTIMATE:
+        ble_particle_estimate(pf, &node);
+        if (node.pos.x < 0)
+            return -1;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Time every stage for a particle and AP count.
+ * Each stage is repeated until it ran for at least min_time seconds.
+ * 
+ * \param res Result structure, particles and aps should be set.
+ * \param min_time Minimum time per stage in seconds.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure(bench_result_t *res, double min_time)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.particles = res->particles;
+    cfg.seed = ble_rng_next(&rng) | 1;
+
+    ble_particle_ap_t *aps = calloc(res->aps, sizeof(ble_particle_ap_t));
+    if (aps == NULL)
+        return -1;
+    ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+    ble_lut_t *lut = ble_lut_create(cfg.area.x, cfg.area.y, LUT_RESOLUTION, res->aps, 
+        LUT_BILINEAR);
+    float *log_weight = calloc(res->particles, sizeof(float));
+    if (pf == NULL || lut == NULL || log_weight == NULL) {
+        ble_particle_filter_destroy(pf);
+        ble_lut_destroy(lut);
+        free(log_weight);
+        free(aps);
+        return -1;
+    }
+    ble_particle_set_t *set = &pf->set;
+    bench_setup_aps(aps, res->aps);
+
+    res->update_ns = 0;
+    for (int s = 0; s < BENCH_STAGE_COUNT; s++) {
+        int64_t elapsed = 0;
+        int reps = 0;
+        while (reps < BENCH_MIN_REPS || elapsed < (int64_t)(min_time * 1e9)) {
+            int64_t start = bench_now_ns();
+            if (bench_run_stage(s, pf, aps, res->aps, lut, log_weight) != 0) {
+                ble_particle_filter_destroy(pf);
+                ble_lut_destroy(lut);
+                free(log_weight);
+                free(aps);
+                return -1;
+            }
+            elapsed += bench_now_ns() - start;
+            reps++;
+            // reset the weights, repeated weighting without resampling
+            // underflows them to denormals which are very slow on x86
+            // the normalization is left pending, so every normalize repetition applies it
+            for (int i = 0; i < res->particles; i++) {
+                PARTICLE_WEIGHT(set, i) = 1.0F;
+                log_weight[i] = 0;
+            }
+            pf->weight_scale = 1.0F / res->particles;
+        }
+        double ns = (double)elapsed / reps;
+        res->ns_per_particle[s] = ns / res->particles;
+        if (s != BENCH_STAGE_WEIGHT_LUT && s != BENCH_STAGE_WEIGHT_LOG && 
+                s != BENCH_STAGE_LOG_MOMENTS)
+            res->update_ns += ns;
+    }
+    ble_particle_filter_destroy(pf);
+    ble_lut_destroy(lut);
+    free(log_weight);
+    free(aps);
+
+    return 0;
+}
+
+/**
+ * \brief Measure a full filter update.
+ * 
+ * \param particles Amount of particles.
+ * \param pool Pool to update with, NULL for a serial update.
+ * \param min_time Minimum time in seconds.
+ * 
+ * \return Nanoseconds per update, negative on failure.
+ */
+static double 
+bench_measure_update(int particles, ble_pool_t *pool, double min_time)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.particles = particles;
+    cfg.seed = ble_rng_next(&rng) | 1;
+
+    ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+    if (pf == NULL)
+        return -1;
+    if (pool != NULL && ble_particle_filter_set_pool(pf, pool) != 0) {
+        ble_particle_filter_destroy(pf);
+        return -1;
+    }
+    ble_particle_data_t data = {0};
+    bench_setup_aps(data.aps, NO_OF_APS);
+    data.ap_count = NO_OF_APS;
+
+    int64_t elapsed = 0;
+    int reps = 0;
+    while (reps < BENCH_MIN_REPS || elapsed < (int64_t)(min_time * 1e9)) {
+        int64_t start = bench_now_ns();
+        if (ble_particle_filter_update(pf, &data) != 0) {
+            ble_particle_filter_destroy(pf);
+            return -1;
+        }
+        elapsed += bench_now_ns() - start;
+        reps++;
+    }
+    ble_particle_filter_destroy(pf);
+
+    return (double)elapsed / reps;
+}
+
+/**
+ * \brief Measure every resampling algorithm on log-normal weights.
+ * Particle i starts at x = i, so the copy count of every particle can be read
+ * from the new set and compared with its expected count N * w.
+ * 
+ * \param res Result with the amount of particles set.
+ * \param min_time Minimum time per algorithm in seconds.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_resample(bench_resample_t *res, double min_time)
+{
+    int *counts = calloc(res->particles, sizeof(int));
+    if (counts == NULL)
+        return -1;
+
+    for (int r = 0; r < PARTICLE_RESAMPLE_COUNT; r++) {
+        ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+        cfg.particles = res->particles;
+        cfg.resampler = r;
+        cfg.seed = ble_rng_next(&rng) | 1;
+        ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+        if (pf == NULL) {
+            free(counts);
+            return -1;
+        }
+
+        int64_t elapsed = 0;
+        int reps = 0;
+        double mse = 0;
+        while (reps < BENCH_MIN_REPS || elapsed < (int64_t)(min_time * 1e9)) {
+            ble_particle_set_t *set = &pf->set;
+            for (int i = 0; i < res->particles; i++) {
+                PARTICLE_X(set, i) = (float)i;
+                PARTICLE_WEIGHT(set, i) = expf(ble_rng_normal(&rng, 0, 1));
+            }
+            ble_particle_moments(pf);
+            ble_particle_normalize(pf);
+
+            int64_t start = bench_now_ns();
+            ble_particle_resample(pf);
+            elapsed += bench_now_ns() - start;
+            reps++;
+
+            // the sets are swapped, the old weights are in the spare set
+            memset(counts, 0, res->particles * sizeof(int));
+            for (int i = 0; i < res->particles; i++)
+                counts[(int)PARTICLE_X(&pf->set, i)]++;
+            double err = 0;
+            for (int i = 0; i < res->particles; i++) {
+                double d = counts[i] - ((double)res->particles * PARTICLE_WEIGHT(&pf->spare, i));
+                err += d * d;
+            }
+            mse += err / res->particles;
+        }
+        res->ns_per_particle[r] = (double)elapsed / reps / res->particles;
+        res->count_mse[r] = mse / reps;
+        ble_particle_filter_destroy(pf);
+    }
+    free(counts);
+
+    return 0;
+}
+
+/**
+ * \brief Run a tracking sequence of a fixed node.
+ * 
+ * \param cfg Filter configuration.
+ * \param particles Written with the mean amount of particles per update.
+ * 
+ * \return Nanoseconds per update, negative on failure.
+ */
+static double 
+bench_run_tracking(ble_particle_config_t *cfg, double *particles)
+{
+    ble_particle_filter_t *pf = ble_particle_filter_create(cfg);
+    if (pf == NULL)
+        return -1;
+    ble_particle_data_t data = {0};
+    bench_setup_aps(data.aps, NO_OF_APS);
+    data.ap_count = NO_OF_APS;
+
+    int64_t elapsed = 0;
+    double total = 0;
+    for (int u = 0; u < BENCH_KLD_UPDATES; u++) {
+        int64_t start = bench_now_ns();
+        if (ble_particle_filter_update(pf, &data) != 0) {
+            ble_particle_filter_destroy(pf);
+            return -1;
+        }
+        elapsed += bench_now_ns() - start;
+        total += data.particles;
+    }
+    ble_particle_filter_destroy(pf);
+    *particles = total / BENCH_KLD_UPDATES;
+
+    return (double)elapsed / BENCH_KLD_UPDATES;
+}
+
+/**
+ * \brief Compare a fixed amount of particles with KLD-sampling up to the same amount.
+ * 
+ * \param res Result with the maximum amount of particles set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_kld(bench_kld_t *res)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.particles = res->particles;
+    cfg.seed = ble_rng_next(&rng) | 1;
+    double fixed_particles;
+    res->fixed_ns = bench_run_tracking(&cfg, &fixed_particles);
+
+    cfg.min_particles = BENCH_KLD_MIN;
+    res->kld_ns = bench_run_tracking(&cfg, &res->kld_particles);
+
+    return (res->fixed_ns < 0 || res->kld_ns < 0) ? -1 : 0;
+}
+
+/**
+ * \brief Run a tracking sequence of a fixed node, and count the updates
+ * after which the weights of the set are no longer finite.
+ * 
+ * \param cfg Filter configuration.
+ * \param collapsed Written with the amount of collapsed updates.
+ * 
+ * \return Nanoseconds per update, negative on failure.
+ */
+static double 
+bench_run_collapse(ble_particle_config_t *cfg, int *collapsed)
+{
+    ble_particle_filter_t *pf = ble_particle_filter_create(cfg);
+    if (pf == NULL)
+        return -1;
+    ble_particle_data_t data = {0};
+    bench_setup_aps(data.aps, NO_OF_APS);
+    data.ap_count = NO_OF_APS;
+
+    int64_t elapsed = 0;
+    *collapsed = 0;
+    for (int u = 0; u < BENCH_KLD_UPDATES; u++) {
+        int64_t start = bench_now_ns();
+        if (ble_particle_filter_update(pf, &data) != 0) {
+            ble_particle_filter_destroy(pf);
+            return -1;
+        }
+        elapsed += bench_now_ns() - start;
+        for (int i = 0; i < pf->set.size; i++) {
+            if (!isfinite(PARTICLE_WEIGHT(&pf->set, i))) {
+                (*collapsed)++;
+                break;
+            }
+        }
+    }
+    ble_particle_filter_destroy(pf);
+
+    return (double)elapsed / BENCH_KLD_UPDATES;
+}
+
+/**
+ * \brief Compare linear weights with log-weights for an AP measurement variance.
+ * 
+ * \param res Result with the AP measurement variance set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_log(bench_log_t *res)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.particles = BENCH_LOG_PARTICLES;
+    cfg.ap_measurement_var = res->ap_measurement_var;
+    cfg.seed = ble_rng_next(&rng) | 1;
+    res->linear_ns = bench_run_collapse(&cfg, &res->linear_collapsed);
+
+    cfg.log_weights = 1;
+    res->log_ns = bench_run_collapse(&cfg, &res->log_collapsed);
+
+    return (res->linear_ns < 0 || res->log_ns < 0) ? -1 : 0;
+}
+
+/**
+ * \brief Turn headings by Gaussian noise with the orientation variance,
+ * once as an angle with cosf and sinf the way PARTICLE_HEADING_ANGLE does,
+ * and once as a vector rotated by the heading table.
+ * The vector is compared with the exact accumulated angle afterwards.
+ * 
+ * \param res Result.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_heading(bench_heading_t *res)
+{
+    int n = BENCH_HEADING_PARTICLES;
+    float *noise = malloc(n * sizeof(float));
+    float *theta = malloc(n * sizeof(float));
+    float *hx = malloc(n * sizeof(float));
+    float *hy = malloc(n * sizeof(float));
+    double *exact = malloc(n * sizeof(double));
+    if (noise == NULL || theta == NULL || hx == NULL || hy == NULL || exact == NULL) {
+        free(noise);
+        free(theta);
+        free(hx);
+        free(hy);
+        free(exact);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int k = ble_rng_sample(&rng, HEADING_STEPS);
+        hx[i] = ble_heading_cos(k);
+        hy[i] = ble_heading_sin(k);
+        exact[i] = (2.0 * M_PI * k) / HEADING_STEPS;
+        theta[i] = (float)exact[i];
+    }
+
+    int64_t trig = 0, vector = 0;
+    float sink_x = 0, sink_y = 0;
+    for (int t = 0; t < BENCH_HEADING_TURNS; t++) {
+        ble_rng_fill_normal(&rng, noise, n, 0.0F, sqrtf(ORIENTATION_VAR));
+        for (int i = 0; i < n; i++)
+            exact[i] += noise[i];
+
+        int64_t start = bench_now_ns();
+        for (int i = 0; i < n; i++) {
+            sink_x += cosf(theta[i]);
+            sink_y += sinf(theta[i]);
+            theta[i] = clampaf(theta[i] + noise[i]);
+        }
+        trig += bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (int i = 0; i < n; i++) {
+            sink_x += hx[i];
+            sink_y += hy[i];
+            ble_heading_rotate(&hx[i], &hy[i], ble_heading_step(noise[i]));
+        }
+        vector += bench_now_ns() - start;
+    }
+
+    double err = 0, norm = 0;
+    for (int i = 0; i < n; i++) {
+        double d = remainder(atan2(hy[i], hx[i]) - exact[i], 2.0 * M_PI);
+        err += d * d;
+        double len = fabs(sqrt(((double)hx[i] * hx[i]) + ((double)hy[i] * hy[i])) - 1.0);
+        norm = (len > norm) ? len : norm;
+    }
+    res->trig_ns = (double)trig / ((double)n * BENCH_HEADING_TURNS);
+    res->vector_ns = (double)vector / ((double)n * BENCH_HEADING_TURNS);
+    res->rms_deg = sqrt(err / n) * (180.0 / M_PI);
+    res->norm_err = norm;
+    free(noise);
+    free(theta);
+    free(hx);
+    free(hy);
+    free(exact);
+
+    // keep the sums alive so the loops are not optimized away
+    return (isnan(sink_x) || isnan(sink_y)) ? -1 : 0;
+}
+
+/**
+ * \brief Spread particles from a single point with the motion model only,
+ * updating every dt for BENCH_DT_TIME_S seconds.
+ * 
+ * \param dt Interval between updates in seconds.
+ * \param timed Scale the step with the interval, as updates with a timestamp do.
+ * 
+ * \return Rms distance of the particles from the start, negative on failure.
+ */
+static double 
+bench_run_spread(float dt, int timed)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.particles = BENCH_DT_PARTICLES;
+    cfg.area.x = BENCH_DT_AREA;
+    cfg.area.y = BENCH_DT_AREA;
+    cfg.seed = ble_rng_next(&rng) | 1;
+    ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+    if (pf == NULL)
+        return -1;
+
+    float start = BENCH_DT_AREA / 2.0F;
+    for (int i = 0; i < pf->set.size; i++) {
+        PARTICLE_X(&pf->set, i) = start;
+        PARTICLE_Y(&pf->set, i) = start;
+    }
+    // the time step ble_particle_filter_update derives from the timestamps
+    pf->dt_scale = timed ? (dt / cfg.update_interval) : 1.0F;
+    int steps = (int)((BENCH_DT_TIME_S / dt) + 0.5F);
+    for (int s = 0; s < steps; s++)
+        ble_particle_state_predict(pf);
+
+    double sum = 0;
+    for (int i = 0; i < pf->set.size; i++) {
+        double dx = PARTICLE_X(&pf->set, i) - start, dy = PARTICLE_Y(&pf->set, i) - start;
+        sum += (dx * dx) + (dy * dy);
+    }
+    ble_particle_filter_destroy(pf);
+
+    return sqrt(sum / BENCH_DT_PARTICLES);
+}
+
+/**
+ * \brief Compare the spread of the motion model with and without timestamps.
+ * 
+ * \param res Result with the update interval set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_dt(bench_dt_t *res)
+{
+    res->fixed_rms = bench_run_spread(res->dt, 0);
+    res->timed_rms = bench_run_spread(res->dt, 1);
+    return (res->fixed_rms < 0 || res->timed_rms < 0) ? -1 : 0;
+}
+
+/**
+ * \brief Schedule the first report of every AP within the first interval.
+ * The APs report every BENCH_PARTIAL_PERIOD_S, except for the last one.
+ * 
+ * \param next_s Array of NO_OF_APS, written with the time of the first report of every AP.
+ * \param slow_period Report interval of the last AP, 0 when it is offline.
+ */
+static void 
+bench_start_reports(double *next_s, float slow_period)
+{
+    for (int i = 0; i < NO_OF_APS; i++)
+        next_s[i] = ble_rng_range(&rng, 0.0F, BENCH_PARTIAL_PERIOD_S);
+    if (slow_period == 0)
+        next_s[NO_OF_APS - 1] = INFINITY;
+}
+
+/**
+ * \brief Take the next report of the AP stream and schedule the following one of that AP.
+ * Every interval is jittered by 10% so the reports do not arrive in lockstep.
+ * 
+ * \param next_s Array of NO_OF_APS with the time of the next report of every AP.
+ * \param slow_period Report interval of the last AP.
+ * \param time_s Written with the time of the report.
+ * 
+ * \return Index of the AP that reports, -1 after BENCH_PARTIAL_TIME_S.
+ */
+static int 
+bench_next_report(double *next_s, float slow_period, double *time_s)
+{
+    int ap = 0;
+    for (int i = 1; i < NO_OF_APS; i++)
+        ap = (next_s[i] < next_s[ap]) ? i : ap;
+    if (next_s[ap] > BENCH_PARTIAL_TIME_S)
+        return -1;
+    *time_s = next_s[ap];
+    float period = (ap == NO_OF_APS - 1) ? slow_period : BENCH_PARTIAL_PERIOD_S;
+    next_s[ap] += period * ble_rng_range(&rng, 0.9F, 1.1F);
+    return ap;
+}
+
+/**
+ * \brief Feed a node an AP stream with a slow last AP, 
+ * and count the measurement sets it completes.
+ * 
+ * \param res Result with the interval of the last AP set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_partial(bench_partial_t *res)
+{
+    ble_node_t node = {0};
+    double next_s[NO_OF_APS], time_s;
+    bench_start_reports(next_s, res->slow_period);
+
+    int all_sets = 0, partial_sets = 0, partial_aps = 0;
+    unsigned int reported = 0;
+    int ap;
+    while ((ap = bench_next_report(next_s, res->slow_period, &time_s)) >= 0) {
+        ble_particle_ap_t data = {.id = ap + 1, .node_distance = 1.0F};
+        data.timestamp_us = (int64_t)(time_s * 1e6);
+        node.last_seen_us = data.timestamp_us;
+        if (ble_node_store_ap_data(&node, data)) {
+            partial_sets++;
+            partial_aps += node.data.ap_count;
+        }
+        // the previous policy, a set once every AP reported
+        reported |= 1U << ap;
+        if (reported == (1U << NO_OF_APS) - 1) {
+            all_sets++;
+            reported = 0;
+        }
+    }
+    res->all_rate = all_sets / BENCH_PARTIAL_TIME_S;
+    res->partial_rate = partial_sets / BENCH_PARTIAL_TIME_S;
+    res->partial_aps = (partial_sets > 0) ? ((double)partial_aps / partial_sets) : 0;
+
+    return (partial_sets > 0) ? 0 : -1;
+}
+
+/**
+ * \brief Run the same AP stream through a filter updated per measurement set
+ * and a filter updated per measurement, with the motion model every second.
+ * The latency of a measurement is the time until an update uses it.
+ * 
+ * \param res Result with the interval of the last AP set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_stream(bench_stream_t *res)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.seed = ble_rng_next(&rng) | 1;
+    ble_particle_filter_t *set_pf = ble_particle_filter_create(&cfg);
+    ble_particle_filter_t *stream_pf = ble_particle_filter_create(&cfg);
+    if (set_pf == NULL || stream_pf == NULL) {
+        ble_particle_filter_destroy(set_pf);
+        ble_particle_filter_destroy(stream_pf);
+        return -1;
+    }
+    ble_particle_ap_t aps[NO_OF_APS];
+    bench_setup_aps(aps, NO_OF_APS);
+    ble_node_t node = {0};
+    double next_s[NO_OF_APS], time_s, next_predict_s = BENCH_PARTIAL_PERIOD_S;
+    bench_start_reports(next_s, res->slow_period);
+
+    int64_t set_ns = 0, stream_ns = 0;
+    double latency_s = 0;
+    int measurements = 0, used = 0, ret = 0;
+    int ap;
+    while (ret == 0 && (ap = bench_next_report(next_s, res->slow_period, &time_s)) >= 0) {
+        ble_particle_ap_t data = aps[ap];
+        data.timestamp_us = (int64_t)(time_s * 1e6);
+        measurements++;
+
+        int64_t start = bench_now_ns();
+        for (; next_predict_s <= time_s; next_predict_s += BENCH_PARTIAL_PERIOD_S)
+            ret |= ble_particle_filter_predict(stream_pf, (int64_t)(next_predict_s * 1e6));
+        ret |= ble_particle_filter_observe(stream_pf, &data, &node.data);
+        stream_ns += bench_now_ns() - start;
+
+        node.last_seen_us = data.timestamp_us;
+        if (!ble_node_store_ap_data(&node, data))
+            continue;
+        for (int i = 0; i < node.data.ap_count; i++)
+            latency_s += time_s - (node.data.aps[i].timestamp_us * 1e-6);
+        used += node.data.ap_count;
+        start = bench_now_ns();
+        ret |= ble_particle_filter_update(set_pf, &node.data);
+        set_ns += bench_now_ns() - start;
+    }
+    ble_particle_filter_destroy(set_pf);
+    ble_particle_filter_destroy(stream_pf);
+    if (ret != 0 || used == 0)
+        return -1;
+
+    res->set_latency_ms = (latency_s / used) * 1e3;
+    res->set_us = (double)set_ns / measurements / 1e3;
+    res->stream_us = (double)stream_ns / measurements / 1e3;
+
+    return 0;
+}
+
+/**
+ * \brief Track a node at a random position from a fresh filter, with and without
+ * a warm start, and add the error after every number of updates in warm_updates.
+ * 
+ * \param res Array of ARRAY_SIZE(warm_updates) results to add to.
+ * \param warm Seed the particles around a trilateration of the first set.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_run_warm(bench_warm_t *res, int warm)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.seed = ble_rng_next(&rng) | 1;
+    cfg.warm_start = warm;
+    ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+    if (pf == NULL)
+        return -1;
+    ble_particle_data_t data = {0};
+    bench_setup_aps(data.aps, NO_OF_APS);
+    data.ap_count = NO_OF_APS;
+    float x = ble_rng_range(&rng, 0.0F, AREA_X), y = ble_rng_range(&rng, 0.0F, AREA_Y);
+
+    int last = warm_updates[ARRAY_SIZE(warm_updates) - 1];
+    for (int u = 1, r = 0; u <= last; u++) {
+        for (int i = 0; i < NO_OF_APS; i++) {
+            float dx = data.aps[i].pos.x - x, dy = data.aps[i].pos.y - y;
+            float d = sqrtf((dx * dx) + (dy * dy)) + ble_rng_normal(&rng, 0, BENCH_WARM_NOISE);
+            data.aps[i].node_distance = (d > 0) ? d : 0;
+        }
+        if (ble_particle_filter_update(pf, &data) != 0) {
+            ble_particle_filter_destroy(pf);
+            return -1;
+        }
+        if (u != warm_updates[r])
+            continue;
+        double err = hypot(data.node.pos.x - x, data.node.pos.y - y) / BENCH_WARM_TRIALS;
+        if (warm)
+            res[r].warm_err += err;
+        else
+            res[r].cold_err += err;
+        r++;
+    }
+    ble_particle_filter_destroy(pf);
+
+    return 0;
+}
+
+/**
+ * \brief Compare how fast a fresh filter converges with and without a warm start.
+ * 
+ * \param res Array of ARRAY_SIZE(warm_updates) results.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_warm(bench_warm_t *res)
+{
+    for (size_t r = 0; r < ARRAY_SIZE(warm_updates); r++)
+        res[r].updates = warm_updates[r];
+    for (int t = 0; t < BENCH_WARM_TRIALS; t++) {
+        if (bench_run_warm(res, 0) != 0 || bench_run_warm(res, 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Give every AP a random distance to the node.
+ * 
+ * \param data Measurement set.
+ */
+static void 
+bench_random_distances(ble_particle_data_t *data)
+{
+    for (int i = 0; i < data->ap_count; i++)
+        data->aps[i].node_distance = ble_rng_range(&rng, 0.5F, 3.0F);
+}
+
+/**
+ * \brief Time the snapshot of a full node table, and check that the restored filters
+ * continue exactly where the originals were.
+ * 
+ * \param res Result.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_snapshot(bench_snapshot_t *res)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.seed = ble_rng_next(&rng) | 1;
+    ble_node_table_t table, restored;
+    ble_node_table_init(&table, &cfg, NULL, NULL);
+    ble_node_table_init(&restored, &cfg, NULL, NULL);
+    ble_particle_data_t data = {0};
+    bench_setup_aps(data.aps, NO_OF_APS);
+    data.ap_count = NO_OF_APS;
+    ble_snapshot_t out = {0}, in = {0};
+    int ret = -1;
+
+    for (int n = 0; n < NODE_TABLE_SIZE; n++) {
+        ble_node_t *node = ble_node_table_get(&table, n, 0);
+        if (node == NULL)
+            goto out;
+        for (int u = 0; u < BENCH_SNAPSHOT_UPDATES; u++) {
+            bench_random_distances(&data);
+            if (ble_particle_filter_update(node->pf, &data) != 0)
+                goto out;
+        }
+    }
+    ble_node_table_pack(&table, &out);
+    out = (ble_snapshot_t){.buf = malloc(out.len), .cap = out.len};
+    in = (ble_snapshot_t){.buf = malloc(out.cap), .cap = out.cap};
+    if (out.buf == NULL || in.buf == NULL)
+        goto out;
+
+    memset(res, 0, sizeof(bench_snapshot_t));
+    for (int r = 0; r < BENCH_SNAPSHOT_REPS; r++) {
+        out.len = 0;
+        out.error = 0;
+        int64_t t0 = bench_now_ns();
+        int err = ble_node_table_pack(&table, &out);
+        int64_t t1 = bench_now_ns();
+        err = err || ble_snapshot_save(&out, SNAPSHOT_KIND_NODES, BENCH_SNAPSHOT_PATH);
+        int64_t t2 = bench_now_ns();
+        err = err || ble_snapshot_load(&in, SNAPSHOT_KIND_NODES, BENCH_SNAPSHOT_PATH, 
+            SNAPSHOT_MAX_AGE_S);
+        int64_t t3 = bench_now_ns();
+        err = err || ble_node_table_unpack(&restored, &in, 0) != NODE_TABLE_SIZE;
+        int64_t t4 = bench_now_ns();
+        if (err)
+            goto out;
+        res->pack_us += (double)(t1 - t0) / (1e3 * BENCH_SNAPSHOT_REPS);
+        res->save_us += (double)(t2 - t1) / (1e3 * BENCH_SNAPSHOT_REPS);
+        res->load_us += (double)(t3 - t2) / (1e3 * BENCH_SNAPSHOT_REPS);
+        res->unpack_us += (double)(t4 - t3) / (1e3 * BENCH_SNAPSHOT_REPS);
+    }
+    res->nodes = NODE_TABLE_SIZE;
+    res->bytes = out.len;
+
+    res->match = 1;
+    for (int n = 0; n < NODE_TABLE_SIZE; n++) {
+        ble_node_t *a = ble_node_table_get(&table, n, 0);
+        ble_node_t *b = ble_node_table_get(&restored, n, 0);
+        if (a == NULL || b == NULL)
+            goto out;
+        for (int u = 0; u < BENCH_SNAPSHOT_UPDATES; u++) {
+            bench_random_distances(&data);
+            ble_particle_data_t copy = data;
+            if (ble_particle_filter_update(a->pf, &data) != 0 || 
+                    ble_particle_filter_update(b->pf, &copy) != 0)
+                goto out;
+            res->match &= (data.node.pos.x == copy.node.pos.x && 
+                data.node.pos.y == copy.node.pos.y);
+        }
+    }
+    ret = 0;
+
+out:
+    remove(BENCH_SNAPSHOT_PATH);
+    free(out.buf);
+    free(in.buf);
+    ble_node_table_free(&table);
+    ble_node_table_free(&restored);
+
+    return ret;
+}
+
+/**
+ * \brief Record a track of a node walking through the area, turning at random
+ * and turned back at the border, with the noisy distance of every AP after every step.
+ * 
+ * \param sets Array of BENCH_ENGINE_UPDATES sets to fill.
+ * \param truth Array of BENCH_ENGINE_UPDATES positions to fill.
+ * \param noise Deviation of the distances in meters.
+ */
+static void 
+bench_record_track(ble_particle_data_t *sets, ble_particle_node_t *truth, float noise)
+{
+    float x = ble_rng_range(&rng, 0.0F, AREA_X), y = ble_rng_range(&rng, 0.0F, AREA_Y);
+    float theta = ble_rng_range(&rng, 0.0F, 2.0F * (float)M_PI);
+    for (int u = 0; u < BENCH_ENGINE_UPDATES; u++) {
+        theta += ble_rng_normal(&rng, 0, BENCH_ENGINE_TURN);
+        float nx = x + (BENCH_ENGINE_STEP * cosf(theta));
+        float ny = y + (BENCH_ENGINE_STEP * sinf(theta));
+        if (nx < 0 || nx > AREA_X || ny < 0 || ny > AREA_Y) {
+            theta += (float)M_PI;
+            nx = clampf(nx, 0, AREA_X);
+            ny = clampf(ny, 0, AREA_Y);
+        }
+        x = nx;
+        y = ny;
+        truth[u].pos.x = x;
+        truth[u].pos.y = y;
+
+        ble_particle_data_t *data = &sets[u];
+        memset(data, 0, sizeof(ble_particle_data_t));
+        bench_setup_aps(data->aps, NO_OF_APS);
+        data->ap_count = NO_OF_APS;
+        data->timestamp_us = (int64_t)(u + 1) * 1000000;
+        for (int i = 0; i < NO_OF_APS; i++) {
+            float dx = data->aps[i].pos.x - x, dy = data->aps[i].pos.y - y;
+            float d = sqrtf((dx * dx) + (dy * dy)) + ble_rng_normal(&rng, 0, noise);
+            data->aps[i].node_distance = (d > 0) ? d : 0;
+            data->aps[i].timestamp_us = data->timestamp_us;
+        }
+    }
+}
+
+/**
+ * \brief Replay recorded tracks through the particle filter, the least-squares engine,
+ * the Kalman filter and the grid filter, and compare the time per update
+ * and the error of the estimates.
+ * 
+ * \param res Result with the noise of the distances.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_engines(bench_engine_t *res)
+{
+    ble_particle_data_t sets[BENCH_ENGINE_UPDATES];
+    ble_particle_node_t truth[BENCH_ENGINE_UPDATES];
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    int64_t pf_ns = 0, lsq_ns = 0, ekf_ns = 0, grid_ns = 0;
+    double pf_err = 0, lsq_err = 0, lsq_rms = 0, ekf_err = 0, ekf_sd = 0, grid_err = 0, grid_sd = 0;
+
+    for (int t = 0; t < BENCH_ENGINE_TRACKS; t++) {
+        bench_record_track(sets, truth, res->noise);
+        cfg.seed = ble_rng_next(&rng) | 1;
+        ble_particle_filter_t *pf = ble_particle_filter_create(&cfg);
+        if (pf == NULL)
+            return -1;
+        ble_lsq_t lsq;
+        ble_lsq_init(&lsq, &cfg);
+        ble_ekf_t ekf;
+        ble_ekf_init(&ekf, &cfg);
+        ble_grid_t *grid = ble_grid_create(&cfg, GRID_CELL_SIZE);
+        if (grid == NULL) {
+            ble_particle_filter_destroy(pf);
+            return -1;
+        }
+
+        for (int u = 0; u < BENCH_ENGINE_UPDATES; u++) {
+            ble_particle_data_t data = sets[u];
+            int64_t start = bench_now_ns();
+            int err = ble_particle_filter_update(pf, &data);
+            pf_ns += bench_now_ns() - start;
+            pf_err += hypot(data.node.pos.x - truth[u].pos.x, data.node.pos.y - truth[u].pos.y);
+
+            data = sets[u];
+            start = bench_now_ns();
+            err |= ble_lsq_update(&lsq, &data);
+            lsq_ns += bench_now_ns() - start;
+            lsq_err += hypot(data.node.pos.x - truth[u].pos.x, data.node.pos.y - truth[u].pos.y);
+            lsq_rms += lsq.rms;
+
+            data = sets[u];
+            start = bench_now_ns();
+            err |= ble_ekf_update(&ekf, &data);
+            ekf_ns += bench_now_ns() - start;
+            ekf_err += hypot(data.node.pos.x - truth[u].pos.x, data.node.pos.y - truth[u].pos.y);
+            ekf_sd += ble_ekf_position_sd(&ekf);
+
+            data = sets[u];
+            start = bench_now_ns();
+            err |= ble_grid_update(grid, &data);
+            grid_ns += bench_now_ns() - start;
+            grid_err += hypot(data.node.pos.x - truth[u].pos.x, data.node.pos.y - truth[u].pos.y);
+            grid_sd += grid->sd;
+            if (err) {
+                ble_particle_filter_destroy(pf);
+                ble_grid_destroy(grid);
+                return -1;
+            }
+        }
+        ble_particle_filter_destroy(pf);
+        ble_grid_destroy(grid);
+    }
+    double updates = (double)BENCH_ENGINE_TRACKS * BENCH_ENGINE_UPDATES;
+    res->pf_us = pf_ns / updates / 1e3;
+    res->pf_err = pf_err / updates;
+    res->lsq_us = lsq_ns / updates / 1e3;
+    res->lsq_err = lsq_err / updates;
+    res->lsq_rms = lsq_rms / updates;
+    res->ekf_us = ekf_ns / updates / 1e3;
+    res->ekf_err = ekf_err / updates;
+    res->ekf_sd = ekf_sd / updates;
+    res->grid_us = grid_ns / updates / 1e3;
+    res->grid_err = grid_err / updates;
+    res->grid_sd = grid_sd / updates;
+
+    return 0;
+}
+
+/**
+ * \brief Time full updates of the grid filter on an area with an AP in every corner.
+ * The cost only depends on the amount of cells and the width of the motion kernel,
+ * not on the measurements.
+ * 
+ * \param res Result with the area and cell size set.
+ * \param min_time Minimum time in seconds.
+ * 
+ * \return 0 on success, -1 on failure.
+ */
+static int 
+bench_measure_grid(bench_grid_t *res, double min_time)
+{
+    ble_particle_config_t cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    cfg.area.x = res->area_x;
+    cfg.area.y = res->area_y;
+    ble_grid_t *grid = ble_grid_create(&cfg, res->cell);
+    if (grid == NULL)
+        return -1;
+    res->cells = grid->cols * grid->rows;
+    res->bytes = ble_grid_footprint(grid);
+
+    ble_particle_data_t data = {0};
+    float node_x = res->area_x * 0.4F, node_y = res->area_y * 0.6F;
+    for (int i = 0; i < BENCH_GRID_APS; i++) {
+        data.aps[i].id = i + 1;
+        data.aps[i].pos.x = (i & 1) ? res->area_x : 0;
+        data.aps[i].pos.y = (i & 2) ? res->area_y : 0;
+        data.aps[i].node_distance = hypotf(data.aps[i].pos.x - node_x, data.aps[i].pos.y - node_y);
+    }
+    data.ap_count = BENCH_GRID_APS;
+
+    // the first update builds the distance planes
+    int64_t elapsed = 0;
+    int reps = 0;
+    for (int warmup = 1; reps < BENCH_MIN_REPS || elapsed < (int64_t)(min_time * 1e9); warmup = 0) {
+        data.timestamp_us += 1000000;
+        int64_t start = bench_now_ns();
+        if (ble_grid_update(grid, &data) != 0) {
+            ble_grid_destroy(grid);
+            return -1;
+        }
+        if (!warmup) {
+            elapsed += bench_now_ns() - start;
+            reps++;
+        }
+    }
+    ble_grid_destroy(grid);
+    res->update_us = (double)elapsed / reps / 1e3;
+    res->cells_per_s = res->cells / (res->update_us * 1e-6);
+
+    return 0;
+}
+
+/**
+ * \brief Gaussian sample the way the filter used to draw it,
+ * Box-Muller on top of the reseeding ble_util_sample_range.
+ * 
+ * \return Value from the standard normal distribution.
+ */
+static float 
+bench_util_box_muller(void)
+{
+    float u1, u2;
+    do {
+        u1 = ble_util_sample_range(0.0F, 1.0F);
+        u2 = ble_util_sample_range(0.0F, 1.0F);
+    } while (u1 <= FLT_EPSILON);
+    return sqrtf(-2.0F * logf(u1)) * cosf((2.0F * M_PI) * u2);
+}
+
+/**
+ * \brief Fill a buffer with Gaussian samples the way the filter drew them
+ * before the Ziggurat method, Box-Muller on ble_rng using both values of a pair.
+ * 
+ * \param buf Buffer to fill.
+ * \param n Amount of values.
+ */
+static void 
+bench_fill_box_muller(float *buf, int n)
+{
+    for (int i = 0; i < n; i += 2) {
+        float u1 = 1.0F - ble_rng_uniform(&rng);
+        float u2 = ble_rng_uniform(&rng);
+        float mag = sqrtf(-2.0F * logf(u1));
+        buf[i] = mag * cosf((2.0F * M_PI) * u2);
+        // for an odd amount the spare value of the last pair is thrown away
+        if (i + 1 < n)
+            buf[i+1] = mag * sinf((2.0F * M_PI) * u2);
+    }
+}
+
+/**
+ * \brief Time the random number generators.
+ * 
+ * \param ns_per_draw Array of BENCH_RNG_COUNT results.
+ * \param min_time Minimum time per generator in seconds.
+ */
+static void 
+bench_measure_rng(double *ns_per_draw, double min_time)
+{
+    static float buf[BENCH_RNG_DRAWS];
+    volatile float sink = 0;
+
+    for (int g = 0; g < BENCH_RNG_COUNT; g++) {
+        int64_t elapsed = 0;
+        int reps = 0;
+        while (reps < BENCH_MIN_REPS || elapsed < (int64_t)(min_time * 1e9)) {
+            int64_t start = bench_now_ns();
+            switch (g) {
+            case BENCH_RNG_UTIL_RANGE:
+                for (int i = 0; i < BENCH_RNG_DRAWS; i++)
+                    buf[i] = ble_util_sample_range(0.0F, 1.0F);
+                break;
+            case BENCH_RNG_RANGE:
+                for (int i = 0; i < BENCH_RNG_DRAWS; i++)
+                    buf[i] = ble_rng_range(&rng, 0.0F, 1.0F);
+                break;
+            case BENCH_RNG_FILL_UNIFORM:
+                ble_rng_fill_uniform(&rng, buf, BENCH_RNG_DRAWS, 0.0F, 1.0F);
+                break;
+            case BENCH_RNG_UTIL_NORMAL:
+                for (int i = 0; i < BENCH_RNG_DRAWS; i++)
+                    buf[i] = bench_util_box_muller();
+                break;
+            case BENCH_RNG_FILL_BOX_MULLER:
+                bench_fill_box_muller(buf, BENCH_RNG_DRAWS);
+                break;
+            case BENCH_RNG_NORMAL:
+                for (int i = 0; i < BENCH_RNG_DRAWS; i++)
+                    buf[i] = ble_rng_normal(&rng, 0.0F, 1.0F);
+                break;
+            case BENCH_RNG_FILL_NORMAL:
+                ble_rng_fill_normal(&rng, buf, BENCH_RNG_DRAWS, 0.0F, 1.0F);
+                break;
+            default:
+                break;
+            }
+            elapsed += bench_now_ns() - start;
+            sink += buf[reps % BENCH_RNG_DRAWS];
+            reps++;
+        }
+        ns_per_draw[g] = (double)elapsed / ((double)reps * BENCH_RNG_DRAWS);
+    }
+}
+
+/**
+ * \brief Print the results as a table.
+ * 
+ * \param report Results of all benchmarks.
+ */
+static void 
+bench_print_table(bench_report_t *report)
+{
+    bench_result_t *results = report->results;
+    for (int g = 0; g < BENCH_RNG_COUNT; g++)
+        printf("%-18s %8.2f ns/draw\n", rng_names[g], report->rng_ns[g]);
+    printf("\nlayout: %s\n", layout_name);
+    printf("lut: %dx%d grid, %zu bytes with one AP, %zu bytes per extra AP\n", 
+        report->lut_cols, report->lut_rows, report->lut_bytes, 
+        (size_t)report->lut_cols * report->lut_rows * sizeof(float));
+
+    printf("%9s %4s", "particles", "aps");
+    for (int s = 0; s < BENCH_STAGE_COUNT; s++)
+        printf(" %10s", stage_names[s]);
+    printf(" %12s\n", "updates/s");
+    for (int i = 0; i < report->count; i++) {
+        printf("%9d %4d", results[i].particles, results[i].aps);
+        for (int s = 0; s < BENCH_STAGE_COUNT; s++)
+            printf(" %10.2f", results[i].ns_per_particle[s]);
+        printf(" %12.1f\n", 1e9 / results[i].update_ns);
+    }
+    printf("(stage columns in ns/particle)\n");
+
+    printf("\n%9s %12s %12s %8s\n", "particles", "serial us", "pool us", "speedup");
+    for (size_t i = 0; i < ARRAY_SIZE(update_counts); i++) {
+        bench_update_t *u = &report->updates[i];
+        printf("%9d %12.1f %12.1f %8.2f\n", u->particles, 
+            u->serial_ns / 1e3, u->pool_ns / 1e3, u->serial_ns / u->pool_ns);
+    }
+    printf("(full update with %d threads)\n", report->threads);
+
+    printf("\n%9s", "particles");
+    for (int r = 0; r < PARTICLE_RESAMPLE_COUNT; r++)
+        printf(" %21s", resampler_names[r]);
+    printf("\n");
+    for (size_t i = 0; i < ARRAY_SIZE(resample_counts); i++) {
+        bench_resample_t *res = &report->resample[i];
+        printf("%9d", res->particles);
+        for (int r = 0; r < PARTICLE_RESAMPLE_COUNT; r++)
+            printf(" %10.2f %10.4f", res->ns_per_particle[r], res->count_mse[r]);
+        printf("\n");
+    }
+    printf("(resampling in ns/particle and mean squared error of the copy counts)\n");
+
+    printf("\n%9s %12s %12s %14s\n", "particles", "fixed us", "kld us", "kld particles");
+    for (size_t i = 0; i < ARRAY_SIZE(kld_counts); i++) {
+        bench_kld_t *k = &report->kld[i];
+        printf("%9d %12.1f %12.1f %14.1f\n", k->particles, k->fixed_ns / 1e3, 
+            k->kld_ns / 1e3, k->kld_particles);
+    }
+    printf("(mean of %d updates, KLD-sampling from %d particles up to the fixed amount)\n", 
+        BENCH_KLD_UPDATES, BENCH_KLD_MIN);
+
+    printf("\n%9s %12s %12s %10s %10s\n", "ap_var", "linear us", "log us", 
+        "linear nan", "log nan");
+    for (size_t i = 0; i < ARRAY_SIZE(log_vars); i++) {
+        bench_log_t *l = &report->log[i];
+        printf("%9.3f %12.1f %12.1f %10d %10d\n", l->ap_measurement_var, 
+            l->linear_ns / 1e3, l->log_ns / 1e3, l->linear_collapsed, l->log_collapsed);
+    }
+    printf("(mean of %d updates of %d particles, nan counts updates with weights that "
+        "are not finite)\n", BENCH_KLD_UPDATES, BENCH_LOG_PARTICLES);
+
+    bench_heading_t *h = &report->heading;
+    printf("\n%12s %12s %12s %12s\n", "trig ns", "vector ns", "rms deg", "norm err");
+    printf("%12.2f %12.2f %12.3f %12.2e\n", h->trig_ns, h->vector_ns, h->rms_deg, 
+        h->norm_err);
+    printf("(heading turn per particle, error after %d turns against the exact angle, "
+        "%d table steps)\n", BENCH_HEADING_TURNS, HEADING_STEPS);
+
+    printf("\n%9s %12s %12s\n", "dt s", "fixed m", "timed m");
+    for (size_t i = 0; i < ARRAY_SIZE(dt_intervals); i++) {
+        bench_dt_t *d = &report->dt[i];
+        printf("%9.2f %12.3f %12.3f\n", d->dt, d->fixed_rms, d->timed_rms);
+    }
+    printf("(rms spread of the motion model after %.0f s, fixed step per update "
+        "or scaled by the interval)\n", BENCH_DT_TIME_S);
+
+    printf("\n%9s %12s %12s %12s\n", "slow s", "all sets/s", "partial/s", "partial aps");
+    for (size_t i = 0; i < ARRAY_SIZE(slow_periods); i++) {
+        bench_partial_t *pa = &report->partial[i];
+        printf("%9.1f %12.3f %12.3f %12.2f\n", pa->slow_period, pa->all_rate, 
+            pa->partial_rate, pa->partial_aps);
+    }
+    printf("(measurement sets of a node when one AP reports slower, 0 is offline, "
+        "waiting for every AP or at least %d)\n", NODE_MIN_APS);
+
+    printf("\n%9s %12s %12s %12s\n", "slow s", "set wait ms", "set us", "stream us");
+    for (size_t i = 0; i < ARRAY_SIZE(slow_periods); i++) {
+        bench_stream_t *st = &report->stream[i];
+        printf("%9.1f %12.1f %12.2f %12.2f\n", st->slow_period, st->set_latency_ms, 
+            st->set_us, st->stream_us);
+    }
+    printf("(time a measurement waits for its set, and compute per measurement "
+        "with sets or streamed, %d particles)\n", PARTICLE_SET);
+
+    printf("\n%9s %12s %12s\n", "updates", "cold m", "warm m");
+    for (size_t i = 0; i < ARRAY_SIZE(warm_updates); i++) {
+        bench_warm_t *w = &report->warm[i];
+        printf("%9d %12.3f %12.3f\n", w->updates, w->cold_err, w->warm_err);
+    }
+    printf("(mean error of %d tracks from a fresh filter, uniform or seeded "
+        "around a trilateration)\n", BENCH_WARM_TRIALS);
+
+    bench_snapshot_t *sn = &report->snapshot;
+    printf("\n%9s %12s %12s %12s %12s %12s %8s\n", "nodes", "bytes", "pack us", "save us", 
+        "load us", "unpack us", "match");
+    printf("%9d %12zu %12.1f %12.1f %12.1f %12.1f %8s\n", sn->nodes, sn->bytes, sn->pack_us, 
+        sn->save_us, sn->load_us, sn->unpack_us, sn->match ? "yes" : "no");
+    printf("(payload of a full node table of %d particles per node, the lock is held "
+        "while packing)\n", PARTICLE_SET);
+
+    printf("\n%9s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s\n", "noise m", 
+        "pf us", "pf m", "lsq us", "lsq m", "lsq rms m", "ekf us", "ekf m", "ekf sd m", 
+        "grid us", "grid m", "grid sd m");
+    for (size_t i = 0; i < ARRAY_SIZE(engine_noises); i++) {
+        bench_engine_t *e = &report->engine[i];
+        printf("%9.2f %12.2f %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12.2f %12.3f "
+            "%12.3f\n", e->noise, e->pf_us, e->pf_err, e->lsq_us, e->lsq_err, e->lsq_rms, 
+            e->ekf_us, e->ekf_err, e->ekf_sd, e->grid_us, e->grid_err, e->grid_sd);
+    }
+    printf("(time per update and mean error of each engine on %d replayed tracks of %d updates, "
+        "grid of %.2f m cells)\n", BENCH_ENGINE_TRACKS, BENCH_ENGINE_UPDATES, GRID_CELL_SIZE);
+
+    printf("\n%9s %9s %9s %12s %12s %12s %12s\n", "area m", "cell m", "cells", "bytes", 
+        "update us", "Mcells/s", "us/cell");
+    for (size_t i = 0; i < ARRAY_SIZE(grid_sizes); i++) {
+        bench_grid_t *g = &report->grid[i];
+        printf("%6.0fx%-2.0f %9.2f %9d %12zu %12.2f %12.1f %12.4f\n", g->area_x, g->area_y, 
+            g->cell, g->cells, g->bytes, g->update_us, g->cells_per_s / 1e6, 
+            g->update_us / g->cells);
+    }
+    printf("(full updates of the grid filter with %d APs, one second apart)\n", BENCH_GRID_APS);
+}
+
+/**
+ * \brief Print the results as JSON.
+ * 
+ * \param report Results of all benchmarks.
+ */
+static void 
+bench_print_json(bench_report_t *report)
+{
+    bench_result_t *results = report->results;
+    printf("{\n  \"rng_ns_per_draw\": {");
+    for (int g = 0; g < BENCH_RNG_COUNT; g++)
+        printf("%s\"%s\": %.3f", (g > 0) ? ", " : "", rng_names[g], report->rng_ns[g]);
+    printf("},\n  \"layout\": \"%s\",\n", layout_name);
+    printf("  \"lut\": {\"cols\": %d, \"rows\": %d, \"bytes\": %zu, \"bytes_per_ap\": %zu},\n", 
+        report->lut_cols, report->lut_rows, report->lut_bytes, 
+        (size_t)report->lut_cols * report->lut_rows * sizeof(float));
+    printf("  \"unit\": \"ns/particle\",\n  \"results\": [\n");
+    for (int i = 0; i < report->count; i++) {
+        printf("    {\"particles\": %d, \"aps\": %d, \"stages\": {", 
+            results[i].particles, results[i].aps);
+        for (int s = 0; s < BENCH_STAGE_COUNT; s++)
+            printf("%s\"%s\": %.3f", (s > 0) ? ", " : "", stage_names[s], 
+                results[i].ns_per_particle[s]);
+        printf("}, \"update_ns\": %.1f, \"updates_per_sec\": %.3f}%s\n", 
+            results[i].update_ns, 1e9 / results[i].update_ns, 
+            (i < report->count - 1) ? "," : "");
+    }
+    printf("  ],\n  \"threads\": %d,\n  \"update\": [\n", report->threads);
+    for (size_t i = 0; i < ARRAY_SIZE(update_counts); i++) {
+        bench_update_t *u = &report->updates[i];
+        printf("    {\"particles\": %d, \"serial_ns\": %.1f, \"pool_ns\": %.1f}%s\n", 
+            u->particles, u->serial_ns, u->pool_ns, 
+            (i < ARRAY_SIZE(update_counts) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"resample\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(resample_counts); i++) {
+        bench_resample_t *res = &report->resample[i];
+        printf("    {\"particles\": %d", res->particles);
+        for (int r = 0; r < PARTICLE_RESAMPLE_COUNT; r++) {
+            printf(", \"%s\": {\"ns_per_particle\": %.3f, \"count_mse\": %.5f}", 
+                resampler_names[r], res->ns_per_particle[r], res->count_mse[r]);
+        }
+        printf("}%s\n", (i < ARRAY_SIZE(resample_counts) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"kld\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(kld_counts); i++) {
+        bench_kld_t *k = &report->kld[i];
+        printf("    {\"particles\": %d, \"fixed_ns\": %.1f, \"kld_ns\": %.1f, "
+            "\"kld_particles\": %.1f}%s\n", k->particles, k->fixed_ns, k->kld_ns, 
+            k->kld_particles, (i < ARRAY_SIZE(kld_counts) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"log_weights\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(log_vars); i++) {
+        bench_log_t *l = &report->log[i];
+        printf("    {\"ap_measurement_var\": %.3f, \"linear_ns\": %.1f, \"log_ns\": %.1f, "
+            "\"linear_collapsed\": %d, \"log_collapsed\": %d}%s\n", l->ap_measurement_var, 
+            l->linear_ns, l->log_ns, l->linear_collapsed, l->log_collapsed, 
+            (i < ARRAY_SIZE(log_vars) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"heading\": {\"trig_ns\": %.3f, \"vector_ns\": %.3f, \"rms_deg\": %.4f, "
+        "\"norm_err\": %.3e},\n", report->heading.trig_ns, report->heading.vector_ns, 
+        report->heading.rms_deg, report->heading.norm_err);
+    printf("  \"dt\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(dt_intervals); i++) {
+        bench_dt_t *d = &report->dt[i];
+        printf("    {\"dt\": %.3f, \"fixed_rms\": %.4f, \"timed_rms\": %.4f}%s\n", d->dt, 
+            d->fixed_rms, d->timed_rms, (i < ARRAY_SIZE(dt_intervals) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"partial\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(slow_periods); i++) {
+        bench_partial_t *pa = &report->partial[i];
+        printf("    {\"slow_period\": %.1f, \"all_rate\": %.4f, \"partial_rate\": %.4f, "
+            "\"partial_aps\": %.3f}%s\n", pa->slow_period, pa->all_rate, pa->partial_rate, 
+            pa->partial_aps, (i < ARRAY_SIZE(slow_periods) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"stream\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(slow_periods); i++) {
+        bench_stream_t *st = &report->stream[i];
+        printf("    {\"slow_period\": %.1f, \"set_latency_ms\": %.2f, \"set_us\": %.3f, "
+            "\"stream_us\": %.3f}%s\n", st->slow_period, st->set_latency_ms, st->set_us, 
+            st->stream_us, (i < ARRAY_SIZE(slow_periods) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"warm_start\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(warm_updates); i++) {
+        bench_warm_t *w = &report->warm[i];
+        printf("    {\"updates\": %d, \"cold_err\": %.4f, \"warm_err\": %.4f}%s\n", 
+            w->updates, w->cold_err, w->warm_err, 
+            (i < ARRAY_SIZE(warm_updates) - 1) ? "," : "");
+    }
+    bench_snapshot_t *sn = &report->snapshot;
+    printf("  ],\n  \"snapshot\": {\"nodes\": %d, \"bytes\": %zu, \"pack_us\": %.2f, "
+        "\"save_us\": %.2f, \"load_us\": %.2f, \"unpack_us\": %.2f, \"match\": %s},\n", 
+        sn->nodes, sn->bytes, sn->pack_us, sn->save_us, sn->load_us, sn->unpack_us, 
+        sn->match ? "true" : "false");
+    printf("  \"engines\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(engine_noises); i++) {
+        bench_engine_t *e = &report->engine[i];
+        printf("    {\"noise\": %.2f, \"particle\": {\"us\": %.3f, \"err\": %.4f}, "
+            "\"lsq\": {\"us\": %.3f, \"err\": %.4f, \"rms\": %.4f}, "
+            "\"ekf\": {\"us\": %.3f, \"err\": %.4f, \"sd\": %.4f}, "
+            "\"grid\": {\"us\": %.3f, \"err\": %.4f, \"sd\": %.4f}}%s\n", e->noise, 
+            e->pf_us, e->pf_err, e->lsq_us, e->lsq_err, e->lsq_rms, e->ekf_us, e->ekf_err, 
+            e->ekf_sd, e->grid_us, e->grid_err, e->grid_sd, 
+            (i < ARRAY_SIZE(engine_noises) - 1) ? "," : "");
+    }
+    printf("  ],\n  \"grid\": [\n");
+    for (size_t i = 0; i < ARRAY_SIZE(grid_sizes); i++) {
+        bench_grid_t *g = &report->grid[i];
+        printf("    {\"area_x\": %.1f, \"area_y\": %.1f, \"cell\": %.3f, \"cells\": %d, "
+            "\"bytes\": %zu, \"update_us\": %.3f, \"cells_per_s\": %.0f}%s\n", g->area_x, 
+            g->area_y, g->cell, g->cells, g->bytes, g->update_us, g->cells_per_s, 
+            (i < ARRAY_SIZE(grid_sizes) - 1) ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+static void 
+bench_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--json] [--time <seconds per stage>] [--seed <seed>] "
+        "[--threads <workers>]\n", name);
+}
+
+int 
+main(int argc, char **argv)
+{
+    int json = 0;
+    double min_time = BENCH_MIN_TIME_S;
+    uint64_t seed = BENCH_SEED;
+    int threads = BENCH_THREADS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            min_time = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            bench_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ble_rng_seed(&rng, seed);
+
+    bench_report_t report = {.threads = threads};
+    ble_lut_t *lut = ble_lut_create(AREA_X, AREA_Y, LUT_RESOLUTION, 1, LUT_BILINEAR);
+    if (lut == NULL)
+        return EXIT_FAILURE;
+    report.lut_bytes = ble_lut_footprint(lut);
+    report.lut_cols = lut->cols;
+    report.lut_rows = lut->rows;
+    ble_lut_destroy(lut);
+    bench_measure_rng(report.rng_ns, min_time);
+
+    report.count = ARRAY_SIZE(particle_counts) * ARRAY_SIZE(ap_counts);
+    report.results = calloc(report.count, sizeof(bench_result_t));
+    if (report.results == NULL)
+        return EXIT_FAILURE;
+
+    int idx = 0;
+    for (size_t p = 0; p < ARRAY_SIZE(particle_counts); p++) {
+        for (size_t a = 0; a < ARRAY_SIZE(ap_counts); a++) {
+            report.results[idx].particles = particle_counts[p];
+            report.results[idx].aps = ap_counts[a];
+            if (bench_measure(&report.results[idx], min_time) != 0) {
+                fprintf(stderr, "benchmark failed for %d particles, %d aps\n", 
+                    particle_counts[p], ap_counts[a]);
+                free(report.results);
+                return EXIT_FAILURE;
+            }
+            idx++;
+        }
+    }
+
+    ble_pool_t *pool = ble_pool_create(threads);
+    if (pool == NULL) {
+        free(report.results);
+        return EXIT_FAILURE;
+    }
+    for (size_t p = 0; p < ARRAY_SIZE(update_counts); p++) {
+        bench_update_t *u = &report.updates[p];
+        u->particles = update_counts[p];
+        u->serial_ns = bench_measure_update(update_counts[p], NULL, min_time);
+        u->pool_ns = bench_measure_update(update_counts[p], pool, min_time);
+        if (u->serial_ns < 0 || u->pool_ns < 0) {
+            fprintf(stderr, "update benchmark failed for %d particles\n", update_counts[p]);
+            ble_pool_destroy(pool);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+    ble_pool_destroy(pool);
+
+    for (size_t p = 0; p < ARRAY_SIZE(resample_counts); p++) {
+        report.resample[p].particles = resample_counts[p];
+        if (bench_measure_resample(&report.resample[p], min_time) != 0) {
+            fprintf(stderr, "resample benchmark failed for %d particles\n", 
+                resample_counts[p]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t p = 0; p < ARRAY_SIZE(kld_counts); p++) {
+        report.kld[p].particles = kld_counts[p];
+        if (bench_measure_kld(&report.kld[p]) != 0) {
+            fprintf(stderr, "kld benchmark failed for %d particles\n", kld_counts[p]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t v = 0; v < ARRAY_SIZE(log_vars); v++) {
+        report.log[v].ap_measurement_var = log_vars[v];
+        if (bench_measure_log(&report.log[v]) != 0) {
+            fprintf(stderr, "log-weight benchmark failed for variance %.3f\n", log_vars[v]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (bench_measure_heading(&report.heading) != 0) {
+        fprintf(stderr, "heading benchmark failed\n");
+        free(report.results);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t d = 0; d < ARRAY_SIZE(dt_intervals); d++) {
+        report.dt[d].dt = dt_intervals[d];
+        if (bench_measure_dt(&report.dt[d]) != 0) {
+            fprintf(stderr, "motion model benchmark failed for dt %.2f\n", dt_intervals[d]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t p = 0; p < ARRAY_SIZE(slow_periods); p++) {
+        report.partial[p].slow_period = slow_periods[p];
+        if (bench_measure_partial(&report.partial[p]) != 0) {
+            fprintf(stderr, "partial set benchmark failed for interval %.1f\n", 
+                slow_periods[p]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+        report.stream[p].slow_period = slow_periods[p];
+        if (bench_measure_stream(&report.stream[p]) != 0) {
+            fprintf(stderr, "streaming benchmark failed for interval %.1f\n", 
+                slow_periods[p]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (bench_measure_warm(report.warm) != 0) {
+        fprintf(stderr, "warm start benchmark failed\n");
+        free(report.results);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_measure_snapshot(&report.snapshot) != 0) {
+        fprintf(stderr, "snapshot benchmark failed\n");
+        free(report.results);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t n = 0; n < ARRAY_SIZE(engine_noises); n++) {
+        report.engine[n].noise = engine_noises[n];
+        if (bench_measure_engines(&report.engine[n]) != 0) {
+            fprintf(stderr, "engine benchmark failed for noise %.2f\n", engine_noises[n]);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t g = 0; g < ARRAY_SIZE(grid_sizes); g++) {
+        report.grid[g].area_x = grid_sizes[g].x;
+        report.grid[g].area_y = grid_sizes[g].y;
+        report.grid[g].cell = grid_sizes[g].cell;
+        if (bench_measure_grid(&report.grid[g], min_time) != 0) {
+            fprintf(stderr, "grid benchmark failed for cell %.2f\n", grid_sizes[g].cell);
+            free(report.results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (json)
+        bench_print_json(&report);
+    else
+        bench_print_table(&report);
+    free(report.results);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * host/include/freertos/semphr.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+// native replacement of the FreeRTOS mutex semaphore using pthreads
+// only blocking forever or polling (0 ticks) are supported
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+
+/**
+ * \brief Create a mutex semaphore.
+ * 
+ * \return Handle to the mutex, NULL on error.
+ */
+static inline SemaphoreHandle_t 
+xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t mutex = malloc(sizeof(pthread_mutex_t));
+    if (mutex == NULL)
+        return NULL;
+    if (pthread_mutex_init(mutex, NULL) != 0) {
+        free(mutex);
+        return NULL;
+    }
+    return mutex;
+}
+
+/**
+ * \brief Take the mutex semaphore.
+ * 
+ * \param mutex Handle to the mutex.
+ * \param ticks 0 to poll, any other value blocks until the mutex is available.
+ * 
+ * \return pdTRUE when the mutex was taken, pdFALSE otherwise.
+ */
+static inline BaseType_t 
+xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks)
+{
+    if (ticks == 0)
+        return (pthread_mutex_trylock(mutex) == 0) ? pdTRUE : pdFALSE;
+    return (pthread_mutex_lock(mutex) == 0) ? pdTRUE : pdFALSE;
+}
+
+/**
+ * \brief Give back the mutex semaphore.
+ * 
+ * \param mutex Handle to the mutex.
+ * 
+ * \return pdTRUE on success, pdFALSE otherwise.
+ */
+static inline BaseType_t 
+xSemaphoreGive(SemaphoreHandle_t mutex)
+{
+    return (pthread_mutex_unlock(mutex) == 0) ? pdTRUE : pdFALSE;
+}
+
+/**
+ * \brief Delete the mutex semaphore.
+ * 
+ * \param mutex Handle to the mutex.
+ */
+static inline void 
+vSemaphoreDelete(SemaphoreHandle_t mutex)
+{
+    pthread_mutex_destroy(mutex);
+    free(mutex);
+}
+
+#endif
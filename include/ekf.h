@@ -0,0 +1,79 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/ekf.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EKF_H
+#define EKF_H
+
+#include <stdint.h>
+
+#include "particle.h"
+#include "snapshot.h"
+
+// state of the tracker, a constant velocity model
+#define EKF_STATES              4
+#define EKF_X                   0
+#define EKF_Y                   1
+#define EKF_VX                  2
+#define EKF_VY                  3
+
+// variance of the (white) acceleration of the node in m^2/s^4, the process noise
+#define EKF_ACCEL_VAR           0.25
+// variance of a single AP distance in m^2, the measurement noise
+#define EKF_RANGE_VAR           0.09
+// variance of the velocity in m^2/s^2 before the first update
+#define EKF_INIT_VEL_VAR        0.25
+// innovations beyond this many standard deviations count as this many,
+// so a single bad distance moves the state a bounded amount
+#define EKF_GATE                3.0
+
+// extended Kalman filter of the position and velocity of a node,
+// every AP distance is a scalar measurement update, as the RSSI filters in rssi.c
+typedef struct {
+    // area, AP ages and time steps are used, see ble_particle_config_t
+    ble_particle_config_t cfg;
+    // x, y, vx, vy
+    float x[EKF_STATES];
+    // covariance of the state
+    float p[EKF_STATES][EKF_STATES];
+    // latest measurement of every AP, see ble_ekf_observe
+    ble_particle_ap_t aps[NO_OF_APS];
+    int ap_count;
+    // the state was initialized from a trilateration since the last reset,
+    // before that it is the center of the area with the variance of a uniform spread
+    int initialized;
+    // timestamp of the last predict, 0 before the first one
+    int64_t last_us;
+} ble_ekf_t;
+
+void ble_ekf_init(ble_ekf_t *ekf, const ble_particle_config_t *cfg);
+void ble_ekf_reset(ble_ekf_t *ekf);
+int ble_ekf_predict(ble_ekf_t *ekf, int64_t timestamp_us);
+int ble_ekf_update(ble_ekf_t *ekf, ble_particle_data_t *data);
+int ble_ekf_observe(ble_ekf_t *ekf, const ble_particle_ap_t *ap, ble_particle_data_t *data);
+float ble_ekf_position_sd(const ble_ekf_t *ekf);
+void ble_ekf_pack(const ble_ekf_t *ekf, ble_snapshot_t *s);
+int ble_ekf_unpack(ble_ekf_t *ekf, ble_snapshot_t *s);
+
+#endif
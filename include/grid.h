@@ -0,0 +1,94 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/grid.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lut.h"
+#include "particle.h"
+#include "snapshot.h"
+
+// side of a cell of the belief grid in meters
+#define GRID_CELL_SIZE          0.1
+// variance of a single AP distance in m^2, the measurement noise
+#define GRID_RANGE_VAR          0.09
+// residuals beyond this many standard deviations count as this many,
+// so a single bad distance can not rule out the whole belief
+#define GRID_GATE               3.0
+// smallest probability of a cell, keeps the belief far from the node out of the
+// denormal floats, which are slow on x86, and lets the belief recover from a wrong peak
+#define GRID_MIN_BELIEF         1e-20
+// largest half-width of the motion kernel in cells, wider blurs are cut off
+#define GRID_MAX_RADIUS         32
+// the motion kernel reaches this many standard deviations
+#define GRID_KERNEL_SD          3.0
+
+// histogram Bayes filter, a discretised belief over the area
+// the belief has a value for every grid point of the AP distance lookup table (lut.h),
+// so the likelihood of a cell is a lookup per AP and no square root
+typedef struct {
+    // area, motion model, AP ages and time steps are used, see ble_particle_config_t
+    ble_particle_config_t cfg;
+    float cell_size;
+    int cols;
+    int rows;
+    // probability of every cell, row-major, sums to 1
+    float *belief;
+    // squared residuals of the likelihood, then the horizontal pass of the motion model
+    float *scratch;
+    // a row or a column of the belief with the border cells repeated radius times on both sides
+    float *pad;
+    // distance from every AP to every cell, owned by the grid
+    ble_lut_t *lut;
+    // diagonal of the area, the lookup table holds distances divided by it
+    float area_diag;
+    // Gaussian motion kernel of 2 * radius + 1 taps, kept for the time step it was built for
+    float kernel[(2 * GRID_MAX_RADIUS) + 1];
+    int radius;
+    float kernel_dt;
+    // latest measurement of every AP, see ble_grid_observe
+    ble_particle_ap_t aps[NO_OF_APS];
+    int ap_count;
+    // timestamp of the last predict, 0 before the first one
+    int64_t last_us;
+    // mean and standard deviation of the belief after the last update
+    ble_particle_node_t estimate;
+    float sd;
+} ble_grid_t;
+
+ble_grid_t *ble_grid_create(const ble_particle_config_t *cfg, float cell_size);
+void ble_grid_reset(ble_grid_t *grid);
+int ble_grid_predict(ble_grid_t *grid, int64_t timestamp_us);
+int ble_grid_update(ble_grid_t *grid, ble_particle_data_t *data);
+int ble_grid_observe(ble_grid_t *grid, const ble_particle_ap_t *ap, ble_particle_data_t *data);
+size_t ble_grid_footprint(const ble_grid_t *grid);
+void ble_grid_pack(const ble_grid_t *grid, ble_snapshot_t *s);
+int ble_grid_unpack(ble_grid_t *grid, ble_snapshot_t *s);
+void ble_grid_destroy(ble_grid_t *grid);
+
+#endif
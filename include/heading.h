@@ -0,0 +1,103 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/heading.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HEADING_H
+#define HEADING_H
+
+#include <math.h>
+
+// amount of directions of the heading table, a power of two
+// 256 steps of 1.4 degrees, the rounding error of a turn is at most 0.7 degrees
+#define HEADING_STEPS           256
+// sine of every step, the last quarter repeats so the cosine is a shifted lookup
+#define HEADING_TABLE_SIZE      (HEADING_STEPS + (HEADING_STEPS / 4))
+
+// sin(2 * pi * k / HEADING_STEPS)
+extern const float ble_heading_table[HEADING_TABLE_SIZE];
+
+/**
+ * \brief Round an angle to the nearest step of the heading table.
+ * 
+ * \param angle Angle in radians, may be negative or beyond 2 * pi.
+ * 
+ * \return Step in [0..HEADING_STEPS).
+ */
+static inline int 
+ble_heading_step(float angle)
+{
+    float f = angle * (float)(HEADING_STEPS / (2.0 * M_PI));
+    // round half away from zero without a library call,
+    // the mask wraps negative steps as the table is a power of two
+    int k = (int)(f + ((f < 0) ? -0.5F : 0.5F));
+    return k & (HEADING_STEPS - 1);
+}
+
+/**
+ * \brief Cosine of a step of the heading table.
+ * 
+ * \param k Step in [0..HEADING_STEPS).
+ * 
+ * \return cos(2 * pi * k / HEADING_STEPS).
+ */
+static inline float 
+ble_heading_cos(int k)
+{
+    return ble_heading_table[k + (HEADING_STEPS / 4)];
+}
+
+/**
+ * \brief Sine of a step of the heading table.
+ * 
+ * \param k Step in [0..HEADING_STEPS).
+ * 
+ * \return sin(2 * pi * k / HEADING_STEPS).
+ */
+static inline float 
+ble_heading_sin(int k)
+{
+    return ble_heading_table[k];
+}
+
+/**
+ * \brief Rotate a unit heading vector by a step of the heading table,
+ * and pull its length back to 1 with a Newton step of 1 / sqrt,
+ * so rounding errors of repeated rotations do not build up.
+ * 
+ * \param hx Cosine of the heading.
+ * \param hy Sine of the heading.
+ * \param k Step to rotate by.
+ */
+static inline void 
+ble_heading_rotate(float *hx, float *hy, int k)
+{
+    float c = ble_heading_cos(k), s = ble_heading_sin(k);
+    float x = (*hx * c) - (*hy * s);
+    float y = (*hx * s) + (*hy * c);
+    float g = 1.5F - (0.5F * ((x * x) + (y * y)));
+    *hx = x * g;
+    *hy = y * g;
+}
+
+#endif
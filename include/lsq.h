@@ -0,0 +1,68 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/lsq.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LSQ_H
+#define LSQ_H
+
+#include "particle.h"
+#include "snapshot.h"
+
+// Gauss-Newton iterations of a fix, and the step in meters below which it has converged
+#define LSQ_MAX_ITERATIONS      10
+#define LSQ_TOLERANCE           1e-3
+// at least this many APs give a fix, fewer keep the previous one
+#define LSQ_MIN_APS             2
+// residual in meters beyond which a distance counts less (Huber), 0 disables
+#define LSQ_HUBER_K             0.3
+// Levenberg damping relative to the trace of the normal equations,
+// keeps the step finite when the APs are in line with the node
+#define LSQ_DAMPING             1e-3
+
+// iterative weighted least-squares (Gauss-Newton) multilateration,
+// a low-cost alternative to the particle filter without a motion model
+typedef struct {
+    // area, AP ages and measurement noise are used, see ble_particle_config_t
+    ble_particle_config_t cfg;
+    // latest measurement of every AP, see ble_lsq_observe
+    ble_particle_ap_t aps[NO_OF_APS];
+    int ap_count;
+    // last fix, the starting point of the next one, the center of the area before the first
+    ble_particle_node_t fix;
+    int has_fix;
+    // quality of the last fix, the rms difference in meters between the measured distances
+    // and the distances from the fix to the APs
+    float rms;
+    // Gauss-Newton iterations of the last fix
+    int iterations;
+} ble_lsq_t;
+
+void ble_lsq_init(ble_lsq_t *lsq, const ble_particle_config_t *cfg);
+void ble_lsq_reset(ble_lsq_t *lsq);
+int ble_lsq_update(ble_lsq_t *lsq, ble_particle_data_t *data);
+int ble_lsq_observe(ble_lsq_t *lsq, const ble_particle_ap_t *ap, ble_particle_data_t *data);
+void ble_lsq_pack(const ble_lsq_t *lsq, ble_snapshot_t *s);
+int ble_lsq_unpack(ble_lsq_t *lsq, ble_snapshot_t *s);
+
+#endif
@@ -0,0 +1,114 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/lut.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LUT_H
+#define LUT_H
+
+#include <stddef.h>
+
+#include "util.h"
+
+// grid spacing of the distance lookup table in meters
+#define LUT_RESOLUTION          0.05
+// largest amount of APs the weighting kernel looks up at once
+#define LUT_MAX_APS             32
+#define LUT_ID_NONE             -1
+
+typedef enum {
+    // value of the closest grid point, one load per lookup
+    LUT_NEAREST,
+    // interpolate between the four surrounding grid points
+    LUT_BILINEAR
+} ble_lut_interp_t;
+
+typedef struct {
+    // AP the plane was built for
+    int id;
+    float x;
+    float y;
+    // lookup counter at the last use, the least recently used plane is rebuilt first
+    unsigned int used;
+} ble_lut_plane_t;
+
+// normalized distance from every AP to the points of a grid over the area,
+// so the weighting kernel needs no square root per particle and AP
+// a plane is built once for every AP and rebuilt when the AP moves
+typedef struct {
+    int cols;
+    int rows;
+    float area_x;
+    float area_y;
+    float inv_res;
+    ble_lut_interp_t interp;
+    int plane_count;
+    ble_lut_plane_t *planes;
+    unsigned int tick;
+    // plane_count planes of rows x cols distances, row-major
+    float *dist;
+} ble_lut_t;
+
+ble_lut_t *ble_lut_create(float area_x, float area_y, float resolution, int planes, 
+    ble_lut_interp_t interp);
+int ble_lut_plane(ble_lut_t *lut, int id, float x, float y);
+size_t ble_lut_footprint(const ble_lut_t *lut);
+void ble_lut_destroy(ble_lut_t *lut);
+
+/**
+ * \brief Look up the normalized distance from the AP of a plane to a position.
+ * Positions outside the area are clamped to its border.
+ * 
+ * \param lut Lookup table.
+ * \param plane Plane of the AP, see ble_lut_plane.
+ * \param x X coordinate in meters.
+ * \param y Y coordinate in meters.
+ * 
+ * \return Distance divided by the diagonal of the area.
+ */
+static inline float 
+ble_lut_sample(const ble_lut_t *lut, int plane, float x, float y)
+{
+    const float *dist = lut->dist + ((size_t)plane * lut->rows * lut->cols);
+    x = ble_util_clamp(x, 0, lut->area_x);
+    y = ble_util_clamp(y, 0, lut->area_y);
+    float fx = x * lut->inv_res, fy = y * lut->inv_res;
+
+    if (lut->interp == LUT_NEAREST) {
+        int ix = (int)(fx + 0.5F), iy = (int)(fy + 0.5F);
+        ix = (ix > lut->cols - 1) ? (lut->cols - 1) : ix;
+        iy = (iy > lut->rows - 1) ? (lut->rows - 1) : iy;
+        return dist[(iy * lut->cols) + ix];
+    }
+    // the grid has at least two points per axis
+    int ix = (int)fx, iy = (int)fy;
+    ix = (ix > lut->cols - 2) ? (lut->cols - 2) : ix;
+    iy = (iy > lut->rows - 2) ? (lut->rows - 2) : iy;
+    float tx = fx - (float)ix, ty = fy - (float)iy;
+    const float *p = dist + (iy * lut->cols) + ix;
+    float top = p[0] + (tx * (p[1] - p[0]));
+    float bottom = p[lut->cols] + (tx * (p[lut->cols + 1] - p[lut->cols]));
+    return top + (ty * (bottom - top));
+}
+
+#endif
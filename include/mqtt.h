@@ -30,9 +30,13 @@
 
 #include "config.h"
 #include "particle.h"
+#include "pool.h"
+#include "node.h"
 
 #define AP_TOPIC        "ap"
 #define NODE_TOPIC      "node"
+// switches the engine of a node at runtime, format: [node,engine], see ble_node_engine_t
+#define ENGINE_TOPIC    "engine"
 #define KEEPALIVE       60
 #define RECONNECT       1000
 #define NETWORK_TIMEOUT 20000
@@ -40,8 +44,33 @@
 #define RECONNECT_MAX   3
 
 #define PF_TASK_NAME    "Update particle filter"
-#define PF_TASK_SIZE    90000
+// particles live on the heap, the stack only holds printing and publishing
+#define PF_TASK_SIZE    8192
 #define PF_TASK_PRIO    10
+// weight every AP measurement as soon as it arrives, instead of waiting for a set,
+// the motion model of every node then runs every PF_PREDICT_MS
+#define PF_STREAMING    0
+#define PF_PREDICT_MS   1000
+// a measurement of every AP for every node
+#define PF_QUEUE_LENGTH (NO_OF_APS * NODE_TABLE_SIZE)
+// log the amount of dropped measurements every this many drops
+#define PF_DROP_LOG     100
+// the update task is worker 0 of the filter pool, see pool.h
+#define PF_TASK_CORE    POOL_CORE
+// one worker per core, every core updates part of the particles
+#define PF_WORKERS      portNUM_PROCESSORS
+// weight with a distance lookup table, see lut.h, instead of calculating the distances
+// off by default: on x86 the lookup is slower than the exact distance, whose sqrtf vectorizes,
+// enable it once ble_bench measures weight_lut faster than weight on the ESP32
+#define PF_LUT          0
+// KLD-sampling lowers the amount of particles down to this when a node is well localised
+#define PF_MIN_PARTICLES 50
+
+// writes the filter state every SNAPSHOT_INTERVAL_MS, see snapshot.h
+#define SNAPSHOT_TASK_NAME  "Write snapshot"
+#define SNAPSHOT_TASK_SIZE  4096
+// below the update task, writing flash never delays an update
+#define SNAPSHOT_TASK_PRIO  1
 
 typedef enum {
     MQTT_STATE_DISCONNECTED,
@@ -56,7 +85,9 @@ typedef enum {
 
 #ifdef HOST
 void ble_mqtt_set_task(ble_mqtt_task_t task);
-void ble_mqtt_store_ap_data(ble_particle_ap_t data);
+void ble_mqtt_store_ap_data(int node_id, ble_particle_ap_t data);
+unsigned int ble_mqtt_get_dropped(void);
+int ble_mqtt_set_node_engine(int node_id, ble_node_engine_t engine);
 #endif
 
 void ble_mqtt_init(void);
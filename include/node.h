@@ -0,0 +1,112 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/node.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef NODE_H
+#define NODE_H
+
+#include <stdint.h>
+
+#include "particle.h"
+#include "lsq.h"
+#include "ekf.h"
+#include "grid.h"
+#include "pool.h"
+#include "lut.h"
+
+// node IDs advertised after INSTANCE_PREFIX, in range 0 to NODE_ID_COUNT - 1
+#define NODE_ID_COUNT           10
+// maximum amount of nodes tracked at the same time
+// the least recently seen node is evicted when a new node shows up
+#define NODE_TABLE_SIZE         8
+#define NODE_ID_NONE            -1
+// a set of AP measurements completes once every AP reported, or once at least
+// NODE_MIN_APS reported and the first measurement is NODE_SET_WINDOW_US old,
+// so a slow or offline AP does not hold back the updates
+#define NODE_MIN_APS            2
+#define NODE_SET_WINDOW_US      1000000
+// position engine of new nodes, see ble_node_engine_t
+#define NODE_ENGINE             NODE_ENGINE_PARTICLE
+
+// estimator that tracks a node
+typedef enum {
+    // particle filter, see particle.h
+    NODE_ENGINE_PARTICLE,
+    // least-squares multilateration of every set, see lsq.h
+    NODE_ENGINE_LSQ,
+    // extended Kalman filter with a constant velocity model, see ekf.h
+    NODE_ENGINE_EKF,
+    // histogram filter over a grid of cells, see grid.h
+    NODE_ENGINE_GRID,
+    NODE_ENGINE_COUNT
+} ble_node_engine_t;
+
+typedef struct {
+    int id;
+    int64_t last_seen_us;
+    // AP measurements received since the last update
+    ble_particle_ap_t aps[NO_OF_APS];
+    int ap_count;
+    // time of the first measurement since the last update
+    int64_t first_us;
+    // complete measurement set and position estimate
+    ble_particle_data_t data;
+    ble_node_engine_t engine;
+    // particle filter, only allocated for NODE_ENGINE_PARTICLE
+    ble_particle_filter_t *pf;
+    ble_lsq_t lsq;
+    ble_ekf_t ekf;
+    // belief grid, only allocated for NODE_ENGINE_GRID
+    ble_grid_t *grid;
+    // data holds a measurement set that is waiting for an update
+    int pending;
+} ble_node_t;
+
+typedef struct {
+    ble_node_t nodes[NODE_TABLE_SIZE];
+    ble_particle_config_t cfg;
+    // engine of new nodes, NODE_ENGINE by default
+    ble_node_engine_t engine;
+    // cell size of the grids of new grid engines, GRID_CELL_SIZE by default
+    float grid_cell_size;
+    // pool and distance lookup table used by the filter of every node, may be NULL
+    ble_pool_t *pool;
+    ble_lut_t *lut;
+    unsigned int evictions;
+    // measurement sets replaced by a newer set, or lost on eviction, before an update
+    unsigned int dropped;
+} ble_node_table_t;
+
+void ble_node_table_init(ble_node_table_t *table, const ble_particle_config_t *cfg, 
+    ble_pool_t *pool, ble_lut_t *lut);
+void ble_node_table_free(ble_node_table_t *table);
+ble_node_t *ble_node_table_get(ble_node_table_t *table, int id, int64_t now_us);
+int ble_node_set_engine(ble_node_table_t *table, ble_node_t *node, ble_node_engine_t engine);
+int ble_node_store_ap_data(ble_node_t *node, ble_particle_ap_t data);
+int ble_node_update(ble_node_t *node, const ble_particle_ap_t *ap);
+void ble_node_table_predict(ble_node_table_t *table, int64_t now_us);
+int ble_node_table_pack(const ble_node_table_t *table, ble_snapshot_t *s);
+int ble_node_table_unpack(ble_node_table_t *table, ble_snapshot_t *s, int64_t now_us);
+
+#endif
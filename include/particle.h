@@ -26,6 +26,15 @@
 #ifndef PARTICLE_H
 #define PARTICLE_H
 
+#include <stdint.h>
+
+#include "rng.h"
+#include "pool.h"
+#include "lut.h"
+#include "heading.h"
+#include "snapshot.h"
+#include "config.h"
+
 #define PARTICLE_SET            400
 #define NO_OF_APS               4
 
@@ -33,9 +42,71 @@
 #define ORIENTATION_VAR         0.1
 #define POSITION_MEAN           0.2
 #define POSITION_VAR            0.02
+// the measurement of an AP counts less the longer it was taken before the set,
+// by exp(-age / AP_AGE_TAU), and not at all after AP_MAX_AGE, both in seconds
+#define AP_AGE_TAU              1.0
+#define AP_MAX_AGE              3.0
 
 #define RATIO_COEFFICIENT       0.95
 
+// interval between updates in seconds that the motion model parameters describe
+// the step and the noise of an update are scaled by the time since the previous one
+#define UPDATE_INTERVAL         1.0
+// longest time in seconds a single update catches up with after a delay
+#define PARTICLE_MAX_DT         5.0
+
+// default seed of the random number generator, 0 seeds from time and process id
+// any other value makes the filter reproducible
+#define PARTICLE_SEED           0
+// amount of particles processed at once by the predict and weight kernels
+#define PARTICLE_BLOCK          64
+// default resampling algorithm, see ble_particle_resampler_t
+#define PARTICLE_RESAMPLER      PARTICLE_RESAMPLE_SYSTEMATIC
+#define METROPOLIS_STEPS        16
+// KLD-sampling, adapts the amount of particles between PARTICLE_MIN_SET and PARTICLE_SET
+// 0 keeps the amount fixed
+#define PARTICLE_MIN_SET        0
+// bin size of the occupancy grid in meters
+#define KLD_BIN_SIZE            0.1
+// maximum KL divergence between the particles and the posterior
+#define KLD_EPSILON             0.05
+// upper quantile of the standard normal distribution for delta = 0.01
+#define KLD_Z                   2.326
+// keep per-particle log-weights, normalized with log-sum-exp
+// stays stable when sharp likelihoods or many APs underflow the linear weights
+#define PARTICLE_LOG_WEIGHTS    0
+// seed the particles around a trilateration of the first set of at least 3 APs,
+// as a Gaussian with the rms residual of the fix as deviation, but at least PARTICLE_WARM_SD
+// a fix with a deviation beyond the shorter side of the area keeps the uniform spread
+#define PARTICLE_WARM_START     1
+#define PARTICLE_WARM_SD        0.3
+// smallest determinant of the normal equations relative to their squared trace,
+// APs closer to a line than this give no trilateration
+#define TRILATERATE_MIN_DET     1e-3
+
+// memory layout of the particle set
+// AOS stores one struct per particle, SOA stores one aligned array per field
+// SOA lets the compiler vectorize the filter stages
+#define PARTICLE_LAYOUT_AOS     0
+#define PARTICLE_LAYOUT_SOA     1
+
+#ifndef PARTICLE_LAYOUT
+#define PARTICLE_LAYOUT         PARTICLE_LAYOUT_SOA
+#endif
+// alignment of the SOA arrays in bytes
+#define PARTICLE_ALIGN          64
+
+// orientation of a particle
+// ANGLE stores theta and calls cosf and sinf for every particle in every step
+// VECTOR stores the unit vector (cos(theta), sin(theta)) and turns it with 
+// the rotations of the heading table, so predict needs no trigonometry
+#define PARTICLE_HEADING_ANGLE  0
+#define PARTICLE_HEADING_VECTOR 1
+
+#ifndef PARTICLE_HEADING
+#define PARTICLE_HEADING        PARTICLE_HEADING_VECTOR
+#endif
+
 typedef enum {
     MOTION_STATE_STOP,
     MOTION_STATE_MOVING,
@@ -48,12 +119,57 @@ typedef struct {
             float x;
             float y;
         } pos;
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+        struct {
+            float x;
+            float y;
+        } heading;
+#else
         float theta;
+#endif
         ble_particle_motion_t motion;
     } state;
     float weight;
 } ble_particle_t;
 
+typedef struct {
+    int size;
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+    float *x;
+    float *y;
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+    float *hx;
+    float *hy;
+#else
+    float *theta;
+#endif
+    float *weight;
+    uint8_t *motion;
+    void *mem;
+#else
+    ble_particle_t *particles;
+#endif
+} ble_particle_set_t;
+
+// access a field of particle i, independent of the layout
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+#define PARTICLE_X(set, i)      ((set)->x[i])
+#define PARTICLE_Y(set, i)      ((set)->y[i])
+#define PARTICLE_HX(set, i)     ((set)->hx[i])
+#define PARTICLE_HY(set, i)     ((set)->hy[i])
+#define PARTICLE_THETA(set, i)  ((set)->theta[i])
+#define PARTICLE_MOTION(set, i) ((set)->motion[i])
+#define PARTICLE_WEIGHT(set, i) ((set)->weight[i])
+#else
+#define PARTICLE_X(set, i)      ((set)->particles[i].state.pos.x)
+#define PARTICLE_Y(set, i)      ((set)->particles[i].state.pos.y)
+#define PARTICLE_HX(set, i)     ((set)->particles[i].state.heading.x)
+#define PARTICLE_HY(set, i)     ((set)->particles[i].state.heading.y)
+#define PARTICLE_THETA(set, i)  ((set)->particles[i].state.theta)
+#define PARTICLE_MOTION(set, i) ((set)->particles[i].state.motion)
+#define PARTICLE_WEIGHT(set, i) ((set)->particles[i].weight)
+#endif
+
 typedef struct {
     struct {
         float x;
@@ -68,18 +184,173 @@ typedef struct {
     } pos;
     int id;
     float node_distance;
+    // time the distance was measured in microseconds, 0 if unknown
+    int64_t timestamp_us;
 } ble_particle_ap_t;
 
 typedef struct {
-    float d_node;
-    float d_particle;
-} ble_particle_ap_dist_t;
-
-typedef struct {
+    // measurements of the APs that reported, in any order
     ble_particle_ap_t aps[NO_OF_APS];
+    int ap_count;
     ble_particle_node_t node;
+    // time of the measurements in microseconds, 0 assumes the nominal update interval
+    int64_t timestamp_us;
+    // amount of particles after the last update
+    int particles;
 } ble_particle_data_t;
 
-int ble_particle_update(ble_particle_data_t *data);
+// resampling algorithms, selected per filter with ble_particle_config_t.resampler
+typedef enum {
+    // stochastic universal sampling, one random offset for evenly spaced pointers
+    PARTICLE_RESAMPLE_SYSTEMATIC,
+    // one random pointer within every 1/N stratum
+    PARTICLE_RESAMPLE_STRATIFIED,
+    // floor(N * w) copies of every particle, the rest systematic on the residual weights
+    PARTICLE_RESAMPLE_RESIDUAL,
+    // Metropolis chain per output particle, needs no normalization or cumulative sum
+    PARTICLE_RESAMPLE_METROPOLIS,
+    PARTICLE_RESAMPLE_COUNT
+} ble_particle_resampler_t;
+
+typedef struct {
+    // amount of particles
+    int particles;
+    // size of the (rectangular) area in meters
+    struct {
+        float x;
+        float y;
+    } area;
+    float ap_measurement_var;
+    float orientation_var;
+    float position_mean;
+    float position_var;
+    // nominal time between updates and the largest time step of an update, in seconds
+    float update_interval;
+    float max_dt;
+    // age of an AP measurement at which its weight drops by 1/e, and the age it is ignored at
+    float ap_age_tau;
+    float ap_max_age;
+    // resample when the effective sample size drops below this ratio of particles
+    float ratio_coefficient;
+    ble_particle_resampler_t resampler;
+    // steps of every Metropolis chain, more steps reduce the bias towards the start
+    int metropolis_steps;
+    // KLD-sampling between min_particles and particles, 0 keeps the amount fixed
+    int min_particles;
+    float kld_bin_size;
+    float kld_epsilon;
+    float kld_z;
+    // accumulate the observation model in the log domain, see ble_particle_moments
+    int log_weights;
+    // seed the particles around a trilateration of the first set, see PARTICLE_WARM_START
+    int warm_start;
+    float warm_start_sd;
+    // 0 seeds from time and process id
+    uint64_t seed;
+} ble_particle_config_t;
+
+#define BLE_PARTICLE_CONFIG_DEFAULT() {         \
+    .particles = PARTICLE_SET,                  \
+    .area = {.x = AREA_X, .y = AREA_Y},         \
+    .ap_measurement_var = AP_MEASUREMENT_VAR,   \
+    .orientation_var = ORIENTATION_VAR,         \
+    .position_mean = POSITION_MEAN,             \
+    .position_var = POSITION_VAR,               \
+    .update_interval = UPDATE_INTERVAL,         \
+    .max_dt = PARTICLE_MAX_DT,                  \
+    .ap_age_tau = AP_AGE_TAU,                   \
+    .ap_max_age = AP_MAX_AGE,                   \
+    .ratio_coefficient = RATIO_COEFFICIENT,     \
+    .resampler = PARTICLE_RESAMPLER,            \
+    .metropolis_steps = METROPOLIS_STEPS,       \
+    .min_particles = PARTICLE_MIN_SET,          \
+    .kld_bin_size = KLD_BIN_SIZE,               \
+    .kld_epsilon = KLD_EPSILON,                 \
+    .kld_z = KLD_Z,                             \
+    .log_weights = PARTICLE_LOG_WEIGHTS,        \
+    .warm_start = PARTICLE_WARM_START,          \
+    .warm_start_sd = PARTICLE_WARM_SD,          \
+    .seed = PARTICLE_SEED                       \
+}
+
+// partial sums of a chunk of particles, combined after a parallel stage
+typedef struct {
+    float sum;
+    float sum_sq;
+    float sum_x;
+    float sum_y;
+    // largest log-weight of the chunk
+    float max;
+    // cumulative weight of all chunks before this one
+    double offset;
+} ble_particle_partial_t;
+
+typedef struct {
+    ble_particle_config_t cfg;
+    ble_particle_set_t set;
+    // resampling writes into this set, after which it is swapped with set
+    ble_particle_set_t spare;
+    // latest measurement of every AP, the last set or the measurements streamed since
+    ble_particle_ap_t prev_ap[NO_OF_APS];
+    int prev_ap_count;
+    // the particles were seeded around a trilateration since the last reset
+    int warm;
+    // timestamp of the previous update, 0 before the first one
+    int64_t last_us;
+    // time since the previous update relative to the nominal interval, scales predict
+    float dt_scale;
+    ble_rng_t rng;
+    // parallel update, every worker of the pool handles one chunk of particles
+    // with its own random number stream, see ble_particle_filter_set_pool
+    ble_pool_t *pool;
+    ble_rng_t *chunk_rng;
+    ble_particle_partial_t *partial;
+    // cumulative weights within each chunk, used for parallel resampling
+    float *cumsum;
+    // AP distance lookup table, shared between filters, NULL calculates the distances
+    ble_lut_t *lut;
+    // amount of particles drawn by the next resampling step
+    int next_size;
+    // occupancy bitmap of the KLD-sampling grid, NULL when the amount is fixed
+    uint32_t *kld_bins;
+    int kld_cols;
+    int kld_rows;
+    // log-weight of every particle, NULL when the weights are kept linear
+    float *log_weight;
+    // sums of the weights of the set, see ble_particle_moments
+    ble_particle_partial_t sums;
+    // factor that normalizes the weights, applied when resampling or by the next weighting
+    float weight_scale;
+} ble_particle_filter_t;
+
+int ble_particle_set_alloc(ble_particle_set_t *set, int size);
+void ble_particle_set_free(ble_particle_set_t *set);
+
+// individual filter stages, used by ble_particle_filter_update and the benchmarks
+int ble_particle_generate(ble_particle_filter_t *pf);
+void ble_particle_state_predict(ble_particle_filter_t *pf);
+void ble_particle_weight(ble_particle_filter_t *pf, ble_particle_ap_t *aps, int ap_count);
+float ble_particle_moments(ble_particle_filter_t *pf);
+void ble_particle_normalize(ble_particle_filter_t *pf);
+void ble_particle_resample(ble_particle_filter_t *pf);
+void ble_particle_estimate(ble_particle_filter_t *pf, ble_particle_node_t *node);
+
+ble_particle_filter_t *ble_particle_filter_create(const ble_particle_config_t *cfg);
+float ble_particle_ap_age_scale(const ble_particle_config_t *cfg, int64_t timestamp_us, 
+    int64_t now_us);
+void ble_particle_keep_ap(ble_particle_ap_t *aps, int *count, const ble_particle_ap_t *ap);
+int ble_particle_trilaterate(const ble_particle_ap_t *aps, int ap_count, 
+    ble_particle_node_t *fix, float *rms);
+int ble_particle_filter_update(ble_particle_filter_t *pf, ble_particle_data_t *data);
+// streaming, the motion model on a clock and every measurement on its own
+int ble_particle_filter_predict(ble_particle_filter_t *pf, int64_t timestamp_us);
+int ble_particle_filter_observe(ble_particle_filter_t *pf, const ble_particle_ap_t *ap, 
+    ble_particle_data_t *data);
+int ble_particle_filter_reset(ble_particle_filter_t *pf);
+int ble_particle_filter_set_pool(ble_particle_filter_t *pf, ble_pool_t *pool);
+int ble_particle_filter_set_lut(ble_particle_filter_t *pf, ble_lut_t *lut);
+int ble_particle_filter_pack(const ble_particle_filter_t *pf, ble_snapshot_t *s);
+int ble_particle_filter_unpack(ble_particle_filter_t *pf, ble_snapshot_t *s);
+void ble_particle_filter_destroy(ble_particle_filter_t *pf);
 
 #endif
\ No newline at end of file
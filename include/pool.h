@@ -0,0 +1,51 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/pool.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#ifndef NATIVE
+// the task calling ble_pool_run is worker 0 and should be pinned to POOL_CORE,
+// worker i is pinned to core (POOL_CORE + i) % portNUM_PROCESSORS
+// BLE, WiFi and MQTT run on core 0, on a dual-core ESP32 worker 0 has core 1 and
+// worker 1 shares core 0 with them, at a lower priority
+#define POOL_CORE       1
+#define POOL_TASK_NAME  "Particle filter worker"
+#define POOL_TASK_SIZE  4096
+// below the MQTT task (5), the radio tasks on core 0 take precedence over the filter
+#define POOL_TASK_PRIO  4
+#endif
+
+// job executed by every worker of a pool, worker is in range [0..workers)
+typedef void (*ble_pool_fn_t)(void *arg, int worker);
+
+typedef struct ble_pool ble_pool_t;
+
+ble_pool_t *ble_pool_create(int workers);
+int ble_pool_workers(ble_pool_t *pool);
+void ble_pool_run(ble_pool_t *pool, ble_pool_fn_t fn, void *arg);
+void ble_pool_destroy(ble_pool_t *pool);
+
+#endif
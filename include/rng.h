@@ -0,0 +1,60 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/rng.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// random number engines, select one with RNG_ENGINE
+// xoshiro128+ only uses 32 bit operations, which suits the Xtensa cores best
+// PCG32 has better statistical quality in the low bits, at the cost of 64 bit multiplies
+#define RNG_ENGINE_XOSHIRO128   0
+#define RNG_ENGINE_PCG32        1
+
+#ifndef RNG_ENGINE
+#define RNG_ENGINE              RNG_ENGINE_XOSHIRO128
+#endif
+
+typedef struct {
+#if RNG_ENGINE == RNG_ENGINE_PCG32
+    uint64_t state;
+    uint64_t inc;
+#else
+    uint32_t s[4];
+#endif
+} ble_rng_t;
+
+void ble_rng_seed(ble_rng_t *rng, uint64_t seed);
+uint64_t ble_rng_entropy(void);
+uint32_t ble_rng_next(ble_rng_t *rng);
+float ble_rng_uniform(ble_rng_t *rng);
+float ble_rng_range(ble_rng_t *rng, float min, float max);
+int ble_rng_sample(ble_rng_t *rng, int state_amount);
+float ble_rng_normal(ble_rng_t *rng, float mu, float sigma);
+void ble_rng_fill_uniform(ble_rng_t *rng, float *buf, int n, float min, float max);
+void ble_rng_fill_normal(ble_rng_t *rng, float *buf, int n, float mu, float sigma);
+
+#endif
@@ -40,6 +40,10 @@
 #define MEASUREMENT_NOISE_R 30
 #define PROCESS_NOISE_Q     0.01
 
+#include <stdint.h>
+
+#include "snapshot.h"
+
 typedef struct {
     float state;
     float p_noise;
@@ -47,6 +51,23 @@ typedef struct {
     float err_v;
 } ble_rssi_state_t;
 
-void ble_rssi_update(int measurement);
+typedef struct {
+    ble_rssi_state_t kalman;
+    struct {
+        float prev;
+        int64_t start_us;
+    } low_pass;
+} ble_rssi_filter_t;
+
+void ble_rssi_filter_init(ble_rssi_filter_t *f);
+float ble_rssi_filter_update(ble_rssi_filter_t *f, int measurement);
+void ble_rssi_filter_pack(const ble_rssi_filter_t *f, ble_snapshot_t *s);
+void ble_rssi_filter_unpack(ble_rssi_filter_t *f, ble_snapshot_t *s);
+
+#ifndef NATIVE
+void ble_rssi_update(int node_id, int measurement);
+int ble_rssi_pack(ble_snapshot_t *s);
+int ble_rssi_unpack(ble_snapshot_t *s);
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * include/snapshot.h
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// "MSSN", first word of every snapshot file
+#define SNAPSHOT_MAGIC          0x4e53534d
+// increased whenever the layout of a payload changes, older files are ignored
+#define SNAPSHOT_VERSION        2
+// directory of the snapshot files, on the ESP32 a SPIFFS partition is mounted there
+#ifdef NATIVE
+#define SNAPSHOT_DIR            "."
+#else
+#define SNAPSHOT_DIR            "/spiffs"
+#define SNAPSHOT_PARTITION      "storage"
+#endif
+#define SNAPSHOT_NODES_PATH     SNAPSHOT_DIR "/nodes.snap"
+#define SNAPSHOT_RSSI_PATH      SNAPSHOT_DIR "/rssi.snap"
+// time between snapshots, and the largest age in seconds of a snapshot restored on start
+#define SNAPSHOT_INTERVAL_MS    5000
+#define SNAPSHOT_MAX_AGE_S      60
+
+typedef enum {
+    SNAPSHOT_KIND_NODES = 1,
+    SNAPSHOT_KIND_RSSI
+} ble_snapshot_kind_t;
+
+// payload of a snapshot, written and read in order
+typedef struct {
+    // NULL only counts the bytes that would be written
+    uint8_t *buf;
+    size_t cap;
+    // bytes written, or the size of the loaded payload
+    size_t len;
+    // read position
+    size_t pos;
+    // a write did not fit or a read went past the payload
+    int error;
+} ble_snapshot_t;
+
+int ble_snapshot_init(void);
+void ble_snapshot_put(ble_snapshot_t *s, const void *src, size_t n);
+void ble_snapshot_get(ble_snapshot_t *s, void *dst, size_t n);
+int ble_snapshot_save(const ble_snapshot_t *s, ble_snapshot_kind_t kind, const char *path);
+int ble_snapshot_load(ble_snapshot_t *s, ble_snapshot_kind_t kind, const char *path, 
+    int64_t max_age_s);
+
+#endif
@@ -34,6 +34,14 @@
 
 #define US_TO_S(us)             (us / 1000000)
 
+// compare and select instead of clampf, fminf and fmaxf are library calls without -ffast-math,
+// this keeps per-particle and per-cell loops inline and vectorizable
+static inline float 
+ble_util_clamp(float v, float minv, float maxv)
+{
+    return (v < minv) ? minv : ((v > maxv) ? maxv : v);
+}
+
 unsigned long ble_util_mix(unsigned long a, unsigned long b, unsigned long c);
 int ble_util_sample(int state_amount);
 float ble_util_sample_range(float min, float max);
@@ -27,7 +27,6 @@ import sys
 import argparse
 import numpy as np
 import matplotlib.pyplot as plt
-from collections import deque
 from matplotlib.animation import FuncAnimation
 from serial import Serial, SerialException
 
@@ -72,7 +71,7 @@ def parse_args(parser: argparse.ArgumentParser):
         baudrate = int(args.b)
 
 
-def animate(i, n, ser: Serial, n_x: deque, n_y: deque):
+def animate(i, n, ser: Serial, nodes: dict):
     """Update plot on interval."""
     bytes = ser.readline()
     received_data = bytes.split(b',')
@@ -80,18 +79,25 @@ def animate(i, n, ser: Serial, n_x: deque, n_y: deque):
         return
     
     # check if numbers only
+    # format is id,x,y; older HOST firmware prints x,y for a single node
     try:
-        coord_x = float(received_data[0])
-        coord_y = float(received_data[1])
+        if len(received_data) >= 3:
+            node_id = int(received_data[0])
+            coord_x = float(received_data[1])
+            coord_y = float(received_data[2])
+        else:
+            node_id = 0
+            coord_x = float(received_data[0])
+            coord_y = float(received_data[1])
     except ValueError:
         return
 
-    # replace the items in the deque since maxlen is 1
-    n_x.append(coord_x)
-    n_y.append(coord_y)
+    # keep the last position of every node
+    nodes[node_id] = (coord_x, coord_y)
 
     # add to scatter plots
-    n.set_offsets(np.c_[n_x, n_y])
+    n.set_offsets(np.array(list(nodes.values())))
+    n.set_array(np.array(list(nodes.keys()), dtype=float))
 
 
 def main():
@@ -117,17 +123,16 @@ def main():
 
     print(f"Connected to {ser.portstr}")
     
-    node_x = deque([0], maxlen=1)
-    node_y = deque([0], maxlen=1)
+    nodes = {}
 
-    # create plot
+    # create plot, nodes are colored by their ID
     fig, ax = plt.subplots()
-    node = ax.scatter(node_x, node_y, color='red', s=100)
+    node = ax.scatter([], [], c=[], cmap='tab10', vmin=0, vmax=9, s=100)
     plt.xlim(0, x_limit)
     plt.ylim(0, y_limit)
 
     # plot the node state as fast as possible
-    ani = FuncAnimation(fig, animate, fargs=(node, ser, node_x, node_y), interval=1)
+    ani = FuncAnimation(fig, animate, fargs=(node, ser, nodes), interval=1)
     plt.show()
 
 try:    
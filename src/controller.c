@@ -80,7 +80,7 @@ ble_controller_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *para
             if (found_adv != ESP_OK)
                 return;
             else
-                ble_rssi_update(param->scan_rst.rssi);
+                ble_rssi_update(ble_scan_node_id(&result_pkt), param->scan_rst.rssi);
             break;
         default:
             break;
@@ -0,0 +1,339 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/ekf.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+
+#include "ekf.h"
+#include "particle.h"
+#include "util.h"
+
+/**
+ * \brief Initialize an extended Kalman filter tracker.
+ * 
+ * \param ekf Tracker.
+ * \param cfg Configuration, of which the area, the time steps and the AP ages are used.
+ */
+void 
+ble_ekf_init(ble_ekf_t *ekf, const ble_particle_config_t *cfg)
+{
+    memset(ekf, 0, sizeof(ble_ekf_t));
+    ekf->cfg = *cfg;
+    ble_ekf_reset(ekf);
+}
+
+/**
+ * \brief Start over from the center of the area, at rest,
+ * with the variance of a uniform spread over the area.
+ * 
+ * \param ekf Tracker.
+ */
+void 
+ble_ekf_reset(ble_ekf_t *ekf)
+{
+    float area_x = ekf->cfg.area.x, area_y = ekf->cfg.area.y;
+    memset(ekf->x, 0, sizeof(ekf->x));
+    memset(ekf->p, 0, sizeof(ekf->p));
+    ekf->x[EKF_X] = area_x / 2;
+    ekf->x[EKF_Y] = area_y / 2;
+    ekf->p[EKF_X][EKF_X] = (area_x * area_x) / 12;
+    ekf->p[EKF_Y][EKF_Y] = (area_y * area_y) / 12;
+    ekf->p[EKF_VX][EKF_VX] = EKF_INIT_VEL_VAR;
+    ekf->p[EKF_VY][EKF_VY] = EKF_INIT_VEL_VAR;
+    ekf->ap_count = 0;
+    ekf->initialized = 0;
+    ekf->last_us = 0;
+}
+
+/**
+ * \brief Move the state with the constant velocity model.
+ * The time step follows from the timestamps as in the particle filter,
+ * the nominal update_interval without them, and at most max_dt.
+ * 
+ * \param ekf Tracker.
+ * \param timestamp_us Current time in microseconds, 0 if unknown.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_ekf_predict(ble_ekf_t *ekf, int64_t timestamp_us)
+{
+    if (ekf == NULL)
+        return -1;
+    float dt = ekf->cfg.update_interval;
+    if (timestamp_us != 0 && ekf->last_us != 0) {
+        dt = (float)(timestamp_us - ekf->last_us) * 1e-6F;
+        dt = (dt < 0) ? 0 : ((dt > ekf->cfg.max_dt) ? ekf->cfg.max_dt : dt);
+    }
+    if (timestamp_us > ekf->last_us)
+        ekf->last_us = timestamp_us;
+    if (dt == 0)
+        return 0;
+
+    // x' = F x, with the velocity integrated into the position
+    ekf->x[EKF_X] += ekf->x[EKF_VX] * dt;
+    ekf->x[EKF_Y] += ekf->x[EKF_VY] * dt;
+    // P' = F P F^T + Q, F only adds dt times a velocity row or column to a position one
+    float (*p)[EKF_STATES] = ekf->p;
+    for (int i = 0; i < EKF_STATES; i++) {
+        p[EKF_X][i] += dt * p[EKF_VX][i];
+        p[EKF_Y][i] += dt * p[EKF_VY][i];
+    }
+    for (int i = 0; i < EKF_STATES; i++) {
+        p[i][EKF_X] += dt * p[i][EKF_VX];
+        p[i][EKF_Y] += dt * p[i][EKF_VY];
+    }
+    // white acceleration noise, per axis q [dt^3 / 3, dt^2 / 2; dt^2 / 2, dt]
+    float q = EKF_ACCEL_VAR;
+    float q_pp = q * dt * dt * dt / 3, q_pv = q * dt * dt / 2, q_vv = q * dt;
+    p[EKF_X][EKF_X] += q_pp;
+    p[EKF_Y][EKF_Y] += q_pp;
+    p[EKF_X][EKF_VX] += q_pv;
+    p[EKF_VX][EKF_X] += q_pv;
+    p[EKF_Y][EKF_VY] += q_pv;
+    p[EKF_VY][EKF_Y] += q_pv;
+    p[EKF_VX][EKF_VX] += q_vv;
+    p[EKF_VY][EKF_VY] += q_vv;
+
+    return 0;
+}
+
+/**
+ * \brief Correct the state with the distance to a single AP, linearized around the state.
+ * As the scalar filter of ble_rssi_kf_estimate, the gain is the predicted variance
+ * over the predicted variance plus the measurement noise, here along H = d range / d state.
+ * 
+ * \param ekf Tracker.
+ * \param ap AP measurement.
+ * \param weight Factor of the measurement by its age, divides the measurement noise.
+ */
+static void 
+ble_ekf_correct(ble_ekf_t *ekf, const ble_particle_ap_t *ap, float weight)
+{
+    if (weight <= 0)
+        return;
+    float dx = ekf->x[EKF_X] - ap->pos.x, dy = ekf->x[EKF_Y] - ap->pos.y;
+    float range = sqrtf((dx * dx) + (dy * dy));
+    // on top of the AP the direction of the range is undefined
+    if (range < 1e-3F)
+        return;
+    float hx = dx / range, hy = dy / range;
+
+    // P H^T, H only has position entries
+    float pht[EKF_STATES];
+    for (int i = 0; i < EKF_STATES; i++)
+        pht[i] = (ekf->p[i][EKF_X] * hx) + (ekf->p[i][EKF_Y] * hy);
+    // S = H P H^T + R
+    float s = (hx * pht[EKF_X]) + (hy * pht[EKF_Y]) + (EKF_RANGE_VAR / weight);
+    float innovation = ap->node_distance - range;
+    // bound the innovation by inflating its variance
+    float gate = (float)(EKF_GATE * EKF_GATE) * s;
+    if (innovation * innovation > gate)
+        s *= (innovation * innovation) / gate;
+
+    // x = x' + K (m - h(x')), P = (I - K H) P', with K = P' H^T / S
+    for (int i = 0; i < EKF_STATES; i++)
+        ekf->x[i] += pht[i] * innovation / s;
+    for (int i = 0; i < EKF_STATES; i++) {
+        for (int j = 0; j < EKF_STATES; j++)
+            ekf->p[i][j] -= (pht[i] * pht[j]) / s;
+    }
+}
+
+/**
+ * \brief Keep the position within the area, stopping the velocity towards the border.
+ * 
+ * \param ekf Tracker.
+ */
+static void 
+ble_ekf_clamp(ble_ekf_t *ekf)
+{
+    float area[2] = {ekf->cfg.area.x, ekf->cfg.area.y};
+    for (int i = 0; i < 2; i++) {
+        float v = ekf->x[EKF_X + i];
+        if (v < 0 || v > area[i]) {
+            ekf->x[EKF_X + i] = clampf(v, 0, area[i]);
+            ekf->x[EKF_VX + i] = 0;
+        }
+    }
+}
+
+/**
+ * \brief Initialize the position from the trilateration of at least 3 APs,
+ * once after a reset, see ble_particle_trilaterate.
+ * 
+ * \param ekf Tracker.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ */
+static void 
+ble_ekf_initialize(ble_ekf_t *ekf, const ble_particle_ap_t *aps, int ap_count)
+{
+    ble_particle_node_t fix;
+    float rms;
+    if (ekf->initialized || ap_count < 3 || 
+        ble_particle_trilaterate(aps, ap_count, &fix, &rms) != 0)
+        return;
+    float sd = (rms > ekf->cfg.warm_start_sd) ? rms : ekf->cfg.warm_start_sd;
+    ekf->x[EKF_X] = fix.pos.x;
+    ekf->x[EKF_Y] = fix.pos.y;
+    ekf->x[EKF_VX] = ekf->x[EKF_VY] = 0;
+    memset(ekf->p, 0, sizeof(ekf->p));
+    ekf->p[EKF_X][EKF_X] = ekf->p[EKF_Y][EKF_Y] = sd * sd;
+    ekf->p[EKF_VX][EKF_VX] = ekf->p[EKF_VY][EKF_VY] = EKF_INIT_VEL_VAR;
+    ekf->initialized = 1;
+}
+
+/**
+ * \brief Predict the state to the time of a set of AP measurements and correct it
+ * with every distance, in place of ble_particle_filter_update.
+ * The first set of at least 3 APs after a reset initializes the position
+ * from their trilateration, see ble_particle_trilaterate.
+ * 
+ * \param ekf Tracker.
+ * \param data Pointer to a structure with AP measurements and their timestamp,
+ * written with the position and 0 particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_ekf_update(ble_ekf_t *ekf, ble_particle_data_t *data)
+{
+    if (ekf == NULL || data == NULL || data->ap_count < 0 || data->ap_count > NO_OF_APS)
+        return -1;
+    ble_ekf_predict(ekf, data->timestamp_us);
+
+    ble_ekf_initialize(ekf, data->aps, data->ap_count);
+    for (int j = 0; j < data->ap_count; j++) {
+        ble_ekf_correct(ekf, &data->aps[j], 
+            ble_particle_ap_age_scale(&ekf->cfg, data->aps[j].timestamp_us, ekf->last_us));
+    }
+    ble_ekf_clamp(ekf);
+
+    data->node.pos.x = ekf->x[EKF_X];
+    data->node.pos.y = ekf->x[EKF_Y];
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Predict the state to the time of a single AP measurement and correct it
+ * with the distance, in place of ble_particle_filter_observe.
+ * The latest measurement of every AP is kept, once at least 3 of them are recent
+ * they initialize the position as the first set in ble_ekf_update.
+ * 
+ * \param ekf Tracker.
+ * \param ap Measurement of a single AP.
+ * \param data Written with the recent measurements, the position and 0 particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_ekf_observe(ble_ekf_t *ekf, const ble_particle_ap_t *ap, ble_particle_data_t *data)
+{
+    if (ekf == NULL || ap == NULL || data == NULL)
+        return -1;
+    ble_particle_keep_ap(ekf->aps, &ekf->ap_count, ap);
+
+    ble_ekf_predict(ekf, ap->timestamp_us);
+    if (!ekf->initialized) {
+        // only measurements that are not too old to weigh
+        ble_particle_ap_t recent[NO_OF_APS];
+        int n = 0;
+        for (int j = 0; j < ekf->ap_count; j++) {
+            if (ble_particle_ap_age_scale(&ekf->cfg, ekf->aps[j].timestamp_us, 
+                    ap->timestamp_us) > 0)
+                recent[n++] = ekf->aps[j];
+        }
+        ble_ekf_initialize(ekf, recent, n);
+    }
+    ble_ekf_correct(ekf, ap, 1.0F);
+    ble_ekf_clamp(ekf);
+
+    memcpy(data->aps, ekf->aps, sizeof(ekf->aps));
+    data->ap_count = ekf->ap_count;
+    data->timestamp_us = ap->timestamp_us;
+    data->node.pos.x = ekf->x[EKF_X];
+    data->node.pos.y = ekf->x[EKF_Y];
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Standard deviation of the position, the quality of the estimate.
+ * 
+ * \param ekf Tracker.
+ * 
+ * \return Square root of the summed variance of x and y in meters.
+ */
+float 
+ble_ekf_position_sd(const ble_ekf_t *ekf)
+{
+    return sqrtf(ekf->p[EKF_X][EKF_X] + ekf->p[EKF_Y][EKF_Y]);
+}
+
+/**
+ * \brief Write the state and covariance of a tracker to a snapshot.
+ * The time of the last predict is not kept, it does not survive a reset of the device.
+ * 
+ * \param ekf Tracker.
+ * \param s Snapshot to append to.
+ */
+void 
+ble_ekf_pack(const ble_ekf_t *ekf, ble_snapshot_t *s)
+{
+    int32_t initialized = ekf->initialized;
+    ble_snapshot_put(s, ekf->x, sizeof(ekf->x));
+    ble_snapshot_put(s, ekf->p, sizeof(ekf->p));
+    ble_snapshot_put(s, &initialized, sizeof(initialized));
+}
+
+/**
+ * \brief Restore a tracker written by ble_ekf_pack.
+ * 
+ * \param ekf Tracker, unchanged on failure.
+ * \param s Snapshot to read from.
+ * 
+ * \return 0 on succes, -1 when the snapshot is cut short.
+ */
+int 
+ble_ekf_unpack(ble_ekf_t *ekf, ble_snapshot_t *s)
+{
+    float x[EKF_STATES], p[EKF_STATES][EKF_STATES];
+    int32_t initialized;
+    ble_snapshot_get(s, x, sizeof(x));
+    ble_snapshot_get(s, p, sizeof(p));
+    ble_snapshot_get(s, &initialized, sizeof(initialized));
+    if (s->error)
+        return -1;
+    memcpy(ekf->x, x, sizeof(x));
+    memcpy(ekf->p, p, sizeof(p));
+    ekf->initialized = (initialized != 0);
+    ekf->last_us = 0;
+    ble_ekf_clamp(ekf);
+    return 0;
+}
@@ -0,0 +1,445 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/grid.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+
+#include "grid.h"
+#include "lut.h"
+#include "particle.h"
+#include "util.h"
+
+/**
+ * \brief Create a histogram filter over the area of a configuration.
+ * The belief has a cell on both borders, as the grid of the lookup table.
+ * 
+ * \param cfg Configuration, of which the area, the motion model, the time steps 
+ * and the AP ages are used.
+ * \param cell_size Side of a cell in meters, see GRID_CELL_SIZE.
+ * 
+ * \return Pointer to the filter, NULL on error.
+ */
+ble_grid_t *
+ble_grid_create(const ble_particle_config_t *cfg, float cell_size)
+{
+    if (cfg == NULL || cell_size <= 0)
+        return NULL;
+    ble_grid_t *grid = calloc(1, sizeof(ble_grid_t));
+    if (grid == NULL)
+        return NULL;
+    grid->cfg = *cfg;
+    grid->cell_size = cell_size;
+    grid->lut = ble_lut_create(cfg->area.x, cfg->area.y, cell_size, NO_OF_APS, LUT_NEAREST);
+    if (grid->lut == NULL) {
+        ble_grid_destroy(grid);
+        return NULL;
+    }
+    grid->cols = grid->lut->cols;
+    grid->rows = grid->lut->rows;
+    grid->area_diag = sqrtf((cfg->area.x * cfg->area.x) + (cfg->area.y * cfg->area.y));
+    size_t cells = (size_t)grid->cols * grid->rows;
+    grid->belief = malloc(cells * sizeof(float));
+    grid->scratch = malloc(cells * sizeof(float));
+    grid->pad = malloc((grid->cols + (2 * GRID_MAX_RADIUS)) * sizeof(float));
+    if (grid->belief == NULL || grid->scratch == NULL || grid->pad == NULL) {
+        ble_grid_destroy(grid);
+        return NULL;
+    }
+    ble_grid_reset(grid);
+    return grid;
+}
+
+/**
+ * \brief Mean and standard deviation of the belief, clamped to the area.
+ * 
+ * \param grid Filter.
+ */
+static void 
+ble_grid_estimate(ble_grid_t *grid)
+{
+    int cols = grid->cols;
+    float cell = grid->cell_size;
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_yy = 0;
+    for (int r = 0; r < grid->rows; r++) {
+        const float *row = grid->belief + ((size_t)r * cols);
+        float p_row = 0, p_x = 0, p_xx = 0;
+        for (int c = 0; c < cols; c++) {
+            float x = (float)c * cell;
+            p_row += row[c];
+            p_x += row[c] * x;
+            p_xx += row[c] * x * x;
+        }
+        float y = (float)r * cell;
+        sum_x += p_x;
+        sum_xx += p_xx;
+        sum_y += p_row * y;
+        sum_yy += p_row * y * y;
+    }
+    double var = (sum_xx - (sum_x * sum_x)) + (sum_yy - (sum_y * sum_y));
+    grid->estimate.pos.x = clampf((float)sum_x, 0, grid->cfg.area.x);
+    grid->estimate.pos.y = clampf((float)sum_y, 0, grid->cfg.area.y);
+    grid->sd = (var > 0) ? (float)sqrt(var) : 0;
+}
+
+/**
+ * \brief Start over from a uniform belief over the area.
+ * 
+ * \param grid Filter.
+ */
+void 
+ble_grid_reset(ble_grid_t *grid)
+{
+    size_t cells = (size_t)grid->cols * grid->rows;
+    float p = 1.0F / (float)cells;
+    for (size_t i = 0; i < cells; i++)
+        grid->belief[i] = p;
+    // no kernel is built for a negative time step
+    grid->kernel_dt = -1;
+    grid->radius = 0;
+    grid->ap_count = 0;
+    grid->last_us = 0;
+    ble_grid_estimate(grid);
+}
+
+/**
+ * \brief Build the motion kernel for a time step.
+ * The particle filter steps position_mean in any direction plus noise of position_var,
+ * per axis a random walk with variance position_mean^2 / 2 + position_var per update_interval.
+ * 
+ * \param grid Filter.
+ * \param dt Time step in seconds.
+ */
+static void 
+ble_grid_kernel(ble_grid_t *grid, float dt)
+{
+    const ble_particle_config_t *cfg = &grid->cfg;
+    float var = ((cfg->position_mean * cfg->position_mean / 2) + cfg->position_var) * 
+        (dt / cfg->update_interval);
+    float sd = sqrtf(var) / grid->cell_size;
+    int radius = (int)ceilf((float)GRID_KERNEL_SD * sd);
+    radius = (radius > GRID_MAX_RADIUS) ? GRID_MAX_RADIUS : radius;
+
+    float sum = 0;
+    for (int k = -radius; k <= radius; k++) {
+        float tap = (sd > 0) ? expf(-(float)(k * k) / (2 * sd * sd)) : 1.0F;
+        grid->kernel[k + radius] = tap;
+        sum += tap;
+    }
+    for (int k = 0; k <= 2 * radius; k++)
+        grid->kernel[k] /= sum;
+    grid->radius = radius;
+    grid->kernel_dt = dt;
+}
+
+/**
+ * \brief Scale the belief to a sum of 1, with every cell at least GRID_MIN_BELIEF.
+ * 
+ * \param grid Filter.
+ * 
+ * \return Sum before scaling.
+ */
+static float 
+ble_grid_normalize(ble_grid_t *grid)
+{
+    size_t cells = (size_t)grid->cols * grid->rows;
+    float sum = 0;
+    for (size_t i = 0; i < cells; i++)
+        sum += grid->belief[i];
+    if (sum > 0) {
+        float inv = 1.0F / sum;
+        for (size_t i = 0; i < cells; i++)
+            grid->belief[i] = ble_util_clamp(grid->belief[i] * inv, (float)GRID_MIN_BELIEF, 1.0F);
+    }
+    return sum;
+}
+
+/**
+ * \brief Blur the belief with the motion model, a separable Gaussian convolution.
+ * The rows are convolved through a padded copy, the columns by adding whole shifted rows,
+ * so both inner loops run over contiguous cells. The border cells extend beyond the area,
+ * the node can not leave it. The time step follows from the timestamps as in the particle filter,
+ * the nominal update_interval without them, and at most max_dt.
+ * 
+ * \param grid Filter.
+ * \param timestamp_us Current time in microseconds, 0 if unknown.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_grid_predict(ble_grid_t *grid, int64_t timestamp_us)
+{
+    if (grid == NULL)
+        return -1;
+    float dt = grid->cfg.update_interval;
+    if (timestamp_us != 0 && grid->last_us != 0) {
+        dt = (float)(timestamp_us - grid->last_us) * 1e-6F;
+        dt = (dt < 0) ? 0 : ((dt > grid->cfg.max_dt) ? grid->cfg.max_dt : dt);
+    }
+    if (timestamp_us > grid->last_us)
+        grid->last_us = timestamp_us;
+    if (dt == 0)
+        return 0;
+    if (dt != grid->kernel_dt)
+        ble_grid_kernel(grid, dt);
+    int radius = grid->radius;
+    if (radius == 0)
+        return 0;
+
+    int cols = grid->cols, rows = grid->rows, taps = (2 * radius) + 1;
+    const float *kernel = grid->kernel;
+    float *pad = grid->pad;
+    // rows, from the belief to the scratch
+    for (int r = 0; r < rows; r++) {
+        const float *in = grid->belief + ((size_t)r * cols);
+        float *out = grid->scratch + ((size_t)r * cols);
+        for (int k = 0; k < radius; k++) {
+            pad[k] = in[0];
+            pad[radius + cols + k] = in[cols - 1];
+        }
+        memcpy(pad + radius, in, cols * sizeof(float));
+        for (int c = 0; c < cols; c++)
+            out[c] = 0;
+        for (int k = 0; k < taps; k++) {
+            float w = kernel[k];
+            const float *src = pad + k;
+            for (int c = 0; c < cols; c++)
+                out[c] += w * src[c];
+        }
+    }
+    // columns, from the scratch back to the belief
+    for (int r = 0; r < rows; r++) {
+        float *out = grid->belief + ((size_t)r * cols);
+        for (int c = 0; c < cols; c++)
+            out[c] = 0;
+        for (int k = 0; k < taps; k++) {
+            int src_r = r + k - radius;
+            src_r = (src_r < 0) ? 0 : ((src_r > rows - 1) ? (rows - 1) : src_r);
+            float w = kernel[k];
+            const float *src = grid->scratch + ((size_t)src_r * cols);
+            for (int c = 0; c < cols; c++)
+                out[c] += w * src[c];
+        }
+    }
+    // the repeated borders add a little mass
+    ble_grid_normalize(grid);
+    return 0;
+}
+
+/**
+ * \brief Multiply the belief with the likelihood of AP distances.
+ * The squared residuals of every cell are summed first and the exponent is taken once per cell,
+ * relative to the best cell so it does not underflow. The residual of a distance is bounded
+ * by GRID_GATE standard deviations. When the measurements still rule out
+ * the whole belief, it starts over from the likelihood alone.
+ * 
+ * \param grid Filter.
+ * \param aps AP measurements.
+ * \param weights Factor of every measurement by its age, divides the measurement noise.
+ * \param ap_count Amount of measurements.
+ */
+static void 
+ble_grid_correct(ble_grid_t *grid, const ble_particle_ap_t *aps, const float *weights, 
+    int ap_count)
+{
+    size_t cells = (size_t)grid->cols * grid->rows;
+    float *sq = grid->scratch;
+    float diag = grid->area_diag;
+    int used = 0;
+
+    for (size_t i = 0; i < cells; i++)
+        sq[i] = 0;
+    for (int j = 0; j < ap_count; j++) {
+        if (weights[j] <= 0)
+            continue;
+        int plane = ble_lut_plane(grid->lut, aps[j].id, aps[j].pos.x, aps[j].pos.y);
+        const float *dist = grid->lut->dist + ((size_t)plane * cells);
+        float measured = aps[j].node_distance;
+        float scale = weights[j] / (float)(2 * GRID_RANGE_VAR);
+        float gate = weights[j] * (float)(GRID_GATE * GRID_GATE / 2);
+        for (size_t i = 0; i < cells; i++) {
+            float e = (dist[i] * diag) - measured;
+            float term = scale * e * e;
+            sq[i] += (term < gate) ? term : gate;
+        }
+        used++;
+    }
+    if (used == 0)
+        return;
+
+    float min = sq[0];
+    for (size_t i = 1; i < cells; i++)
+        min = (sq[i] < min) ? sq[i] : min;
+    for (size_t i = 0; i < cells; i++)
+        grid->belief[i] *= expf(min - sq[i]);
+    float sum = ble_grid_normalize(grid);
+    if (!(sum > 0) || !isfinite(sum)) {
+        for (size_t i = 0; i < cells; i++)
+            grid->belief[i] = expf(min - sq[i]);
+        ble_grid_normalize(grid);
+    }
+}
+
+/**
+ * \brief Predict the belief to the time of a set of AP measurements and multiply it
+ * with their likelihood, in place of ble_particle_filter_update.
+ * 
+ * \param grid Filter.
+ * \param data Pointer to a structure with AP measurements and their timestamp,
+ * written with the position and 0 particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_grid_update(ble_grid_t *grid, ble_particle_data_t *data)
+{
+    if (grid == NULL || data == NULL || data->ap_count < 0 || data->ap_count > NO_OF_APS)
+        return -1;
+    ble_grid_predict(grid, data->timestamp_us);
+
+    float weights[NO_OF_APS];
+    for (int j = 0; j < data->ap_count; j++) {
+        weights[j] = ble_particle_ap_age_scale(&grid->cfg, data->aps[j].timestamp_us, 
+            grid->last_us);
+    }
+    ble_grid_correct(grid, data->aps, weights, data->ap_count);
+    ble_grid_estimate(grid);
+
+    data->node = grid->estimate;
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Predict the belief to the time of a single AP measurement and multiply it
+ * with its likelihood, in place of ble_particle_filter_observe.
+ * 
+ * \param grid Filter.
+ * \param ap Measurement of a single AP.
+ * \param data Written with the recent measurements, the position and 0 particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_grid_observe(ble_grid_t *grid, const ble_particle_ap_t *ap, ble_particle_data_t *data)
+{
+    if (grid == NULL || ap == NULL || data == NULL)
+        return -1;
+    ble_particle_keep_ap(grid->aps, &grid->ap_count, ap);
+
+    ble_grid_predict(grid, ap->timestamp_us);
+    float weight = 1.0F;
+    ble_grid_correct(grid, ap, &weight, 1);
+    ble_grid_estimate(grid);
+
+    memcpy(data->aps, grid->aps, sizeof(grid->aps));
+    data->ap_count = grid->ap_count;
+    data->timestamp_us = ap->timestamp_us;
+    data->node = grid->estimate;
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Get the memory used by a filter, including its lookup table.
+ * 
+ * \param grid Filter.
+ * 
+ * \return Size in bytes.
+ */
+size_t 
+ble_grid_footprint(const ble_grid_t *grid)
+{
+    size_t cells = (size_t)grid->cols * grid->rows;
+    return sizeof(ble_grid_t) + (2 * cells * sizeof(float)) + 
+        ((grid->cols + (2 * GRID_MAX_RADIUS)) * sizeof(float)) + ble_lut_footprint(grid->lut);
+}
+
+/**
+ * \brief Write the belief of a filter to a snapshot.
+ * The distance planes are rebuilt on the next update and the time of the last predict
+ * is not kept, it does not survive a reset of the device.
+ * 
+ * \param grid Filter.
+ * \param s Snapshot to append to.
+ */
+void 
+ble_grid_pack(const ble_grid_t *grid, ble_snapshot_t *s)
+{
+    int32_t size[2] = {grid->cols, grid->rows};
+    ble_snapshot_put(s, size, sizeof(size));
+    ble_snapshot_put(s, grid->belief, (size_t)grid->cols * grid->rows * sizeof(float));
+}
+
+/**
+ * \brief Restore a filter written by ble_grid_pack.
+ * 
+ * \param grid Filter, unchanged on failure.
+ * \param s Snapshot to read from.
+ * 
+ * \return 0 on succes, -1 when the snapshot is cut short or has another grid size.
+ */
+int 
+ble_grid_unpack(ble_grid_t *grid, ble_snapshot_t *s)
+{
+    int32_t size[2];
+    ble_snapshot_get(s, size, sizeof(size));
+    if (s->error || size[0] != grid->cols || size[1] != grid->rows)
+        return -1;
+    size_t bytes = (size_t)grid->cols * grid->rows * sizeof(float);
+    ble_snapshot_get(s, grid->scratch, bytes);
+    if (s->error)
+        return -1;
+    // restored as written, a belief that does not sum to a positive number starts over
+    float sum = 0;
+    for (size_t i = 0; i < bytes / sizeof(float); i++)
+        sum += grid->scratch[i];
+    if (!(sum > 0) || !isfinite(sum)) {
+        ble_grid_reset(grid);
+        return 0;
+    }
+    memcpy(grid->belief, grid->scratch, bytes);
+    grid->last_us = 0;
+    ble_grid_estimate(grid);
+    return 0;
+}
+
+/**
+ * \brief Free a filter.
+ * 
+ * \param grid Filter, may be NULL.
+ */
+void 
+ble_grid_destroy(ble_grid_t *grid)
+{
+    if (grid == NULL)
+        return;
+    ble_lut_destroy(grid->lut);
+    free(grid->belief);
+    free(grid->scratch);
+    free(grid->pad);
+    free(grid);
+}
@@ -0,0 +1,111 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/heading.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "heading.h"
+
+// generated with sin(2 * pi * k / 256), quarter turns are exact
+// const, so the table stays in flash on the ESP32
+const float ble_heading_table[HEADING_TABLE_SIZE] = {
+    0.0F, 2.454122852e-02F, 4.906767433e-02F, 7.356456360e-02F,
+    9.801714033e-02F, 1.224106752e-01F, 1.467304745e-01F, 1.709618888e-01F,
+    1.950903220e-01F, 2.191012402e-01F, 2.429801799e-01F, 2.667127575e-01F,
+    2.902846773e-01F, 3.136817404e-01F, 3.368898534e-01F, 3.598950365e-01F,
+    3.826834324e-01F, 4.052413140e-01F, 4.275550934e-01F, 4.496113297e-01F,
+    4.713967368e-01F, 4.928981922e-01F, 5.141027442e-01F, 5.349976199e-01F,
+    5.555702330e-01F, 5.758081914e-01F, 5.956993045e-01F, 6.152315906e-01F,
+    6.343932842e-01F, 6.531728430e-01F, 6.715589548e-01F, 6.895405447e-01F,
+    7.071067812e-01F, 7.242470830e-01F, 7.409511254e-01F, 7.572088465e-01F,
+    7.730104534e-01F, 7.883464276e-01F, 8.032075315e-01F, 8.175848132e-01F,
+    8.314696123e-01F, 8.448535652e-01F, 8.577286100e-01F, 8.700869911e-01F,
+    8.819212643e-01F, 8.932243012e-01F, 9.039892931e-01F, 9.142097557e-01F,
+    9.238795325e-01F, 9.329927988e-01F, 9.415440652e-01F, 9.495281806e-01F,
+    9.569403357e-01F, 9.637760658e-01F, 9.700312532e-01F, 9.757021300e-01F,
+    9.807852804e-01F, 9.852776424e-01F, 9.891765100e-01F, 9.924795346e-01F,
+    9.951847267e-01F, 9.972904567e-01F, 9.987954562e-01F, 9.996988187e-01F,
+    1.000000000e+00F, 9.996988187e-01F, 9.987954562e-01F, 9.972904567e-01F,
+    9.951847267e-01F, 9.924795346e-01F, 9.891765100e-01F, 9.852776424e-01F,
+    9.807852804e-01F, 9.757021300e-01F, 9.700312532e-01F, 9.637760658e-01F,
+    9.569403357e-01F, 9.495281806e-01F, 9.415440652e-01F, 9.329927988e-01F,
+    9.238795325e-01F, 9.142097557e-01F, 9.039892931e-01F, 8.932243012e-01F,
+    8.819212643e-01F, 8.700869911e-01F, 8.577286100e-01F, 8.448535652e-01F,
+    8.314696123e-01F, 8.175848132e-01F, 8.032075315e-01F, 7.883464276e-01F,
+    7.730104534e-01F, 7.572088465e-01F, 7.409511254e-01F, 7.242470830e-01F,
+    7.071067812e-01F, 6.895405447e-01F, 6.715589548e-01F, 6.531728430e-01F,
+    6.343932842e-01F, 6.152315906e-01F, 5.956993045e-01F, 5.758081914e-01F,
+    5.555702330e-01F, 5.349976199e-01F, 5.141027442e-01F, 4.928981922e-01F,
+    4.713967368e-01F, 4.496113297e-01F, 4.275550934e-01F, 4.052413140e-01F,
+    3.826834324e-01F, 3.598950365e-01F, 3.368898534e-01F, 3.136817404e-01F,
+    2.902846773e-01F, 2.667127575e-01F, 2.429801799e-01F, 2.191012402e-01F,
+    1.950903220e-01F, 1.709618888e-01F, 1.467304745e-01F, 1.224106752e-01F,
+    9.801714033e-02F, 7.356456360e-02F, 4.906767433e-02F, 2.454122852e-02F,
+    0.0F, -2.454122852e-02F, -4.906767433e-02F, -7.356456360e-02F,
+    -9.801714033e-02F, -1.224106752e-01F, -1.467304745e-01F, -1.709618888e-01F,
+    -1.950903220e-01F, -2.191012402e-01F, -2.429801799e-01F, -2.667127575e-01F,
+    -2.902846773e-01F, -3.136817404e-01F, -3.368898534e-01F, -3.598950365e-01F,
+    -3.826834324e-01F, -4.052413140e-01F, -4.275550934e-01F, -4.496113297e-01F,
+    -4.713967368e-01F, -4.928981922e-01F, -5.141027442e-01F, -5.349976199e-01F,
+    -5.555702330e-01F, -5.758081914e-01F, -5.956993045e-01F, -6.152315906e-01F,
+    -6.343932842e-01F, -6.531728430e-01F, -6.715589548e-01F, -6.895405447e-01F,
+    -7.071067812e-01F, -7.242470830e-01F, -7.409511254e-01F, -7.572088465e-01F,
+    -7.730104534e-01F, -7.883464276e-01F, -8.032075315e-01F, -8.175848132e-01F,
+    -8.314696123e-01F, -8.448535652e-01F, -8.577286100e-01F, -8.700869911e-01F,
+    -8.819212643e-01F, -8.932243012e-01F, -9.039892931e-01F, -9.142097557e-01F,
+    -9.238795325e-01F, -9.329927988e-01F, -9.415440652e-01F, -9.495281806e-01F,
+    -9.569403357e-01F, -9.637760658e-01F, -9.700312532e-01F, -9.757021300e-01F,
+    -9.807852804e-01F, -9.852776424e-01F, -9.891765100e-01F, -9.924795346e-01F,
+    -9.951847267e-01F, -9.972904567e-01F, -9.987954562e-01F, -9.996988187e-01F,
+    -1.000000000e+00F, -9.996988187e-01F, -9.987954562e-01F, -9.972904567e-01F,
+    -9.951847267e-01F, -9.924795346e-01F, -9.891765100e-01F, -9.852776424e-01F,
+    -9.807852804e-01F, -9.757021300e-01F, -9.700312532e-01F, -9.637760658e-01F,
+    -9.569403357e-01F, -9.495281806e-01F, -9.415440652e-01F, -9.329927988e-01F,
+    -9.238795325e-01F, -9.142097557e-01F, -9.039892931e-01F, -8.932243012e-01F,
+    -8.819212643e-01F, -8.700869911e-01F, -8.577286100e-01F, -8.448535652e-01F,
+    -8.314696123e-01F, -8.175848132e-01F, -8.032075315e-01F, -7.883464276e-01F,
+    -7.730104534e-01F, -7.572088465e-01F, -7.409511254e-01F, -7.242470830e-01F,
+    -7.071067812e-01F, -6.895405447e-01F, -6.715589548e-01F, -6.531728430e-01F,
+    -6.343932842e-01F, -6.152315906e-01F, -5.956993045e-01F, -5.758081914e-01F,
+    -5.555702330e-01F, -5.349976199e-01F, -5.141027442e-01F, -4.928981922e-01F,
+    -4.713967368e-01F, -4.496113297e-01F, -4.275550934e-01F, -4.052413140e-01F,
+    -3.826834324e-01F, -3.598950365e-01F, -3.368898534e-01F, -3.136817404e-01F,
+    -2.902846773e-01F, -2.667127575e-01F, -2.429801799e-01F, -2.191012402e-01F,
+    -1.950903220e-01F, -1.709618888e-01F, -1.467304745e-01F, -1.224106752e-01F,
+    -9.801714033e-02F, -7.356456360e-02F, -4.906767433e-02F, -2.454122852e-02F,
+    0.0F, 2.454122852e-02F, 4.906767433e-02F, 7.356456360e-02F,
+    9.801714033e-02F, 1.224106752e-01F, 1.467304745e-01F, 1.709618888e-01F,
+    1.950903220e-01F, 2.191012402e-01F, 2.429801799e-01F, 2.667127575e-01F,
+    2.902846773e-01F, 3.136817404e-01F, 3.368898534e-01F, 3.598950365e-01F,
+    3.826834324e-01F, 4.052413140e-01F, 4.275550934e-01F, 4.496113297e-01F,
+    4.713967368e-01F, 4.928981922e-01F, 5.141027442e-01F, 5.349976199e-01F,
+    5.555702330e-01F, 5.758081914e-01F, 5.956993045e-01F, 6.152315906e-01F,
+    6.343932842e-01F, 6.531728430e-01F, 6.715589548e-01F, 6.895405447e-01F,
+    7.071067812e-01F, 7.242470830e-01F, 7.409511254e-01F, 7.572088465e-01F,
+    7.730104534e-01F, 7.883464276e-01F, 8.032075315e-01F, 8.175848132e-01F,
+    8.314696123e-01F, 8.448535652e-01F, 8.577286100e-01F, 8.700869911e-01F,
+    8.819212643e-01F, 8.932243012e-01F, 9.039892931e-01F, 9.142097557e-01F,
+    9.238795325e-01F, 9.329927988e-01F, 9.415440652e-01F, 9.495281806e-01F,
+    9.569403357e-01F, 9.637760658e-01F, 9.700312532e-01F, 9.757021300e-01F,
+    9.807852804e-01F, 9.852776424e-01F, 9.891765100e-01F, 9.924795346e-01F,
+    9.951847267e-01F, 9.972904567e-01F, 9.987954562e-01F, 9.996988187e-01F
+};
@@ -0,0 +1,277 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/lsq.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+
+#include "lsq.h"
+#include "particle.h"
+#include "util.h"
+
+/**
+ * \brief Initialize a least-squares tracker.
+ * 
+ * \param lsq Tracker.
+ * \param cfg Configuration, of which the area and the AP ages are used.
+ */
+void 
+ble_lsq_init(ble_lsq_t *lsq, const ble_particle_config_t *cfg)
+{
+    memset(lsq, 0, sizeof(ble_lsq_t));
+    lsq->cfg = *cfg;
+    ble_lsq_reset(lsq);
+}
+
+/**
+ * \brief Forget the previous fix and the cached measurements.
+ * 
+ * \param lsq Tracker.
+ */
+void 
+ble_lsq_reset(ble_lsq_t *lsq)
+{
+    lsq->ap_count = 0;
+    lsq->fix.pos.x = lsq->cfg.area.x / 2;
+    lsq->fix.pos.y = lsq->cfg.area.y / 2;
+    lsq->has_fix = 0;
+    lsq->rms = 0;
+    lsq->iterations = 0;
+}
+
+/**
+ * \brief Weight of every AP by the age of its measurement, as in the particle filter,
+ * see ble_particle_ap_age_scale.
+ * 
+ * \param lsq Tracker.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ * \param now_us Time the ages are relative to, 0 gives every AP the same weight.
+ * \param weights Array of ap_count, filled with the weights.
+ */
+static void 
+ble_lsq_weights(const ble_lsq_t *lsq, const ble_particle_ap_t *aps, int ap_count, 
+    int64_t now_us, float *weights)
+{
+    for (int j = 0; j < ap_count; j++)
+        weights[j] = ble_particle_ap_age_scale(&lsq->cfg, aps[j].timestamp_us, now_us);
+}
+
+/**
+ * \brief Gauss-Newton fix of the position that minimizes the weighted squared differences
+ * between the measured distances and the distances to the APs.
+ * Starts at the previous fix, or at the closed-form trilateration for the first one.
+ * Residuals beyond LSQ_HUBER_K are down-weighted, so a single bad distance pulls less.
+ * 
+ * \param lsq Tracker, written with the fix, its rms residual and the iterations.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ * \param weights Weight of every AP.
+ * 
+ * \return 0 on succes, -1 with fewer than LSQ_MIN_APS weighted APs.
+ */
+static int 
+ble_lsq_solve(ble_lsq_t *lsq, const ble_particle_ap_t *aps, int ap_count, 
+    const float *weights)
+{
+    ble_particle_ap_t used[NO_OF_APS];
+    float w[NO_OF_APS];
+    int n = 0;
+    for (int j = 0; j < ap_count && n < NO_OF_APS; j++) {
+        if (weights[j] <= 0)
+            continue;
+        used[n] = aps[j];
+        w[n++] = weights[j];
+    }
+    if (n < LSQ_MIN_APS)
+        return -1;
+
+    float area_x = lsq->cfg.area.x, area_y = lsq->cfg.area.y;
+    ble_particle_node_t start;
+    if (!lsq->has_fix && ble_particle_trilaterate(used, n, &start, NULL) == 0)
+        lsq->fix = start;
+    float x = clampf(lsq->fix.pos.x, 0, area_x), y = clampf(lsq->fix.pos.y, 0, area_y);
+
+    int it = 0;
+    while (it < LSQ_MAX_ITERATIONS) {
+        it++;
+        // normal equations J^T W J and gradient J^T W r
+        float a11 = 0, a12 = 0, a22 = 0, g1 = 0, g2 = 0;
+        for (int j = 0; j < n; j++) {
+            float dx = x - used[j].pos.x, dy = y - used[j].pos.y;
+            float r = sqrtf((dx * dx) + (dy * dy));
+            // on top of the AP the direction is undefined, step away along x
+            if (r < 1e-4F) {
+                dx = r = 1e-4F;
+                dy = 0;
+            }
+            float res = r - used[j].node_distance;
+            float hw = w[j];
+            if (LSQ_HUBER_K > 0 && fabsf(res) > LSQ_HUBER_K)
+                hw *= LSQ_HUBER_K / fabsf(res);
+            float jx = dx / r, jy = dy / r;
+            a11 += hw * jx * jx;
+            a12 += hw * jx * jy;
+            a22 += hw * jy * jy;
+            g1 += hw * jx * res;
+            g2 += hw * jy * res;
+        }
+        float damping = LSQ_DAMPING * (a11 + a22);
+        a11 += damping;
+        a22 += damping;
+        float det = (a11 * a22) - (a12 * a12);
+        if (det <= 0)
+            break;
+        float sx = -((a22 * g1) - (a12 * g2)) / det;
+        float sy = -((a11 * g2) - (a12 * g1)) / det;
+        float nx = clampf(x + sx, 0, area_x), ny = clampf(y + sy, 0, area_y);
+        float step = ((nx - x) * (nx - x)) + ((ny - y) * (ny - y));
+        x = nx;
+        y = ny;
+        if (step < LSQ_TOLERANCE * LSQ_TOLERANCE)
+            break;
+    }
+
+    float sum = 0, total = 0;
+    for (int j = 0; j < n; j++) {
+        float dx = x - used[j].pos.x, dy = y - used[j].pos.y;
+        float res = sqrtf((dx * dx) + (dy * dy)) - used[j].node_distance;
+        sum += w[j] * res * res;
+        total += w[j];
+    }
+    lsq->fix.pos.x = x;
+    lsq->fix.pos.y = y;
+    lsq->has_fix = 1;
+    lsq->rms = sqrtf(sum / total);
+    lsq->iterations = it;
+
+    return 0;
+}
+
+/**
+ * \brief Fix the position of the node from a set of AP measurements,
+ * in place of ble_particle_filter_update. Each fix stands on its own, 
+ * the previous one is only the starting point. With too few APs the previous fix is kept.
+ * 
+ * \param lsq Tracker.
+ * \param data Pointer to a structure with AP measurements and their timestamp,
+ * written with the position and 0 particles.
+ * 
+ * \return 0 on succes, also when the previous fix is kept, -1 on failure or
+ * when there is no fix yet.
+ */
+int 
+ble_lsq_update(ble_lsq_t *lsq, ble_particle_data_t *data)
+{
+    if (lsq == NULL || data == NULL || data->ap_count < 0 || data->ap_count > NO_OF_APS)
+        return -1;
+    // ages relative to the set, or to the newest measurement without a set time
+    int64_t now_us = data->timestamp_us;
+    for (int j = 0; j < data->ap_count && now_us == 0; j++) {
+        if (data->aps[j].timestamp_us > now_us)
+            now_us = data->aps[j].timestamp_us;
+    }
+    float weights[NO_OF_APS];
+    ble_lsq_weights(lsq, data->aps, data->ap_count, now_us, weights);
+    // without a first fix there is no position to report, the area center is made up
+    if (ble_lsq_solve(lsq, data->aps, data->ap_count, weights) != 0 && !lsq->has_fix)
+        return -1;
+
+    data->node = lsq->fix;
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Fix the position with a single new AP measurement and the recent ones of the other APs,
+ * in place of ble_particle_filter_observe.
+ * 
+ * \param lsq Tracker.
+ * \param ap Measurement of a single AP.
+ * \param data Written with the recent measurements, the position and 0 particles.
+ * 
+ * \return 0 on succes, -1 on failure or when there is no fix yet,
+ * the measurement is kept for the next one.
+ */
+int 
+ble_lsq_observe(ble_lsq_t *lsq, const ble_particle_ap_t *ap, ble_particle_data_t *data)
+{
+    if (lsq == NULL || ap == NULL || data == NULL)
+        return -1;
+    ble_particle_keep_ap(lsq->aps, &lsq->ap_count, ap);
+
+    float weights[NO_OF_APS];
+    ble_lsq_weights(lsq, lsq->aps, lsq->ap_count, ap->timestamp_us, weights);
+    if (ble_lsq_solve(lsq, lsq->aps, lsq->ap_count, weights) != 0 && !lsq->has_fix)
+        return -1;
+
+    memcpy(data->aps, lsq->aps, sizeof(lsq->aps));
+    data->ap_count = lsq->ap_count;
+    data->timestamp_us = ap->timestamp_us;
+    data->node = lsq->fix;
+    data->particles = 0;
+    return 0;
+}
+
+/**
+ * \brief Write the last fix of a tracker to a snapshot.
+ * 
+ * \param lsq Tracker.
+ * \param s Snapshot to append to.
+ */
+void 
+ble_lsq_pack(const ble_lsq_t *lsq, ble_snapshot_t *s)
+{
+    float fix[] = {lsq->fix.pos.x, lsq->fix.pos.y, lsq->rms};
+    int32_t has_fix = lsq->has_fix;
+    ble_snapshot_put(s, fix, sizeof(fix));
+    ble_snapshot_put(s, &has_fix, sizeof(has_fix));
+}
+
+/**
+ * \brief Restore the last fix of a tracker written by ble_lsq_pack.
+ * 
+ * \param lsq Tracker, unchanged on failure.
+ * \param s Snapshot to read from.
+ * 
+ * \return 0 on succes, -1 when the snapshot is cut short.
+ */
+int 
+ble_lsq_unpack(ble_lsq_t *lsq, ble_snapshot_t *s)
+{
+    float fix[3];
+    int32_t has_fix;
+    ble_snapshot_get(s, fix, sizeof(fix));
+    ble_snapshot_get(s, &has_fix, sizeof(has_fix));
+    if (s->error)
+        return -1;
+    ble_lsq_reset(lsq);
+    lsq->fix.pos.x = clampf(fix[0], 0, lsq->cfg.area.x);
+    lsq->fix.pos.y = clampf(fix[1], 0, lsq->cfg.area.y);
+    lsq->rms = fix[2];
+    lsq->has_fix = (has_fix != 0);
+    return 0;
+}
@@ -0,0 +1,184 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/lut.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef NATIVE
+#include <esp_heap_caps.h>
+#endif
+
+#include "lut.h"
+
+/**
+ * \brief Allocate the distance planes.
+ * On the ESP32 they go to PSRAM when LUT_PSRAM is defined,
+ * which keeps large grids out of the internal DRAM.
+ * 
+ * \param bytes Size in bytes.
+ * 
+ * \return Pointer to the memory, NULL on error.
+ */
+static void *
+ble_lut_alloc(size_t bytes)
+{
+#if !defined(NATIVE) && defined(LUT_PSRAM)
+    return heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    return malloc(bytes);
+#endif
+}
+
+/**
+ * \brief Create an empty lookup table, the planes are built on their first use.
+ * 
+ * \param area_x Width of the area in meters.
+ * \param area_y Height of the area in meters.
+ * \param resolution Grid spacing in meters.
+ * \param planes Amount of APs the table holds at the same time.
+ * \param interp LUT_NEAREST or LUT_BILINEAR.
+ * 
+ * \return Pointer to the table, NULL on error.
+ */
+ble_lut_t *
+ble_lut_create(float area_x, float area_y, float resolution, int planes, 
+    ble_lut_interp_t interp)
+{
+    if (area_x <= 0 || area_y <= 0 || resolution <= 0 || planes < 1)
+        return NULL;
+
+    ble_lut_t *lut = calloc(1, sizeof(ble_lut_t));
+    if (lut == NULL)
+        return NULL;
+    // a grid point on both borders, and at least two per axis for interpolation
+    lut->cols = (int)ceilf(area_x / resolution) + 1;
+    lut->rows = (int)ceilf(area_y / resolution) + 1;
+    lut->area_x = area_x;
+    lut->area_y = area_y;
+    lut->inv_res = 1.0F / resolution;
+    lut->interp = interp;
+    lut->plane_count = planes;
+    lut->planes = calloc(planes, sizeof(ble_lut_plane_t));
+    lut->dist = ble_lut_alloc((size_t)planes * lut->rows * lut->cols * sizeof(float));
+    if (lut->planes == NULL || lut->dist == NULL) {
+        ble_lut_destroy(lut);
+        return NULL;
+    }
+    for (int p = 0; p < planes; p++)
+        lut->planes[p].id = LUT_ID_NONE;
+
+    return lut;
+}
+
+/**
+ * \brief Calculate the normalized distance from an AP to every grid point.
+ * 
+ * \param lut Lookup table.
+ * \param plane Plane to fill.
+ * \param x X coordinate of the AP.
+ * \param y Y coordinate of the AP.
+ */
+static void 
+ble_lut_build(ble_lut_t *lut, int plane, float x, float y)
+{
+    float *dist = lut->dist + ((size_t)plane * lut->rows * lut->cols);
+    float res = 1.0F / lut->inv_res;
+    float inv_area_diag = 1.0F / sqrtf((lut->area_x * lut->area_x) + (lut->area_y * lut->area_y));
+
+    for (int r = 0; r < lut->rows; r++) {
+        float dy = y - ((float)r * res);
+        for (int c = 0; c < lut->cols; c++) {
+            float dx = x - ((float)c * res);
+            dist[(r * lut->cols) + c] = sqrtf((dx * dx) + (dy * dy)) * inv_area_diag;
+        }
+    }
+}
+
+/**
+ * \brief Get the plane of an AP, build it when the AP is new or has moved.
+ * A new AP takes the least recently used plane.
+ * Not thread safe, look up the planes before the weighting kernel runs.
+ * 
+ * \param lut Lookup table.
+ * \param id ID of the AP.
+ * \param x X coordinate of the AP.
+ * \param y Y coordinate of the AP.
+ * 
+ * \return Index of the plane.
+ */
+int 
+ble_lut_plane(ble_lut_t *lut, int id, float x, float y)
+{
+    int lru = 0;
+    lut->tick++;
+    for (int p = 0; p < lut->plane_count; p++) {
+        ble_lut_plane_t *plane = &lut->planes[p];
+        if (plane->id == id) {
+            if (plane->x != x || plane->y != y) {
+                ble_lut_build(lut, p, x, y);
+                plane->x = x;
+                plane->y = y;
+            }
+            plane->used = lut->tick;
+            return p;
+        }
+        if (plane->used < lut->planes[lru].used)
+            lru = p;
+    }
+
+    ble_lut_build(lut, lru, x, y);
+    lut->planes[lru] = (ble_lut_plane_t){.id = id, .x = x, .y = y, .used = lut->tick};
+    return lru;
+}
+
+/**
+ * \brief Get the memory used by a lookup table.
+ * 
+ * \param lut Lookup table.
+ * 
+ * \return Size in bytes.
+ */
+size_t 
+ble_lut_footprint(const ble_lut_t *lut)
+{
+    return sizeof(ble_lut_t) + (lut->plane_count * sizeof(ble_lut_plane_t)) + 
+        ((size_t)lut->plane_count * lut->rows * lut->cols * sizeof(float));
+}
+
+/**
+ * \brief Free a lookup table.
+ * 
+ * \param lut Lookup table, may be NULL.
+ */
+void 
+ble_lut_destroy(ble_lut_t *lut)
+{
+    if (lut == NULL)
+        return;
+    free(lut->planes);
+    // heap_caps_malloc memory is released with free as well
+    free(lut->dist);
+    free(lut);
+}
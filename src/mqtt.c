@@ -29,11 +29,16 @@
 #include <string.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
 #include "mqtt.h"
 #include "config.h"
 #include "particle.h"
+#include "node.h"
+#include "rssi.h"
+#include "snapshot.h"
 #include "wifi.h"
 
 static const char *TAG = "mqtt";
@@ -43,11 +48,26 @@ static ble_mqtt_state_t mqtt_state = MQTT_STATE_DISCONNECTED;
 static int reconnect_tries = 0;
 
 #ifdef HOST
-static ble_particle_ap_t ap_data[NO_OF_APS];
-static ble_particle_data_t pf_data;
+static ble_node_table_t node_table;
+static ble_pool_t *pf_pool = NULL;
+static ble_lut_t *pf_lut = NULL;
 static SemaphoreHandle_t xSemaphore = NULL;
+// a single AP measurement of a node
+typedef struct {
+    int node_id;
+    ble_particle_ap_t ap;
+} ble_mqtt_measurement_t;
+// single measurements, cached into sets or weighted with PF_STREAMING by the update task,
+// so the MQTT and BLE callbacks never wait for an update
+static QueueHandle_t pf_queue = NULL;
+// measurements that did not fit in the queue, counted by the callbacks outside the semaphore
+static unsigned int queue_dropped = 0;
+static portMUX_TYPE queue_dropped_lock = portMUX_INITIALIZER_UNLOCKED;
 static ble_mqtt_task_t extra_task = TASK_NONE;
-static int event_idx = 0;
+
+static const char *engine_names[NODE_ENGINE_COUNT] = {
+    "Particle filter", "Least-squares", "EKF", "Grid filter"
+};
 #endif
 
 /**
@@ -65,63 +85,152 @@ ble_mqtt_log_if_nonzero(const char *message, int error_code)
 }
 
 #ifdef HOST
+/**
+ * \brief Name of an engine for the log.
+ * 
+ * \param engine Engine, may be out of range when it was received over MQTT.
+ * 
+ * \return Name of the engine.
+ */
+static const char *
+ble_mqtt_engine_name(ble_node_engine_t engine)
+{
+    return (engine >= 0 && engine < NODE_ENGINE_COUNT) ? engine_names[engine] : "Unknown engine";
+}
+
 /**
  * \brief Write the node position to STDOUT.
+ * 
+ * \param node Node to print.
  */
 static void 
-ble_mqtt_node_print(void)
+ble_mqtt_node_print(ble_node_t *node)
 {
-    printf("%g,%g\n", pf_data.node.pos.x, pf_data.node.pos.y);
+    printf("%d,%g,%g\n", node->id, node->data.node.pos.x, node->data.node.pos.y);
 }
 
 /**
- * \brief Publish the node state to a MQTT topic "node".
+ * \brief Publish the node state to a MQTT topic "node/<id>".
+ * 
+ * \param node Node to publish.
  */
 static void 
-ble_mqtt_node_publish(void)
+ble_mqtt_node_publish(ble_node_t *node)
 {
-    char *payload;
-    int ret = asprintf(&payload, "%g,%g", pf_data.node.pos.x, pf_data.node.pos.y);
+    char *topic, *payload;
+    if (asprintf(&topic, "%s/%d", NODE_TOPIC, node->id) == ESP_FAIL)
+        return;
+    int ret = asprintf(&payload, "%g,%g", node->data.node.pos.x, node->data.node.pos.y);
     if (ret != ESP_FAIL) {
         if (ble_mqtt_get_state() == MQTT_STATE_CONNECTED)
-            esp_mqtt_client_publish(ble_mqtt_get_client(), NODE_TOPIC, payload, 0, 0, 0);
+            esp_mqtt_client_publish(ble_mqtt_get_client(), topic, payload, 0, 0, 0);
         free(payload);
     }
+    free(topic);
 }
 
+/**
+ * \brief Update the filter of a node and run the extra task.
+ * 
+ * \param node Node with a pending measurement set.
+ * \param ap Single measurement to weight with, NULL to update with the set in node->data.
+ */
+static void 
+ble_mqtt_update_node(ble_node_t *node, const ble_particle_ap_t *ap)
+{
+    // update particle filter, or the engine of the node
+    int ret = ble_node_update(node, ap);
+    // execute extra task only after the engine was updated
+    if (ret == ESP_OK) {
+        ESP_LOGD(TAG, "Node %d updated with %d particles", node->id, node->data.particles);
+        switch (extra_task) {
+        case TASK_PRINT_NODE_STATE:
+            ble_mqtt_node_print(node);
+            break;
+        case TASK_PUBLISH_NODE_STATE:
+            ble_mqtt_node_publish(node);
+            break;
+        default:
+            break;
+        }
+    }
+    else
+        ESP_LOGE(TAG, "%s update failed for node %d", ble_mqtt_engine_name(node->engine), 
+            node->id);
+}
+
+#if PF_STREAMING
+/**
+ * \brief Task that weights the particle filter of a node with every measurement
+ * as soon as it is received, and runs the motion model of all nodes every PF_PREDICT_MS.
+ * It runs for the lifetime of the HOST.
+ * 
+ * \param pv_params Unused, provided to xTaskCreatePinnedToCore.
+ */ 
+static void 
+ble_mqtt_update_pf_task(void *pv_params)
+{
+    int64_t next_predict_us = esp_timer_get_time() + (PF_PREDICT_MS * 1000LL);
+    for (;;) {
+        ble_mqtt_measurement_t m;
+        int64_t wait_us = next_predict_us - esp_timer_get_time();
+        TickType_t wait = (wait_us > 0) ? pdMS_TO_TICKS(wait_us / 1000) : 0;
+        int received = (xQueueReceive(pf_queue, &m, wait) == pdTRUE);
+        if (xSemaphoreTake(xSemaphore, portMAX_DELAY) != pdTRUE)
+            continue;
+        if (received) {
+            ble_node_t *node = ble_node_table_get(&node_table, m.node_id, m.ap.timestamp_us);
+            if (node != NULL)
+                ble_mqtt_update_node(node, &m.ap);
+        }
+        int64_t now_us = esp_timer_get_time();
+        if (now_us >= next_predict_us) {
+            ble_node_table_predict(&node_table, now_us);
+            next_predict_us += PF_PREDICT_MS * 1000LL;
+            // skip the ticks that were missed, predict catches up with the time step
+            if (next_predict_us <= now_us)
+                next_predict_us = now_us + (PF_PREDICT_MS * 1000LL);
+        }
+        xSemaphoreGive(xSemaphore);
+    }
+}
+#else
 /**
  * \brief Task that updates the particle filter with new data upon receiving new events.
+ * It runs for the lifetime of the HOST, caches the measurements of the queue per node
+ * and updates the filter of a node once they form a set, see NODE_MIN_APS.
  * 
- * \param pv_params Parameter provided to XTaskCreate.
+ * \param pv_params Unused, provided to xTaskCreatePinnedToCore.
  */ 
 static void 
 ble_mqtt_update_pf_task(void *pv_params)
 {
-    // try to take the semaphore to write a new node state
-    // poll the semaphore (don't block) because values are received fast
-    if (xSemaphoreTake(xSemaphore, (TickType_t)0) == pdTRUE) {
-        // update particle filter
-        int ret = ble_particle_update(&pf_data);
+    for (;;) {
+        ble_mqtt_measurement_t m;
+        if (xQueueReceive(pf_queue, &m, portMAX_DELAY) != pdTRUE)
+            continue;
+        if (xSemaphoreTake(xSemaphore, portMAX_DELAY) != pdTRUE)
+            continue;
+        ble_node_t *node = ble_node_table_get(&node_table, m.node_id, m.ap.timestamp_us);
+        if (node != NULL && ble_node_store_ap_data(node, m.ap))
+            ble_mqtt_update_node(node, NULL);
         // return access to the resource
         xSemaphoreGive(xSemaphore);
-        // execute extra task only after particle filter was updated
-        if (ret == ESP_OK) {
-            switch (extra_task) {
-            case TASK_PRINT_NODE_STATE:
-                ble_mqtt_node_print();
-                break;
-            case TASK_PUBLISH_NODE_STATE:
-                ble_mqtt_node_publish();
-                break;
-            default:
-                break;
-            }
-        }
-        else
-            ESP_LOGE(TAG, "Particle filter update failed");
     }
-    // delete task after it is done, as it should only run once
-    vTaskDelete(NULL);
+}
+#endif
+
+/**
+ * \brief Count a measurement that was dropped because the queue was full.
+ */
+static void 
+ble_mqtt_count_dropped(void)
+{
+    taskENTER_CRITICAL(&queue_dropped_lock);
+    unsigned int dropped = ++queue_dropped;
+    taskEXIT_CRITICAL(&queue_dropped_lock);
+    if (dropped % PF_DROP_LOG == 0)
+        ESP_LOGW(TAG, "Dropped %u measurements", dropped);
 }
 
 /**
@@ -136,28 +245,63 @@ ble_mqtt_set_task(ble_mqtt_task_t task)
 }
 
 /**
- * \brief Cache new AP data.
- * The HOST AP caches the data directly instead of publishing via MQTT.
- * This function is only relevant for the HOST device.
+ * \brief Pass new AP data for a node on to the update task, which caches it,
+ * or weights the filter with it with PF_STREAMING. Never waits for an update,
+ * it runs in the MQTT event handler and the BLE GAP callback.
  * 
+ * \param node_id ID of the node the measurement belongs to.
  * \param data Struct holding the pre-processed RSSI and position.
  */
 void 
-ble_mqtt_store_ap_data(ble_particle_ap_t data)
+ble_mqtt_store_ap_data(int node_id, ble_particle_ap_t data)
 {
-    for (int i = 0; i < NO_OF_APS; i++) {
-        // we already cached an event from the HOST AP
-        // replace it with the newer data for better accuracy
-        if (ap_data[i].id == data.id) {
-            ap_data[i] = data;
-            return;
-        }
-    }
-    // safeguard
-    if (event_idx == NO_OF_APS)
+    // the update task was not created
+    if (xSemaphore == NULL)
         return;
+    // the APs do not send the time of their measurement, the time of arrival is used
+    data.timestamp_us = esp_timer_get_time();
+    // the node is looked up by the update task, it may be evicted before then
+    ble_mqtt_measurement_t m = {.node_id = node_id, .ap = data};
+    if (xQueueSend(pf_queue, &m, 0) != pdTRUE)
+        ble_mqtt_count_dropped();
+}
+
+/**
+ * \brief Switch the engine that tracks a node, see ble_node_set_engine.
+ * The node is claimed when it was not seen yet.
+ * 
+ * \param node_id ID of the node.
+ * \param engine New engine.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_mqtt_set_node_engine(int node_id, ble_node_engine_t engine)
+{
+    if (xSemaphore == NULL || xSemaphoreTake(xSemaphore, portMAX_DELAY) != pdTRUE)
+        return -1;
+    ble_node_t *node = ble_node_table_get(&node_table, node_id, esp_timer_get_time());
+    int ret = (node != NULL) ? ble_node_set_engine(&node_table, node, engine) : -1;
+    xSemaphoreGive(xSemaphore);
+    if (ret == 0)
+        ESP_LOGI(TAG, "Node %d switched to %s", node_id, ble_mqtt_engine_name(engine));
     else
-        ap_data[event_idx++] = data;
+        ESP_LOGW(TAG, "Unable to switch node %d to %s", node_id, ble_mqtt_engine_name(engine));
+    return ret;
+}
+
+/**
+ * \brief Get the amount of measurements that were dropped before an update.
+ * 
+ * \return Amount of dropped measurements.
+ */
+unsigned int 
+ble_mqtt_get_dropped(void)
+{
+    taskENTER_CRITICAL(&queue_dropped_lock);
+    unsigned int dropped = queue_dropped;
+    taskEXIT_CRITICAL(&queue_dropped_lock);
+    return dropped;
 }
 #endif
 
@@ -183,6 +327,7 @@ ble_mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_
         // in case of receiving values realtime, QoS 0 provides the least overhead
         // if a value is lost, it doesn't matter as we get a new more up to date value later
         esp_mqtt_client_subscribe(client, AP_TOPIC, 0);
+        esp_mqtt_client_subscribe(client, ENGINE_TOPIC, 1);
 #endif
         break;
     case MQTT_EVENT_DISCONNECTED:
@@ -201,14 +346,25 @@ ble_mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_
         break;
     case MQTT_EVENT_DATA:
 #ifdef HOST
+        // an engine switch is rare, it is parsed on its own
+        if (event->topic_len == strlen(ENGINE_TOPIC) && 
+                strncmp(event->topic, ENGINE_TOPIC, event->topic_len) == ESP_OK) {
+            int node_id, engine;
+            char *engine_buf = strndup(event->data, event->data_len);
+            if (engine_buf != NULL && sscanf(engine_buf, "%d,%d", &node_id, &engine) == 2)
+                ble_mqtt_set_node_engine(node_id, (ble_node_engine_t)engine);
+            free(engine_buf);
+            break;
+        }
         // check that topic matches
         if (strncmp(event->topic, AP_TOPIC, event->topic_len) != ESP_OK)
             break;
 
         char *data_buf = strndup(event->data, event->data_len);
         ble_particle_ap_t data = {0};
+        int node_id = 0;
         // split data string, delimiter is comma
-        // format: [id,distance,posx,posy]
+        // format: [id,distance,posx,posy,node], node is 0 when omitted
         for (int i = 0; i < strlen(data_buf); i++) {
             // split ID
             char *id_p = strtok(data_buf, ",");
@@ -230,21 +386,14 @@ ble_mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_
             if (posy_p != NULL) {
                 data.pos.y = strtof(posy_p, &posy_p);
             }
+            // split node
+            char *node_p = strtok(NULL, ",");
+            if (node_p != NULL) {
+                node_id = (int)strtol(node_p, &node_p, 10);
+            }
         }
         free(data_buf);
-        ble_mqtt_store_ap_data(data);
-
-        // check if we have a value for each AP
-        if (event_idx == NO_OF_APS) {
-            memcpy(pf_data.aps, ap_data, sizeof(ap_data));
-            // create task for particle update to prevent exceeding watchdog timer
-            TaskHandle_t xHandle;
-            xTaskCreate(ble_mqtt_update_pf_task, PF_TASK_NAME, PF_TASK_SIZE, 
-                NULL, PF_TASK_PRIO, &xHandle);
-            // reset counter & clear buffer
-            event_idx = 0;
-            memset(ap_data, 0, sizeof(ap_data));
-        }
+        ble_mqtt_store_ap_data(node_id, data);
 #endif
         break;
     case MQTT_EVENT_BEFORE_CONNECT:
@@ -270,6 +419,83 @@ ble_mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_
     }
 }
 
+/**
+ * \brief Restore the filters from the snapshots of before a restart,
+ * when they are recent enough. Call before scanning starts, the MQTT client
+ * and the update task run, the filters are not locked.
+ */
+static void 
+ble_mqtt_restore_snapshots(void)
+{
+    ble_snapshot_t s = {0};
+    if (ble_snapshot_load(&s, SNAPSHOT_KIND_RSSI, SNAPSHOT_RSSI_PATH, SNAPSHOT_MAX_AGE_S) == 0) {
+        if (ble_rssi_unpack(&s) == 0)
+            ESP_LOGI(TAG, "Restored RSSI filters");
+        else
+            ESP_LOGW(TAG, "RSSI snapshot does not match, ignored");
+    }
+    free(s.buf);
+#ifdef HOST
+    s = (ble_snapshot_t){0};
+    if (ble_snapshot_load(&s, SNAPSHOT_KIND_NODES, SNAPSHOT_NODES_PATH, SNAPSHOT_MAX_AGE_S) == 0) {
+        int count = ble_node_table_unpack(&node_table, &s, esp_timer_get_time());
+        if (count >= 0)
+            ESP_LOGI(TAG, "Restored the particle filters of %d nodes", count);
+        else
+            ESP_LOGW(TAG, "Node snapshot does not match, restored part of the nodes");
+    }
+    free(s.buf);
+#endif
+}
+
+/**
+ * \brief Task writing a snapshot of the filters every SNAPSHOT_INTERVAL_MS.
+ * The particle filters are copied under the semaphore,
+ * the slow write to flash happens after it is released.
+ * 
+ * \param pv_params Unused, provided to xTaskCreate.
+ */
+static void 
+ble_mqtt_snapshot_task(void *pv_params)
+{
+    ble_snapshot_t rssi = {0};
+    // the RSSI payload has a fixed size, counted without a buffer
+    ble_rssi_pack(&rssi);
+    rssi = (ble_snapshot_t){.buf = malloc(rssi.len), .cap = rssi.len};
+#ifdef HOST
+    ble_snapshot_t nodes = {0};
+#endif
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(SNAPSHOT_INTERVAL_MS));
+        rssi.len = 0;
+        rssi.error = 0;
+        if (rssi.buf == NULL || ble_rssi_pack(&rssi) != 0 || 
+                ble_snapshot_save(&rssi, SNAPSHOT_KIND_RSSI, SNAPSHOT_RSSI_PATH) != 0)
+            ESP_LOGW(TAG, "Unable to write RSSI snapshot");
+#ifdef HOST
+        if (xSemaphoreTake(xSemaphore, portMAX_DELAY) != pdTRUE)
+            continue;
+        // the payload grows with the amount of nodes and particles
+        ble_snapshot_t count = {0};
+        ble_node_table_pack(&node_table, &count);
+        if (count.len > nodes.cap) {
+            uint8_t *buf = realloc(nodes.buf, count.len);
+            if (buf != NULL) {
+                nodes.buf = buf;
+                nodes.cap = count.len;
+            }
+        }
+        nodes.len = 0;
+        nodes.error = 0;
+        int err = (nodes.buf == NULL) ? -1 : ble_node_table_pack(&node_table, &nodes);
+        xSemaphoreGive(xSemaphore);
+        if (err != 0 || ble_snapshot_save(&nodes, SNAPSHOT_KIND_NODES, SNAPSHOT_NODES_PATH) != 0)
+            ESP_LOGW(TAG, "Unable to write node snapshot");
+#endif
+    }
+}
+
 /**
  * \brief Initialize MQTT broker connection and event loop.
  */
@@ -295,16 +521,59 @@ ble_mqtt_init(void)
     // subscribe to events
     ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, 
         ble_mqtt_event_handler, NULL));
-    ESP_ERROR_CHECK(esp_mqtt_client_start(client));
 #ifdef HOST
+    // every node gets its own particle filter once it is seen
+    // the filters share a pool with a worker on every core
+    // updates are serialized by the semaphore, so only one filter uses it at a time
+    ble_particle_config_t pf_cfg = BLE_PARTICLE_CONFIG_DEFAULT();
+    pf_cfg.min_particles = PF_MIN_PARTICLES;
+    // the other engines use neither, a node switched to the particle filter at runtime
+    // then updates on a single core and calculates the distances
+    if (NODE_ENGINE == NODE_ENGINE_PARTICLE) {
+        pf_pool = ble_pool_create(PF_WORKERS);
+        if (pf_pool == NULL)
+            ESP_LOGW(TAG, "Unable to create filter workers, updating on a single core");
+    }
+    if (NODE_ENGINE == NODE_ENGINE_PARTICLE && PF_LUT) {
+        // the APs are static, so their distance to every point of the area is calculated once
+        pf_lut = ble_lut_create(pf_cfg.area.x, pf_cfg.area.y, LUT_RESOLUTION, NO_OF_APS, 
+            LUT_BILINEAR);
+        if (pf_lut != NULL)
+            ESP_LOGI(TAG, "Distance lookup table uses %u bytes", 
+                (unsigned)ble_lut_footprint(pf_lut));
+        else
+            ESP_LOGW(TAG, "Unable to create distance lookup table, calculating distances");
+    }
+    ble_node_table_init(&node_table, &pf_cfg, pf_pool, pf_lut);
     // initialize mutex semaphore
     xSemaphore = xSemaphoreCreateMutex();
-    if (xSemaphore == NULL) {
-        ESP_ERROR_CHECK(esp_mqtt_client_stop(client));
+    pf_queue = xQueueCreate(PF_QUEUE_LENGTH, sizeof(ble_mqtt_measurement_t));
+#endif
+    // continue from the state of before a restart, before the client and the update task
+    // run, so no measurement touches the filters while they are restored
+    int snapshots = (ble_snapshot_init() == 0);
+    if (snapshots)
+        ble_mqtt_restore_snapshots();
+#ifdef HOST
+    // a single long-lived task updates the filters, to prevent exceeding watchdog timer
+    // it runs on the core of the filter pool, away from BLE and MQTT
+    if (xSemaphore == NULL || pf_queue == NULL || 
+            xTaskCreatePinnedToCore(ble_mqtt_update_pf_task, PF_TASK_NAME, PF_TASK_SIZE, 
+                NULL, PF_TASK_PRIO, NULL, PF_TASK_CORE) != pdPASS) {
         ESP_ERROR_CHECK(esp_wifi_stop());
-        ESP_LOGE(TAG, "Unable to create semaphore, closing connections");
+        ESP_LOGE(TAG, "Unable to create particle filter task, closing connections");
+        // ble_mqtt_store_ap_data checks the semaphore before using the queue
+        if (xSemaphore != NULL)
+            vSemaphoreDelete(xSemaphore);
+        xSemaphore = NULL;
+        return;
     }
 #endif
+    ESP_ERROR_CHECK(esp_mqtt_client_start(client));
+    // keep the state up to date
+    if (snapshots && xTaskCreate(ble_mqtt_snapshot_task, SNAPSHOT_TASK_NAME, SNAPSHOT_TASK_SIZE, 
+            NULL, SNAPSHOT_TASK_PRIO, NULL) != pdPASS)
+        ESP_LOGW(TAG, "Unable to create snapshot task, the filter state is not kept");
 }
 
 /**
@@ -0,0 +1,402 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/node.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "node.h"
+#include "particle.h"
+
+/**
+ * \brief Initialize an empty node table.
+ * 
+ * \param table Node table.
+ * \param cfg Configuration used for the filter of every node.
+ * \param pool Pool shared by the filters, NULL to update on the calling task.
+ * \param lut Distance lookup table shared by the filters, NULL to calculate the distances.
+ * Filters sharing a pool or table must not be updated at the same time.
+ */
+void 
+ble_node_table_init(ble_node_table_t *table, const ble_particle_config_t *cfg, 
+    ble_pool_t *pool, ble_lut_t *lut)
+{
+    memset(table, 0, sizeof(ble_node_table_t));
+    table->cfg = *cfg;
+    table->pool = pool;
+    table->lut = lut;
+    table->engine = NODE_ENGINE;
+    table->grid_cell_size = GRID_CELL_SIZE;
+    for (int i = 0; i < NODE_TABLE_SIZE; i++)
+        table->nodes[i].id = NODE_ID_NONE;
+}
+
+/**
+ * \brief Free the filters of all nodes in the table.
+ * 
+ * \param table Node table.
+ */
+void 
+ble_node_table_free(ble_node_table_t *table)
+{
+    for (int i = 0; i < NODE_TABLE_SIZE; i++) {
+        ble_particle_filter_destroy(table->nodes[i].pf);
+        table->nodes[i].pf = NULL;
+        ble_grid_destroy(table->nodes[i].grid);
+        table->nodes[i].grid = NULL;
+        table->nodes[i].id = NODE_ID_NONE;
+    }
+}
+
+/**
+ * \brief Start tracking a node from scratch with an engine.
+ * The particle filter and the grid are allocated on first use, and kept when the node switches
+ * to another engine, so they are reused once the node, or the next one in its entry, switches back.
+ * 
+ * \param table Node table.
+ * \param node Node.
+ * \param engine Engine.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+static int 
+ble_node_start_engine(ble_node_table_t *table, ble_node_t *node, ble_node_engine_t engine)
+{
+    switch (engine) {
+    case NODE_ENGINE_PARTICLE:
+        // start with a uniform prior
+        if (node->pf == NULL) {
+            node->pf = ble_particle_filter_create(&table->cfg);
+            if (node->pf == NULL)
+                return -1;
+            if ((table->pool != NULL && ble_particle_filter_set_pool(node->pf, table->pool) != 0) || 
+                    ble_particle_filter_set_lut(node->pf, table->lut) != 0) {
+                ble_particle_filter_destroy(node->pf);
+                node->pf = NULL;
+                return -1;
+            }
+        } else if (ble_particle_filter_reset(node->pf) != 0) {
+            return -1;
+        }
+        break;
+    case NODE_ENGINE_LSQ:
+        ble_lsq_init(&node->lsq, &table->cfg);
+        break;
+    case NODE_ENGINE_EKF:
+        ble_ekf_init(&node->ekf, &table->cfg);
+        break;
+    case NODE_ENGINE_GRID:
+        // a grid of another cell size is replaced
+        if (node->grid != NULL && node->grid->cell_size != table->grid_cell_size) {
+            ble_grid_destroy(node->grid);
+            node->grid = NULL;
+        }
+        if (node->grid == NULL) {
+            node->grid = ble_grid_create(&table->cfg, table->grid_cell_size);
+            if (node->grid == NULL)
+                return -1;
+        } else {
+            ble_grid_reset(node->grid);
+        }
+        break;
+    default:
+        return -1;
+    }
+    node->engine = engine;
+    return 0;
+}
+
+/**
+ * \brief Look up a node by ID, or claim an entry for it when it is new.
+ * A new node takes a free entry, or the entry of the least recently seen node.
+ * The filter of an evicted node is reset and reused, so its memory stays allocated.
+ * 
+ * \param table Node table.
+ * \param id Node ID.
+ * \param now_us Current time in microseconds.
+ * \param engine Engine of the node when it is new.
+ * 
+ * \return Pointer to the node, NULL on error.
+ */
+static ble_node_t *
+ble_node_table_claim(ble_node_table_t *table, int id, int64_t now_us, ble_node_engine_t engine)
+{
+    if (id < 0 || id >= NODE_ID_COUNT || engine < 0 || engine >= NODE_ENGINE_COUNT)
+        return NULL;
+
+    ble_node_t *lru = &table->nodes[0];
+    for (int i = 0; i < NODE_TABLE_SIZE; i++) {
+        ble_node_t *node = &table->nodes[i];
+        if (node->id == id) {
+            node->last_seen_us = now_us;
+            return node;
+        }
+        // free entries are preferred over the least recently seen node
+        if (lru->id == NODE_ID_NONE)
+            continue;
+        if (node->id == NODE_ID_NONE || node->last_seen_us < lru->last_seen_us)
+            lru = node;
+    }
+
+    if (lru->id != NODE_ID_NONE)
+        table->evictions++;
+    if (lru->pending)
+        table->dropped++;
+    // new node
+    if (ble_node_start_engine(table, lru, engine) != 0)
+        return NULL;
+
+    lru->id = id;
+    lru->last_seen_us = now_us;
+    lru->ap_count = 0;
+    lru->pending = 0;
+    memset(lru->aps, 0, sizeof(lru->aps));
+    memset(&lru->data, 0, sizeof(lru->data));
+
+    return lru;
+}
+
+/**
+ * \brief Look up a node by ID, or claim an entry for it when it is new.
+ * A new node takes a free entry, or the entry of the least recently seen node,
+ * and is tracked by the engine of the table.
+ * The filter of an evicted node is reset and reused, so its memory stays allocated.
+ * 
+ * \param table Node table.
+ * \param id Node ID.
+ * \param now_us Current time in microseconds.
+ * 
+ * \return Pointer to the node, NULL on error.
+ */
+ble_node_t *
+ble_node_table_get(ble_node_table_t *table, int id, int64_t now_us)
+{
+    return ble_node_table_claim(table, id, now_us, table->engine);
+}
+
+/**
+ * \brief Switch the engine that tracks a node, at runtime.
+ * The node starts over with the new engine, the cached measurements are kept.
+ * 
+ * \param table Node table the node belongs to.
+ * \param node Node.
+ * \param engine New engine.
+ * 
+ * \return 0 on succes, -1 on failure, after which the node keeps its engine.
+ */
+int 
+ble_node_set_engine(ble_node_table_t *table, ble_node_t *node, ble_node_engine_t engine)
+{
+    if (engine < 0 || engine >= NODE_ENGINE_COUNT)
+        return -1;
+    if (engine == node->engine)
+        return 0;
+    ble_node_engine_t prev = node->engine;
+    if (ble_node_start_engine(table, node, engine) != 0) {
+        node->engine = prev;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Cache new AP data for a node.
+ * 
+ * \param node Node the measurement belongs to, last_seen_us is the time of the measurement.
+ * \param data Struct holding the pre-processed RSSI, position and timestamp.
+ * 
+ * \return 1 when the cached values form a set, see NODE_MIN_APS,
+ * which is copied to node->data, after which the cache is cleared. 0 otherwise.
+ */
+int 
+ble_node_store_ap_data(ble_node_t *node, ble_particle_ap_t data)
+{
+    int stored = 0;
+    for (int i = 0; i < node->ap_count; i++) {
+        // we already cached an event from this AP
+        // replace it with the newer data for better accuracy
+        if (node->aps[i].id == data.id) {
+            node->aps[i] = data;
+            stored = 1;
+            break;
+        }
+    }
+    if (!stored && node->ap_count < NO_OF_APS) {
+        if (node->ap_count == 0)
+            node->first_us = node->last_seen_us;
+        node->aps[node->ap_count++] = data;
+    }
+
+    // check if we have a value for each AP,
+    // or stop waiting for the missing ones once the window passed
+    if (node->ap_count < NO_OF_APS) {
+        if (node->ap_count < NODE_MIN_APS || 
+                node->last_seen_us - node->first_us < NODE_SET_WINDOW_US)
+            return 0;
+    }
+    memcpy(node->data.aps, node->aps, sizeof(node->aps));
+    node->data.ap_count = node->ap_count;
+    // the set is complete with the measurement that was just received
+    node->data.timestamp_us = node->last_seen_us;
+    // reset counter & clear buffer
+    node->ap_count = 0;
+    memset(node->aps, 0, sizeof(node->aps));
+
+    return 1;
+}
+
+/**
+ * \brief Update the position of a node with its engine.
+ * 
+ * \param node Node.
+ * \param ap Single measurement, see ble_particle_filter_observe,
+ * NULL to update with the set in node->data, see ble_particle_filter_update.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_node_update(ble_node_t *node, const ble_particle_ap_t *ap)
+{
+    switch (node->engine) {
+    case NODE_ENGINE_PARTICLE:
+        return (ap != NULL) ? ble_particle_filter_observe(node->pf, ap, &node->data) : 
+            ble_particle_filter_update(node->pf, &node->data);
+    case NODE_ENGINE_LSQ:
+        return (ap != NULL) ? ble_lsq_observe(&node->lsq, ap, &node->data) : 
+            ble_lsq_update(&node->lsq, &node->data);
+    case NODE_ENGINE_EKF:
+        return (ap != NULL) ? ble_ekf_observe(&node->ekf, ap, &node->data) : 
+            ble_ekf_update(&node->ekf, &node->data);
+    case NODE_ENGINE_GRID:
+        return (ap != NULL) ? ble_grid_observe(node->grid, ap, &node->data) : 
+            ble_grid_update(node->grid, &node->data);
+    default:
+        return -1;
+    }
+}
+
+/**
+ * \brief Move the particles of every node with the motion model,
+ * the clock of nodes that are updated per measurement, see ble_particle_filter_observe.
+ * Trackers of the EKF and grid engines are predicted as well.
+ * 
+ * \param table Node table.
+ * \param now_us Current time in microseconds.
+ */
+void 
+ble_node_table_predict(ble_node_table_t *table, int64_t now_us)
+{
+    for (int i = 0; i < NODE_TABLE_SIZE; i++) {
+        ble_node_t *node = &table->nodes[i];
+        if (node->id == NODE_ID_NONE)
+            continue;
+        // the least-squares engine has no motion model
+        if (node->engine == NODE_ENGINE_PARTICLE)
+            ble_particle_filter_predict(node->pf, now_us);
+        else if (node->engine == NODE_ENGINE_EKF)
+            ble_ekf_predict(&node->ekf, now_us);
+        else if (node->engine == NODE_ENGINE_GRID)
+            ble_grid_predict(node->grid, now_us);
+    }
+}
+
+/**
+ * \brief Write the filter or tracker of every node in the table to a snapshot.
+ * Cached AP measurements and pending sets are not kept.
+ * 
+ * \param table Node table.
+ * \param s Snapshot to append to.
+ * 
+ * \return 0 on succes, -1 when the snapshot is full.
+ */
+int 
+ble_node_table_pack(const ble_node_table_t *table, ble_snapshot_t *s)
+{
+    int32_t count = 0;
+    for (int i = 0; i < NODE_TABLE_SIZE; i++)
+        count += (table->nodes[i].id != NODE_ID_NONE);
+    ble_snapshot_put(s, &count, sizeof(count));
+    for (int i = 0; i < NODE_TABLE_SIZE; i++) {
+        const ble_node_t *node = &table->nodes[i];
+        if (node->id == NODE_ID_NONE)
+            continue;
+        int32_t id[] = {node->id, node->engine};
+        ble_snapshot_put(s, id, sizeof(id));
+        if (node->engine == NODE_ENGINE_LSQ)
+            ble_lsq_pack(&node->lsq, s);
+        else if (node->engine == NODE_ENGINE_EKF)
+            ble_ekf_pack(&node->ekf, s);
+        else if (node->engine == NODE_ENGINE_GRID)
+            ble_grid_pack(node->grid, s);
+        else if (ble_particle_filter_pack(node->pf, s) != 0)
+            return -1;
+    }
+    return s->error ? -1 : 0;
+}
+
+/**
+ * \brief Restore the nodes of a snapshot written by ble_node_table_pack,
+ * each node is claimed in the table as if it was just seen.
+ * 
+ * \param table Node table, with the configuration of the snapshot.
+ * \param s Snapshot to read from.
+ * \param now_us Current time in microseconds.
+ * 
+ * \return Amount of restored nodes, -1 when the snapshot does not match the table.
+ * The nodes before the mismatch stay restored.
+ */
+int 
+ble_node_table_unpack(ble_node_table_t *table, ble_snapshot_t *s, int64_t now_us)
+{
+    int32_t count;
+    ble_snapshot_get(s, &count, sizeof(count));
+    if (s->error || count < 0 || count > NODE_TABLE_SIZE)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        int32_t id[2];
+        ble_snapshot_get(s, id, sizeof(id));
+        ble_node_t *node = s->error ? NULL : ble_node_table_claim(table, id[0], now_us, id[1]);
+        // a node that was already in the table switches to the engine of the snapshot
+        if (node == NULL || ble_node_set_engine(table, node, id[1]) != 0)
+            return -1;
+        if (node->engine == NODE_ENGINE_LSQ) {
+            if (ble_lsq_unpack(&node->lsq, s) != 0)
+                return -1;
+        } else if (node->engine == NODE_ENGINE_EKF) {
+            if (ble_ekf_unpack(&node->ekf, s) != 0)
+                return -1;
+        } else if (node->engine == NODE_ENGINE_GRID) {
+            if (ble_grid_unpack(node->grid, s) != 0) {
+                ble_grid_reset(node->grid);
+                return -1;
+            }
+        } else if (ble_particle_filter_unpack(node->pf, s) != 0) {
+            // back to a uniform prior, the particles may be partly overwritten
+            ble_particle_filter_reset(node->pf);
+            return -1;
+        }
+    }
+    return count;
+}
@@ -24,326 +24,1797 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <string.h>
-#include <float.h>
 
 #include "particle.h"
+#include "rng.h"
+#include "pool.h"
+#include "lut.h"
+#include "heading.h"
 #include "util.h"
 #include "config.h"
 
+// amount of independent partial sums in reductions
+// lets the compiler vectorize them without reordering float additions itself
+// the scalar Xtensa FPU only needs a few to hide the adder latency
+#ifdef NATIVE
+#define REDUCE_LANES            16
+#else
+#define REDUCE_LANES            4
+#endif
+
+// below this sum of squared weights the squares of the unnormalized weights
+// lose precision, the weights are normalized before summing them again
+#define MOMENTS_MIN_SUM_SQ      1e-20F
+
+/**
+ * \brief Allocate memory for a set of particles.
+ * In the SOA layout every field array starts at a PARTICLE_ALIGN boundary.
+ * 
+ * \param set Particle set to allocate.
+ * \param size Amount of particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_set_alloc(ble_particle_set_t *set, int size)
+{
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+    // pad every array so the next one starts aligned as well
+    size_t f_stride = ((size * sizeof(float) + PARTICLE_ALIGN - 1) / PARTICLE_ALIGN) 
+        * PARTICLE_ALIGN;
+    size_t m_stride = ((size * sizeof(uint8_t) + PARTICLE_ALIGN - 1) / PARTICLE_ALIGN) 
+        * PARTICLE_ALIGN;
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+    int f_arrays = 5;
+#else
+    int f_arrays = 4;
+#endif
+    uint8_t *mem = calloc(1, (f_arrays * f_stride) + m_stride + PARTICLE_ALIGN);
+    if (mem == NULL)
+        return -1;
+    uintptr_t base = ((uintptr_t)mem + PARTICLE_ALIGN - 1) & ~((uintptr_t)PARTICLE_ALIGN - 1);
+    set->x = (float*)base;
+    set->y = (float*)(base + f_stride);
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+    set->hx = (float*)(base + (2 * f_stride));
+    set->hy = (float*)(base + (3 * f_stride));
+#else
+    set->theta = (float*)(base + (2 * f_stride));
+#endif
+    set->weight = (float*)(base + ((f_arrays - 1) * f_stride));
+    set->motion = (uint8_t*)(base + (f_arrays * f_stride));
+    set->mem = mem;
+#else
+    set->particles = calloc(size, sizeof(ble_particle_t));
+    if (set->particles == NULL)
+        return -1;
+#endif
+    set->size = size;
+
+    return 0;
+}
+
 /**
- * \brief Normalize probability weights of particles.
+ * \brief Free memory of a set of particles.
  * 
- * \param arr Array of particles.
- * \param size Size of the array.
+ * \param set Particle set to free.
+ */
+void 
+ble_particle_set_free(ble_particle_set_t *set)
+{
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+    free(set->mem);
+#else
+    free(set->particles);
+#endif
+    memset(set, 0, sizeof(ble_particle_set_t));
+}
+
+/**
+ * \brief Copy a particle from one set to another.
+ * 
+ * \param dst Destination set.
+ * \param di Index in the destination set.
+ * \param src Source set.
+ * \param si Index in the source set.
+ */
+static inline void 
+ble_particle_copy(ble_particle_set_t *dst, int di, ble_particle_set_t *src, int si)
+{
+#if PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+    dst->x[di] = src->x[si];
+    dst->y[di] = src->y[si];
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+    dst->hx[di] = src->hx[si];
+    dst->hy[di] = src->hy[si];
+#else
+    dst->theta[di] = src->theta[si];
+#endif
+    dst->weight[di] = src->weight[si];
+    dst->motion[di] = src->motion[si];
+#else
+    dst->particles[di] = src->particles[si];
+#endif
+}
+
+/**
+ * \brief Sum the weights, squared weights and weighted coordinates 
+ * of a range of particles in a single pass.
+ * 
+ * \param set Particle set.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
+ * \param partial Partial result where sum, sum_sq, sum_x and sum_y are written.
  */
 static void 
-ble_particle_normalize(ble_particle_t *arr, int size)
+ble_particle_weight_moments(ble_particle_set_t *set, int lo, int hi, 
+    ble_particle_partial_t *partial)
 {
-    float sum = 0;
-    for (int i = 0; i < size; i++) {
-        sum += arr[i].weight;
+    int i = lo;
+    float l_w[REDUCE_LANES] = {0}, l_sq[REDUCE_LANES] = {0};
+    float l_x[REDUCE_LANES] = {0}, l_y[REDUCE_LANES] = {0};
+    for (; i + REDUCE_LANES <= hi; i += REDUCE_LANES) {
+        for (int l = 0; l < REDUCE_LANES; l++) {
+            float w = PARTICLE_WEIGHT(set, i + l);
+            l_w[l] += w;
+            l_sq[l] += w * w;
+            l_x[l] += w * PARTICLE_X(set, i + l);
+            l_y[l] += w * PARTICLE_Y(set, i + l);
+        }
     }
-    // normalize such that particles are within 0..1
-    // and sum of all particles equals 1
-    // though it may not be exactly 1, because of floating point inaccuracy
-    for (int i = 0; i < size; i++) {
-        arr[i].weight = arr[i].weight / sum;
+    float sum_w = 0, sum_sq = 0, sum_x = 0, sum_y = 0;
+    for (; i < hi; i++) {
+        float w = PARTICLE_WEIGHT(set, i);
+        sum_w += w;
+        sum_sq += w * w;
+        sum_x += w * PARTICLE_X(set, i);
+        sum_y += w * PARTICLE_Y(set, i);
+    }
+    for (int l = 0; l < REDUCE_LANES; l++) {
+        sum_w += l_w[l];
+        sum_sq += l_sq[l];
+        sum_x += l_x[l];
+        sum_y += l_y[l];
+    }
+    partial->sum = sum_w;
+    partial->sum_sq = sum_sq;
+    partial->sum_x = sum_x;
+    partial->sum_y = sum_y;
+}
+
+/**
+ * \brief Multiply the weights of a range of particles with a factor.
+ * 
+ * \param set Particle set.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
+ * \param factor Factor to multiply with.
+ */
+static void 
+ble_particle_scale_weights(ble_particle_set_t *set, int lo, int hi, float factor)
+{
+    for (int i = lo; i < hi; i++)
+        PARTICLE_WEIGHT(set, i) *= factor;
+}
+
+/**
+ * \brief Start over from uniform weights when every gain underflowed to 0,
+ * or the sum is not finite, so the weights can not be normalized.
+ * The estimate becomes the mean of the particles.
+ * 
+ * \param pf Filter with linear weights.
+ * 
+ * \return Effective sample size of 0, so the set is resampled.
+ */
+static float 
+ble_particle_uniform_weights(ble_particle_filter_t *pf)
+{
+    ble_particle_set_t *set = &pf->set;
+    float w = 1.0F / (float)set->size;
+    for (int i = 0; i < set->size; i++)
+        PARTICLE_WEIGHT(set, i) = w;
+    ble_particle_weight_moments(set, 0, set->size, &pf->sums);
+    pf->weight_scale = 1.0F;
+    return 0;
+}
+
+/**
+ * \brief Find the largest log-weight of a range of particles.
+ * 
+ * \param pf Filter with log-weights.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
+ * 
+ * \return Largest log-weight, -INFINITY for an empty range.
+ */
+static float 
+ble_particle_log_max(ble_particle_filter_t *pf, int lo, int hi)
+{
+    const float *lw = pf->log_weight;
+    int i = lo;
+    float lanes[REDUCE_LANES];
+    for (int l = 0; l < REDUCE_LANES; l++)
+        lanes[l] = -INFINITY;
+    for (; i + REDUCE_LANES <= hi; i += REDUCE_LANES) {
+        for (int l = 0; l < REDUCE_LANES; l++)
+            lanes[l] = (lw[i + l] > lanes[l]) ? lw[i + l] : lanes[l];
+    }
+    float max = -INFINITY;
+    for (; i < hi; i++)
+        max = (lw[i] > max) ? lw[i] : max;
+    for (int l = 0; l < REDUCE_LANES; l++)
+        max = (lanes[l] > max) ? lanes[l] : max;
+    return max;
+}
+
+/**
+ * \brief Shift the log-weights of a range of particles by the largest log-weight
+ * and write their exponent as the linear weight, summing the weights,
+ * squared weights and weighted coordinates in the same pass.
+ * The largest weight becomes 1, so the sum can not underflow.
+ * 
+ * \param pf Filter with log-weights.
+ * \param max Largest log-weight of all particles.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
+ * \param partial Partial result where sum, sum_sq, sum_x and sum_y are written.
+ */
+static void 
+ble_particle_log_exp(ble_particle_filter_t *pf, float max, int lo, int hi, 
+    ble_particle_partial_t *partial)
+{
+    ble_particle_set_t *set = &pf->set;
+    float *lw = pf->log_weight;
+    float sum = 0, sum_sq = 0, sum_x = 0, sum_y = 0;
+    for (int i = lo; i < hi; i++) {
+        lw[i] -= max;
+        float w = expf(lw[i]);
+        PARTICLE_WEIGHT(set, i) = w;
+        sum += w;
+        sum_sq += w * w;
+        sum_x += w * PARTICLE_X(set, i);
+        sum_y += w * PARTICLE_Y(set, i);
     }
+    partial->sum = sum;
+    partial->sum_sq = sum_sq;
+    partial->sum_x = sum_x;
+    partial->sum_y = sum_y;
+}
+
+/**
+ * \brief Sum the weights, squared weights and weighted coordinates of all particles
+ * in a single pass over the unnormalized weights. Normalization is deferred,
+ * the sums are scale invariant:
+ * ESS = sum(w_i)^2 / sum(w_i^2), mean = sum(w_i * x_i) / sum(w_i)
+ * With log-weights the largest log-weight is found first,
+ * and the pass writes the exponents as linear weights (log-sum-exp).
+ * 
+ * \param pf Filter.
+ * 
+ * \return Effective sample size.
+ */
+float 
+ble_particle_moments(ble_particle_filter_t *pf)
+{
+    ble_particle_set_t *set = &pf->set;
+    ble_particle_partial_t *sums = &pf->sums;
+    if (pf->log_weight != NULL) {
+        float max = ble_particle_log_max(pf, 0, set->size);
+        ble_particle_log_exp(pf, max, 0, set->size, sums);
+    } else {
+        ble_particle_weight_moments(set, 0, set->size, sums);
+        // rare, with a sharp likelihood where all gains are tiny
+        if (sums->sum > 0 && sums->sum_sq < MOMENTS_MIN_SUM_SQ) {
+            ble_particle_scale_weights(set, 0, set->size, 1.0F / sums->sum);
+            ble_particle_weight_moments(set, 0, set->size, sums);
+        }
+        if (!(sums->sum > 0) || !isfinite(sums->sum))
+            return ble_particle_uniform_weights(pf);
+    }
+    // applied once resampling needs normalized weights, or by the next weighting stage
+    pf->weight_scale = 1.0F / sums->sum;
+    return (sums->sum * sums->sum) / sums->sum_sq;
+}
+
+/**
+ * \brief Apply the deferred normalization to the probability weights of particles,
+ * such that particles are within 0..1 and the sum of all particles equals 1,
+ * though it may not be exactly 1, because of floating point inaccuracy.
+ * 
+ * \param pf Filter, ble_particle_moments should have run after the last weighting.
+ */
+void 
+ble_particle_normalize(ble_particle_filter_t *pf)
+{
+    if (pf->weight_scale == 1.0F)
+        return;
+    ble_particle_scale_weights(&pf->set, 0, pf->set.size, pf->weight_scale);
+    pf->weight_scale = 1.0F;
 }
 
 /**
  * \brief Uniformly Generate particles across the known area 
  * using Halton sequence. https://en.wikipedia.org/wiki/Halton_sequence
  * 
- * \param size Amount of particles to be generated.
+ * \param pf Filter with an allocated particle set to fill.
  * 
- * \return Pointer to an array of uniformly generated particles.
- * Returns NULL on error.
+ * \return 0 on succes, -1 on failure.
  */
-static ble_particle_t *
-ble_particle_generate(int size)
+int 
+ble_particle_generate(ble_particle_filter_t *pf)
 {
-    ble_particle_t *particles = calloc(size, sizeof(ble_particle_t));
-    if (particles == NULL)
-        return NULL;
-
-    int set_size = size + 1, dim = 2;
-    float scaled_x, scaled_y;
+    ble_particle_set_t *set = &pf->set;
+    int size = set->size, set_size = size + 1, dim = 2;
     // get N prime numbers using Sieve of Eratosthenes
     // we only need 2 here, as our dimensions are 2D
     int *primes = ble_util_prime_sieve(dim);
     if (primes == NULL)
-        return NULL;
+        return -1;
     // generate van der corput samples
     for (int i = 0; i < dim; i++) {
         float *sample = ble_util_corput(set_size, primes[i]);
         if (sample == NULL) {
             free(primes);
-            return NULL;
+            return -1;
         }
         // save x and y coordinates respectively
         // scale values from (0,0 -> 1,1) to our area
         for (int p = 1; p < set_size; p++) {
             switch(i) {
             case 0:
-                scaled_x = ble_util_scale(sample[p], 0, 1, 0, AREA_X);
-                (particles+(p-1))->state.pos.x = scaled_x;
+                PARTICLE_X(set, p-1) = ble_util_scale(sample[p], 0, 1, 0, pf->cfg.area.x);
                 break;
             case 1:
-                scaled_y = ble_util_scale(sample[p], 0, 1, 0, AREA_Y);
-                (particles+(p-1))->state.pos.y = scaled_y;
+                PARTICLE_Y(set, p-1) = ble_util_scale(sample[p], 0, 1, 0, pf->cfg.area.y);
                 break;
             default:
                 break;
             }
-            // sample angle in range [0..2*pi]
-            (particles+(p-1))->state.theta = ble_util_sample_range(0.0F, (2.0F * M_PI));
-            // inital motion state
-            (particles+(p-1))->state.motion = MOTION_STATE_STOP;
-            // initial (normalized) weight value
-            (particles+(p-1))->weight = 1.0F / PARTICLE_SET;
         }
         free(sample);
     }
     free(primes);
 
-    return particles;
+    for (int p = 0; p < size; p++) {
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+        // sample a direction of the heading table
+        int k = ble_rng_sample(&pf->rng, HEADING_STEPS);
+        PARTICLE_HX(set, p) = ble_heading_cos(k);
+        PARTICLE_HY(set, p) = ble_heading_sin(k);
+#else
+        // sample angle in range [0..2*pi]
+        PARTICLE_THETA(set, p) = ble_rng_range(&pf->rng, 0.0F, (2.0F * M_PI));
+#endif
+        // inital motion state
+        PARTICLE_MOTION(set, p) = MOTION_STATE_STOP;
+        // initial (normalized) weight value
+        PARTICLE_WEIGHT(set, p) = 1.0F / size;
+    }
+
+    return 0;
 }
 
 /**
- * \brief Create a sample from Gaussian probability distribution,
- * using the Box-Muller algorithm.
+ * \brief Closed-form least-squares trilateration of the node.
+ * Subtracting the circle of the first AP from the others gives linear equations
+ * 2 (x_i - x_0) x + 2 (y_i - y_0) y = d_0^2 - d_i^2 + x_i^2 - x_0^2 + y_i^2 - y_0^2,
+ * of which the 2x2 normal equations are solved, relative to the first AP.
  * 
- * \param mu Mean of the Gaussian.
- * \param sigma Standarddeviation.
+ * \param aps Array of AP measurements, the distances in meters.
+ * \param ap_count Amount of APs in the array.
+ * \param fix Written with the position.
+ * \param rms Written with the rms difference between the distances
+ * from the position to the APs and the measured distances, may be NULL.
  * 
- * \return Value in Gaussian distribution with given mu and sigma.
+ * \return 0 on succes, -1 with fewer than 3 APs or when they are (close to) collinear.
  */
-static float 
-ble_particle_gaussian_sample(float mu, float sigma)
+int 
+ble_particle_trilaterate(const ble_particle_ap_t *aps, int ap_count, 
+    ble_particle_node_t *fix, float *rms)
 {
-    // sample 2 numbers in the range [0..1]
-    // make sure u1 is greater than machine epsilon
-    float u1, u2;
-    do
-    {
-        u1 = ble_util_sample_range(0.0F, 1.0F);
-        u2 = ble_util_sample_range(0.0F, 1.0F);
+    if (ap_count < 3)
+        return -1;
+    float x0 = aps[0].pos.x, y0 = aps[0].pos.y, d0 = aps[0].node_distance;
+    float sxx = 0, sxy = 0, syy = 0, sxb = 0, syb = 0;
+    for (int i = 1; i < ap_count; i++) {
+        float u = aps[i].pos.x - x0, v = aps[i].pos.y - y0, d = aps[i].node_distance;
+        float a = 2.0F * u, b = 2.0F * v;
+        float c = (d0 * d0) - (d * d) + (u * u) + (v * v);
+        sxx += a * a;
+        sxy += a * b;
+        syy += b * b;
+        sxb += a * c;
+        syb += b * c;
     }
-    while (u1 <= FLT_EPSILON);
+    float det = (sxx * syy) - (sxy * sxy);
+    float trace = sxx + syy;
+    if (trace <= 0 || det <= TRILATERATE_MIN_DET * trace * trace)
+        return -1;
+    fix->pos.x = x0 + (((syy * sxb) - (sxy * syb)) / det);
+    fix->pos.y = y0 + (((sxx * syb) - (sxy * sxb)) / det);
 
-    // calculate the x value
-    float mag = sigma * sqrtf(-2.0F * logf(u1));
-    float z0 = mag * cosf((2.0F * M_PI) * u2) + mu;
-    
-    return z0;
+    if (rms != NULL) {
+        float sum = 0;
+        for (int i = 0; i < ap_count; i++) {
+            float dx = fix->pos.x - aps[i].pos.x, dy = fix->pos.y - aps[i].pos.y;
+            float r = sqrtf((dx * dx) + (dy * dy)) - aps[i].node_distance;
+            sum += r * r;
+        }
+        *rms = sqrtf(sum / ap_count);
+    }
+    return 0;
 }
 
 /**
- * \brief Predict a new state for each particle according to 
+ * \brief Seed the particles as a Gaussian around a trilateration of the APs,
+ * instead of the uniform spread, so the filter starts converged.
+ * Only the first set of at least 3 APs after a reset is tried,
+ * later the particles hold more information than a single fix.
+ * The uniform spread is kept when the APs are collinear,
+ * or when the deviation exceeds the shorter side of the area.
+ * 
+ * \param pf Filter.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ */
+static void 
+ble_particle_warm_start(ble_particle_filter_t *pf, const ble_particle_ap_t *aps, int ap_count)
+{
+    if (!pf->cfg.warm_start || pf->warm || ap_count < 3)
+        return;
+    pf->warm = 1;
+
+    ble_particle_node_t fix;
+    float rms;
+    if (ble_particle_trilaterate(aps, ap_count, &fix, &rms) != 0)
+        return;
+    float area_x = pf->cfg.area.x, area_y = pf->cfg.area.y;
+    float sd = (rms > pf->cfg.warm_start_sd) ? rms : pf->cfg.warm_start_sd;
+    if (sd >= ((area_x < area_y) ? area_x : area_y))
+        return;
+
+    ble_particle_set_t *set = &pf->set;
+    for (int p = 0; p < set->size; p++) {
+        PARTICLE_X(set, p) = clampf(ble_rng_normal(&pf->rng, fix.pos.x, sd), 0, area_x);
+        PARTICLE_Y(set, p) = clampf(ble_rng_normal(&pf->rng, fix.pos.y, sd), 0, area_y);
+        PARTICLE_WEIGHT(set, p) = 1.0F / set->size;
+    }
+    if (pf->log_weight != NULL)
+        memset(pf->log_weight, 0, set->size * sizeof(float));
+    pf->weight_scale = 1.0F;
+}
+
+/**
+ * \brief Predict a new state for a range of particles according to 
  * motion, orientation and position models.
+ * The noise is drawn in bulk for blocks of particles,
+ * so the update loop itself is free of branches and calls into the generator.
  * 
- * \param particles Array of particles.
- * \param size Size of the particle set.
+ * \param pf Filter.
+ * \param rng Random number generator state used for this range.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
  */
 static void 
-ble_particle_state_predict(ble_particle_t *particles, int size)
+ble_particle_predict_range(ble_particle_filter_t *pf, ble_rng_t *rng, int lo, int hi)
 {
-    for (int i = 0; i < size; i++) {
-        float d_theta = 0, d_pos = 0;
+    float u_motion[PARTICLE_BLOCK], u_theta[PARTICLE_BLOCK];
+    float n_theta[PARTICLE_BLOCK], n_pos[PARTICLE_BLOCK];
+    ble_particle_set_t *set = &pf->set;
+    float area_x = pf->cfg.area.x, area_y = pf->cfg.area.y;
+    // the step grows linearly with the elapsed time,
+    // the variance of a random walk as well, so its deviation with the square root
+    float dt_scale = pf->dt_scale;
+    float orientation_sd = sqrtf(pf->cfg.orientation_var * dt_scale);
+    float position_mean = pf->cfg.position_mean * dt_scale;
+    float position_sd = sqrtf(pf->cfg.position_var * dt_scale);
+
+    for (int b = lo; b < hi; b += PARTICLE_BLOCK) {
+        int n = (hi - b < PARTICLE_BLOCK) ? (hi - b) : PARTICLE_BLOCK;
         // sample a motion state for every particle
-        ble_particle_motion_t m_sample = 
-            (ble_particle_motion_t)ble_util_sample(MOTION_STATE_COUNT);
-        // sample orientation delta en position delta based on motion state
-        switch(m_sample) {
-        case MOTION_STATE_STOP:
-            // orientation sampled in range [0..2*pi], postion unchanged
-            d_theta = ble_util_sample_range(0.0F, (2.0F * M_PI));
-            break;
-        case MOTION_STATE_MOVING:
-            // orientation and position sampled from Gaussian distribution
-            d_theta = ble_particle_gaussian_sample(0.0F, sqrtf(ORIENTATION_VAR));
-            d_pos = fabsf(ble_particle_gaussian_sample(POSITION_MEAN, sqrtf(POSITION_VAR)));
-            break;
-        default:
+        ble_rng_fill_uniform(rng, u_motion, n, 0.0F, (float)MOTION_STATE_COUNT);
+        ble_rng_fill_normal(rng, n_theta, n, 0.0F, orientation_sd);
+        ble_rng_fill_normal(rng, n_pos, n, position_mean, position_sd);
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+        // stopped particles face a uniformly sampled direction of the heading table
+        // moving particles turn by the step closest to a Gaussian sampled angle
+        ble_rng_fill_uniform(rng, u_theta, n, 0.0F, (float)HEADING_STEPS);
+
+        for (int k = 0; k < n; k++) {
+            int i = b + k;
+            int moving = ((int)u_motion[k] == MOTION_STATE_MOVING);
+            // stopped particles turn but keep their postion
+            float d_pos = moving ? fabsf(n_pos[k]) : 0.0F;
+            float hx = PARTICLE_HX(set, i), hy = PARTICLE_HY(set, i);
+            // calculate new position and project back in area when out of bounds
+            PARTICLE_X(set, i) = ble_util_clamp(PARTICLE_X(set, i) + (d_pos * hx), 0, area_x);
+            PARTICLE_Y(set, i) = ble_util_clamp(PARTICLE_Y(set, i) + (d_pos * hy), 0, area_y);
+            PARTICLE_MOTION(set, i) = moving ? MOTION_STATE_MOVING : MOTION_STATE_STOP;
+            if (moving) {
+                ble_heading_rotate(&hx, &hy, ble_heading_step(n_theta[k]));
+            } else {
+                int d = (int)u_theta[k];
+                hx = ble_heading_cos(d);
+                hy = ble_heading_sin(d);
+            }
+            PARTICLE_HX(set, i) = hx;
+            PARTICLE_HY(set, i) = hy;
+        }
+#else
+        // orientation for stopped particles sampled in range [0..2*pi]
+        // orientation and position for moving particles sampled from Gaussian distribution
+        ble_rng_fill_uniform(rng, u_theta, n, 0.0F, (2.0F * M_PI));
+
+        for (int k = 0; k < n; k++) {
+            int i = b + k;
+            int moving = ((int)u_motion[k] == MOTION_STATE_MOVING);
+            // stopped particles turn but keep their postion
+            float d_theta = moving ? n_theta[k] : u_theta[k];
+            float d_pos = moving ? fabsf(n_pos[k]) : 0.0F;
+            float theta = PARTICLE_THETA(set, i);
+            // calculate new position and project back in area when out of bounds
+            PARTICLE_X(set, i) = clampf(PARTICLE_X(set, i) + (d_pos * cosf(theta)), 0, area_x);
+            PARTICLE_Y(set, i) = clampf(PARTICLE_Y(set, i) + (d_pos * sinf(theta)), 0, area_y);
+            // set new motion state and calculate new orientation within unit circle
+            PARTICLE_MOTION(set, i) = moving ? MOTION_STATE_MOVING : MOTION_STATE_STOP;
+            PARTICLE_THETA(set, i) = clampaf(theta + d_theta);
+        }
+#endif
+    }
+}
+
+/**
+ * \brief Predict a new state for each particle according to 
+ * motion, orientation and position models, over the time step of the update.
+ * 
+ * \param pf Filter.
+ */
+void 
+ble_particle_state_predict(ble_particle_filter_t *pf)
+{
+    ble_particle_predict_range(pf, &pf->rng, 0, pf->set.size);
+}
+
+/**
+ * \brief Look up the plane of every AP in the lookup table of the filter,
+ * building the planes of APs that are new or have moved.
+ * 
+ * \param pf Filter.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ * \param planes Array of LUT_MAX_APS, filled with the plane of every AP.
+ * 
+ * \return 1 when the table can be used, 0 when the distances must be calculated.
+ */
+static int 
+ble_particle_lut_planes(ble_particle_filter_t *pf, ble_particle_ap_t *aps, int ap_count, 
+    int *planes)
+{
+    // every AP needs its own plane during the update
+    if (pf->lut == NULL || ap_count > LUT_MAX_APS || ap_count > pf->lut->plane_count)
+        return 0;
+    for (int j = 0; j < ap_count; j++)
+        planes[j] = ble_lut_plane(pf->lut, aps[j].id, aps[j].pos.x, aps[j].pos.y);
+    return 1;
+}
+
+/**
+ * \brief Add the scaled absolute difference between the normalized distance estimate of an AP
+ * and the normalized distance from the lookup table, for a block of particles.
+ * Same as ble_lut_sample, with the plane and interpolation mode hoisted out of the loop.
+ * 
+ * \param lut Lookup table.
+ * \param plane Plane of the AP.
+ * \param set Particle set.
+ * \param b First particle of the block.
+ * \param n Amount of particles in the block.
+ * \param norm_d_est Normalized distance estimate of the AP.
+ * \param scale Factor of the AP, see ble_particle_ap_scales.
+ * \param d_diff Summed differences of the block.
+ */
+static void 
+ble_particle_lut_diff(const ble_lut_t *lut, int plane, ble_particle_set_t *set, int b, int n, 
+    float norm_d_est, float scale, float *d_diff)
+{
+    const float *dist = lut->dist + ((size_t)plane * lut->rows * lut->cols);
+    int cols = lut->cols, rows = lut->rows;
+    float inv_res = lut->inv_res, area_x = lut->area_x, area_y = lut->area_y;
+
+    if (lut->interp == LUT_NEAREST) {
+        for (int k = 0; k < n; k++) {
+            float x = ble_util_clamp(PARTICLE_X(set, b + k), 0, area_x);
+            float y = ble_util_clamp(PARTICLE_Y(set, b + k), 0, area_y);
+            int ix = (int)((x * inv_res) + 0.5F), iy = (int)((y * inv_res) + 0.5F);
+            d_diff[k] += scale * fabsf(dist[(iy * cols) + ix] - norm_d_est);
+        }
+        return;
+    }
+    for (int k = 0; k < n; k++) {
+        float x = ble_util_clamp(PARTICLE_X(set, b + k), 0, area_x);
+        float y = ble_util_clamp(PARTICLE_Y(set, b + k), 0, area_y);
+        float fx = x * inv_res, fy = y * inv_res;
+        int ix = (int)fx, iy = (int)fy;
+        // a point on the far border interpolates in the last cell
+        ix = (ix > cols - 2) ? (cols - 2) : ix;
+        iy = (iy > rows - 2) ? (rows - 2) : iy;
+        float tx = fx - (float)ix, ty = fy - (float)iy;
+        const float *p = dist + (iy * cols) + ix;
+        float top = p[0] + (tx * (p[1] - p[0]));
+        float bottom = p[cols] + (tx * (p[cols + 1] - p[cols]));
+        d_diff[k] += scale * fabsf(top + (ty * (bottom - top)) - norm_d_est);
+    }
+}
+
+/**
+ * \brief Factor of an AP measurement by its age, exp(-age / ap_age_tau),
+ * and 0 once it is older than ap_max_age.
+ * 
+ * \param cfg Configuration.
+ * \param timestamp_us Time of the measurement, 0 if unknown.
+ * \param now_us Time the age is relative to, 0 if unknown.
+ * 
+ * \return Factor between 0 and 1, 1 when either time is unknown.
+ */
+float 
+ble_particle_ap_age_scale(const ble_particle_config_t *cfg, int64_t timestamp_us, 
+    int64_t now_us)
+{
+    if (timestamp_us == 0 || now_us == 0)
+        return 1.0F;
+    float age = (float)(now_us - timestamp_us) * 1e-6F;
+    age = (age < 0) ? 0 : age;
+    return (age > cfg->ap_max_age) ? 0 : expf(-age / cfg->ap_age_tau);
+}
+
+/**
+ * \brief Keep the latest measurement of every AP, replacing the oldest one
+ * when more APs report than NO_OF_APS. Used by the streaming updates of every engine.
+ * 
+ * \param aps Array of NO_OF_APS measurements.
+ * \param count Amount of measurements in the array, updated.
+ * \param ap New measurement.
+ */
+void 
+ble_particle_keep_ap(ble_particle_ap_t *aps, int *count, const ble_particle_ap_t *ap)
+{
+    int slot = *count;
+    for (int j = 0; j < *count; j++) {
+        if (aps[j].id == ap->id) {
+            slot = j;
             break;
         }
-        // calculate new position and project back in area when out of bounds
-        particles[i].state.pos.x = clampf(particles[i].state.pos.x + 
-            (d_pos * cosf(particles[i].state.theta)), 0, AREA_X);
-        particles[i].state.pos.y = clampf(particles[i].state.pos.y + 
-            (d_pos * sinf(particles[i].state.theta)), 0, AREA_Y);
-        // set new motion state and calculate new orientation within unit circle
-        particles[i].state.motion = m_sample;
-        particles[i].state.theta = clampaf(particles[i].state.theta + d_theta);
     }
+    if (slot == NO_OF_APS) {
+        slot = 0;
+        for (int j = 1; j < NO_OF_APS; j++) {
+            if (aps[j].timestamp_us < aps[slot].timestamp_us)
+                slot = j;
+        }
+    } else if (slot == *count) {
+        (*count)++;
+    }
+    aps[slot] = *ap;
 }
 
 /**
- * \brief Update the weights of a particle
- * once a new set of RSSI measurements is received.
+ * \brief Factor of the difference of every AP in the observation model.
+ * The differences are averaged, weighted by the age of each measurement
+ * relative to the newest timestamp of the filter, and divided by the AP measurement noise.
+ * Measurements older than ap_max_age get a factor of 0 and are skipped.
+ * Without timestamps every AP counts the same.
  * 
- * \param dist Pointer to an array of estimates for each access point.
- * \param size Array size of dist.
+ * \param pf Filter.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array, at most LUT_MAX_APS.
+ * \param scales Array of ap_count, filled with the factor of every AP.
  * 
- * \return Weight gain factor for a particle.
+ * \return Inverse of the longest distance estimate of the APs that are used,
+ * which normalizes the estimates, 0 when no AP is used.
  */
 static float 
-ble_particle_weight_gain(ble_particle_ap_dist_t *dist, int size)
+ble_particle_ap_scales(ble_particle_filter_t *pf, ble_particle_ap_t *aps, int ap_count, 
+    float *scales)
 {
-    // longest estimated distance amongst states
-    ble_particle_ap_dist_t max_dist = dist[0];
-    for (int i = 1; i < size; i++) {
-        if (dist[i].d_node > max_dist.d_node)
-            max_dist = dist[i];
+    float total = 0, max_d_node = 0;
+    for (int j = 0; j < ap_count; j++) {
+        scales[j] = ble_particle_ap_age_scale(&pf->cfg, aps[j].timestamp_us, pf->last_us);
+        // longest estimated distance amongst states
+        if (scales[j] > 0 && aps[j].node_distance > max_d_node)
+            max_d_node = aps[j].node_distance;
+        total += scales[j];
     }
-    // calculate average variance between a particle and each AP
-    float d_diff = 0, norm_d_est = 0, norm_d = 0;
-    for (int i = 0; i < size; i++) {
-        // normalize distances to better represent the differences
-        // x_norm = (x - x_min) / (x_max - x_min), where x_min is always 0
-        norm_d_est = dist[i].d_node / max_dist.d_node;
-        norm_d = dist[i].d_particle / sqrtf(powf(AREA_X, 2) + powf(AREA_Y, 2));
-        // summation of absolute normalizated distance differences
-        d_diff += fabsf(norm_d - norm_d_est);
+    if (total == 0 || max_d_node <= 0)
+        return 0;
+    float inv_total = 1.0F / (total * pf->cfg.ap_measurement_var);
+    for (int j = 0; j < ap_count; j++)
+        scales[j] *= inv_total;
+    return 1.0F / max_d_node;
+}
+
+/**
+ * \brief Calculate the distance from each AP to a range of particles
+ * and multiply the particle weights with the gain of the observation model,
+ * or add the log of the gain to the log-weights.
+ * The normalized AP estimates do not depend on the particle,
+ * so they are calculated once, after which the APs are walked per block of particles.
+ * 
+ * \param pf Filter.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array.
+ * \param scales Factor of every AP, APs with a factor of 0 are skipped.
+ * \param inv_max_d_node Inverse of the longest distance estimate, see ble_particle_ap_scales.
+ * \param planes Lookup table plane of every AP, NULL to calculate the distances.
+ * \param lo First particle of the range.
+ * \param hi End of the range (exclusive).
+ */
+static void 
+ble_particle_weight_range(ble_particle_filter_t *pf, ble_particle_ap_t *aps, int ap_count, 
+    const float *scales, float inv_max_d_node, const int *planes, int lo, int hi)
+{
+    float d_diff[PARTICLE_BLOCK];
+    ble_particle_set_t *set = &pf->set;
+
+    // normalize distances to better represent the differences
+    // x_norm = (x - x_min) / (x_max - x_min), where x_min is always 0
+    float inv_area_diag = 1.0F / sqrtf(powf(pf->cfg.area.x, 2) + powf(pf->cfg.area.y, 2));
+    // deferred normalization of the previous update
+    float weight_scale = pf->weight_scale;
+
+    for (int b = lo; b < hi; b += PARTICLE_BLOCK) {
+        int n = (hi - b < PARTICLE_BLOCK) ? (hi - b) : PARTICLE_BLOCK;
+        for (int k = 0; k < n; k++)
+            d_diff[k] = 0;
+        // weighted summation of absolute normalizated distance differences,
+        // divided by the AP measurement noise
+        for (int j = 0; j < ap_count; j++) {
+            float scale = scales[j];
+            if (scale == 0)
+                continue;
+            float ap_x = aps[j].pos.x, ap_y = aps[j].pos.y;
+            float norm_d_est = aps[j].node_distance * inv_max_d_node;
+            if (planes != NULL) {
+                ble_particle_lut_diff(pf->lut, planes[j], set, b, n, norm_d_est, scale, d_diff);
+                continue;
+            }
+            for (int k = 0; k < n; k++) {
+                // assuming our area is rectangualar
+                // using Pythagorean theorem: a^2 + b^2 = c^2
+                float dx = ap_x - PARTICLE_X(set, b + k);
+                float dy = ap_y - PARTICLE_Y(set, b + k);
+                float norm_d = sqrtf((dx * dx) + (dy * dy)) * inv_area_diag;
+                d_diff[k] += scale * fabsf(norm_d - norm_d_est);
+            }
+        }
+        // in the log domain the gain is added, no exponent per particle
+        // log(g(x)_t) = -1/2 * (D_t / m_noise_ap)^2
+        if (pf->log_weight != NULL) {
+            for (int k = 0; k < n; k++) {
+                float d = d_diff[k];
+                pf->log_weight[b + k] -= 0.5F * d * d;
+            }
+            continue;
+        }
+        // calculate gain factor based on Gaussian distribution
+        // g(x)_t = exp(-1/2 * (D_t / m_noise_ap)^2)
+        for (int k = 0; k < n; k++) {
+            float d = d_diff[k];
+            PARTICLE_WEIGHT(set, b + k) *= weight_scale * expf(-0.5F * d * d);
+        }
     }
-    d_diff /= size;
-    // calculate gain factor based on Gaussian distribution
-    // g(x)_t = exp(-1/2 * (D_t / m_noise_ap)^2)
-    return expf(-0.5F * powf((d_diff / AP_MEASUREMENT_VAR), 2));
 }
 
 /**
- * \brief Stochastic Universal Sampling (SUS) algorithm
- * to resample all particles, where particles with a higher weight
- * have a higher chance of being reproduced, so we only keep the best particles.
- * This mitigates inaccuracy overtime.
+ * \brief Calculate the distance from each AP to each particle
+ * and multiply the particle weights with the gain of the observation model,
+ * or add the log of the gain to the log-weights.
+ * Any subset of the APs can be passed, see ble_particle_ap_scales for the weighting by age.
+ * 
+ * \param pf Filter.
+ * \param aps Array of AP measurements.
+ * \param ap_count Amount of APs in the array, APs beyond LUT_MAX_APS are ignored.
+ */
+void 
+ble_particle_weight(ble_particle_filter_t *pf, ble_particle_ap_t *aps, int ap_count)
+{
+    int planes[LUT_MAX_APS];
+    float scales[LUT_MAX_APS];
+    ap_count = (ap_count > LUT_MAX_APS) ? LUT_MAX_APS : ap_count;
+    float inv_max_d_node = ble_particle_ap_scales(pf, aps, ap_count, scales);
+    int use_lut = ble_particle_lut_planes(pf, aps, ap_count, planes);
+    ble_particle_weight_range(pf, aps, ap_count, scales, inv_max_d_node, 
+        use_lut ? planes : NULL, 0, pf->set.size);
+    pf->weight_scale = 1.0F;
+}
+
+/**
+ * \brief Amount of particles needed to keep the KL divergence between
+ * the sampled and the true posterior below epsilon with probability 1 - delta,
+ * when the posterior occupies k bins (Fox, KLD-sampling).
+ * Wilson-Hilferty approximation of the chi-square quantile.
+ * 
+ * \param k Amount of occupied bins.
+ * \param epsilon Maximum KL divergence.
+ * \param z Upper 1 - delta quantile of the standard normal distribution.
  * 
- * \param particles Array of particles.
- * \param size Size of particle set.
+ * \return Amount of particles.
+ */
+static float 
+ble_particle_kld_bound(int k, float epsilon, float z)
+{
+    if (k < 2)
+        return 0;
+    float a = 2.0F / (9.0F * (float)(k - 1));
+    float c = 1.0F - a + (sqrtf(a) * z);
+    return ((float)(k - 1) / (2.0F * epsilon)) * c * c * c;
+}
+
+/**
+ * \brief Choose the amount of particles for the next resampling step.
+ * The resampled particles are samples of the posterior,
+ * so the bins of the area grid they occupy show how spread out it is.
+ * A collapsed cloud needs few particles, an ambiguous one needs many.
+ * The amount is kept between min_particles and particles of the configuration.
+ * 
+ * \param pf Filter.
  */
 static void 
-ble_particle_resample(ble_particle_t *particles, int size)
+ble_particle_kld_adapt(ble_particle_filter_t *pf)
 {
-    ble_particle_t *new_particles = calloc(size, sizeof(ble_particle_t));
-    if (new_particles == NULL)
+    ble_particle_set_t *set = &pf->set;
+    if (pf->kld_bins == NULL)
         return;
 
-    int pos = 0;
-    // sample a value in range [0..1/N]
-    float start = ble_util_sample_range(0.0F, (1.0F / (float)size));
-    // generate an array of pointers using this value (according to SUS spec)
+    int cols = pf->kld_cols, rows = pf->kld_rows;
+    float inv_bin = 1.0F / pf->cfg.kld_bin_size;
+    memset(pf->kld_bins, 0, ((cols * rows + 31) / 32) * sizeof(uint32_t));
+    int occupied = 0;
+    for (int i = 0; i < set->size; i++) {
+        int cx = (int)(PARTICLE_X(set, i) * inv_bin);
+        int cy = (int)(PARTICLE_Y(set, i) * inv_bin);
+        // particles outside the area count for the nearest border bin
+        cx = (cx < 0) ? 0 : ((cx >= cols) ? (cols - 1) : cx);
+        cy = (cy < 0) ? 0 : ((cy >= rows) ? (rows - 1) : cy);
+        int bin = (cy * cols) + cx;
+        uint32_t mask = 1U << (bin & 31);
+        if (!(pf->kld_bins[bin >> 5] & mask)) {
+            pf->kld_bins[bin >> 5] |= mask;
+            occupied++;
+        }
+    }
+
+    float n = ble_particle_kld_bound(occupied, pf->cfg.kld_epsilon, pf->cfg.kld_z);
+    int min = pf->cfg.min_particles;
+    // every worker of a pool needs at least one particle
+    if (pf->pool != NULL && min < ble_pool_workers(pf->pool))
+        min = ble_pool_workers(pf->pool);
+    pf->next_size = (n >= (float)pf->cfg.particles) ? pf->cfg.particles : 
+        ((n <= (float)min) ? min : (int)ceilf(n));
+}
+
+/**
+ * \brief Walk the cumulative weights with increasing pointers in [0..1],
+ * particle k of the new set is the first particle of which the cumulative weight
+ * reaches pointer k. Used by systematic and stratified resampling.
+ * 
+ * \param pf Filter.
+ * \param start Offset of the evenly spaced pointers, for systematic resampling.
+ * \param rng Generator for a random pointer per stratum, NULL for systematic resampling.
+ */
+static void 
+ble_particle_resample_walk(ble_particle_filter_t *pf, float start, ble_rng_t *rng)
+{
+    ble_particle_set_t *set = &pf->set, *spare = &pf->spare;
+    int size = set->size;
+    // the new set may hold a different amount of particles, see ble_particle_kld_adapt
+    float step = 1.0F / (float)spare->size;
+
     int index = 0;
-    float sum = particles[index].weight;
-    for (int k = 0; k < size; k++) {
-        float pointer = start + ((float)k * (1.0F / (float)size));
+    float sum = PARTICLE_WEIGHT(set, index);
+    for (int k = 0; k < spare->size; k++) {
+        float pointer = (rng != NULL) ? (((float)k + ble_rng_uniform(rng)) * step) : 
+            (start + ((float)k * step));
         // reproduce particles with higher weights
         // higher weight means the sum is higher than the pointer for a few iterations
         // and the same particle is included multiple times
-        while (sum < pointer) {
+        // the index is bounded since rounding errors may leave the sum below 1
+        while (sum < pointer && index < size - 1) {
+            index++;
+            sum += PARTICLE_WEIGHT(set, index);
+        }
+        ble_particle_copy(spare, k, set, index);
+    }
+}
+
+/**
+ * \brief Residual resampling, every particle is copied floor(M * w) times
+ * for M new particles,
+ * the remaining particles are drawn with systematic resampling on what is left
+ * of the weights. This keeps the variance of the copy counts lowest.
+ * 
+ * \param pf Filter.
+ */
+static void 
+ble_particle_resample_residual(ble_particle_filter_t *pf)
+{
+    ble_particle_set_t *set = &pf->set, *spare = &pf->spare;
+    int size = set->size, k = 0;
+    float n = (float)spare->size, residual_sum = 0;
+
+    // deterministic part
+    for (int i = 0; i < size; i++) {
+        float expected = PARTICLE_WEIGHT(set, i) * n;
+        int copies = (int)expected;
+        for (int c = 0; c < copies && k < spare->size; c++)
+            ble_particle_copy(spare, k++, set, i);
+        residual_sum += expected - (float)copies;
+    }
+    int remaining = spare->size - k;
+    if (remaining == 0)
+        return;
+
+    // systematic resampling on the residual weights
+    float step = residual_sum / (float)remaining;
+    float start = ble_rng_range(&pf->rng, 0.0F, step);
+    int index = 0;
+    float expected = PARTICLE_WEIGHT(set, index) * n;
+    float sum = expected - floorf(expected);
+    for (int r = 0; r < remaining; r++, k++) {
+        float pointer = start + ((float)r * step);
+        while (sum < pointer && index < size - 1) {
             index++;
-            sum += particles[index].weight;
+            expected = PARTICLE_WEIGHT(set, index) * n;
+            sum += expected - floorf(expected);
         }
-        new_particles[pos++] = particles[index];
+        ble_particle_copy(spare, k, set, index);
     }
-    // normalize weights so that the sum is equal to 1 again
-    ble_particle_normalize(new_particles, size);
-    // overwrite old particles
-    memcpy(particles, new_particles, size * sizeof(ble_particle_t));
-    free(new_particles);
+}
+
+/**
+ * \brief Metropolis resampling for a range of output particles.
+ * Every output particle runs a short Markov chain that starts at the particle
+ * at the same relative position in the old set and jumps to a uniformly drawn particle with probability min(1, w_j / w_i).
+ * Only weight ratios are used, so the weights need no normalization or cumulative sum
+ * and every range can be resampled independently.
+ * The result is biased towards the start of the chain when too few steps are taken
+ * for the spread of the weights.
+ * 
+ * \param pf Filter.
+ * \param rng Generator state.
+ * \param lo First output particle of the range.
+ * \param hi End of the output range (exclusive).
+ */
+static void 
+ble_particle_resample_metropolis(ble_particle_filter_t *pf, ble_rng_t *rng, int lo, int hi)
+{
+    ble_particle_set_t *set = &pf->set, *spare = &pf->spare;
+    int size = set->size, steps = pf->cfg.metropolis_steps;
+
+    for (int k = lo; k < hi; k++) {
+        int index = (int)(((int64_t)k * size) / spare->size);
+        float w = PARTICLE_WEIGHT(set, index);
+        for (int b = 0; b < steps; b++) {
+            int j = ble_rng_sample(rng, size);
+            float w_j = PARTICLE_WEIGHT(set, j);
+            // u < w_j / w without the division
+            if (ble_rng_uniform(rng) * w <= w_j) {
+                index = j;
+                w = w_j;
+            }
+        }
+        ble_particle_copy(spare, k, set, index);
+    }
+}
+
+/**
+ * \brief Resample all particles with the algorithm selected in the filter configuration,
+ * where particles with a higher weight have a higher chance of being reproduced,
+ * so we only keep the best particles. This mitigates inaccuracy overtime.
+ * The new particles are written to the spare set, after which both sets are swapped.
+ * 
+ * \param pf Filter.
+ */
+void 
+ble_particle_resample(ble_particle_filter_t *pf)
+{
+    ble_particle_set_t *set = &pf->set, *spare = &pf->spare;
+    spare->size = pf->next_size;
+    // the pointers walk normalized weights
+    ble_particle_normalize(pf);
+
+    switch (pf->cfg.resampler) {
+    case PARTICLE_RESAMPLE_STRATIFIED:
+        ble_particle_resample_walk(pf, 0, &pf->rng);
+        break;
+    case PARTICLE_RESAMPLE_RESIDUAL:
+        ble_particle_resample_residual(pf);
+        break;
+    case PARTICLE_RESAMPLE_METROPOLIS:
+        ble_particle_resample_metropolis(pf, &pf->rng, 0, spare->size);
+        break;
+    case PARTICLE_RESAMPLE_SYSTEMATIC:
+    default:
+        // sample a value in range [0..1/N] (according to SUS spec)
+        ble_particle_resample_walk(pf, 
+            ble_rng_range(&pf->rng, 0.0F, (1.0F / (float)spare->size)), NULL);
+        break;
+    }
+    // swap the buffers instead of copying the particles back
+    ble_particle_set_t tmp = *set;
+    *set = *spare;
+    *spare = tmp;
+    // the new particles are equally likely, also with linear weights,
+    // the weights copied with the particles are not carried over
+    for (int i = 0; i < set->size; i++)
+        PARTICLE_WEIGHT(set, i) = 1.0F;
+    if (pf->log_weight != NULL)
+        memset(pf->log_weight, 0, set->size * sizeof(float));
+    // sums of the new set for the estimate, its normalization is deferred as well
+    ble_particle_moments(pf);
+    ble_particle_kld_adapt(pf);
+}
+
+/**
+ * \brief Calculate a weighted average of all particles for a node state estimate,
+ * from the sums of the last ble_particle_moments.
+ * 
+ * \param pf Filter.
+ * \param node Node where the estimated position is written.
+ */
+void 
+ble_particle_estimate(ble_particle_filter_t *pf, ble_particle_node_t *node)
+{
+    ble_particle_partial_t *sums = &pf->sums;
+    // clamp position in our area
+    node->pos.x = clampf((sums->sum_x / sums->sum), 0, pf->cfg.area.x);
+    node->pos.y = clampf((sums->sum_y / sums->sum), 0, pf->cfg.area.y);
+}
+
+typedef enum {
+    PARALLEL_PHASE_WEIGHT,
+    PARALLEL_PHASE_LOG_EXP,
+    PARALLEL_PHASE_RESCALE,
+    PARALLEL_PHASE_NORMALIZE,
+    PARALLEL_PHASE_RESAMPLE
+} ble_particle_phase_t;
+
+typedef struct {
+    ble_particle_filter_t *pf;
+    ble_particle_phase_t phase;
+    ble_particle_ap_t *aps;
+    int ap_count;
+    // factor of every AP in the observation model, and the normalization of the estimates
+    const float *scales;
+    float inv_max_d_node;
+    // lookup table plane of every AP, NULL to calculate the distances
+    const int *planes;
+    // normalization factor
+    float factor;
+    // largest log-weight of all particles
+    float max;
+    // first pointer of stochastic universal sampling
+    float start;
+    // the spare set is already filled, only its moments are needed
+    int resampled;
+} ble_particle_job_t;
+
+/**
+ * \brief Get the range of particles handled by a worker.
+ * 
+ * \param size Amount of particles.
+ * \param workers Amount of workers.
+ * \param worker Index of the worker.
+ * \param lo First particle of the chunk.
+ * \param hi End of the chunk (exclusive).
+ */
+static void 
+ble_particle_chunk(int size, int workers, int worker, int *lo, int *hi)
+{
+    *lo = (int)(((int64_t)size * worker) / workers);
+    *hi = (int)(((int64_t)size * (worker + 1)) / workers);
+}
+
+/**
+ * \brief Normalize the weights of a chunk and calculate its cumulative weights
+ * in the same pass, only needed before resampling.
+ * 
+ * \param pf Filter.
+ * \param factor Normalization factor.
+ * \param lo First particle of the chunk.
+ * \param hi End of the chunk (exclusive).
+ * \param partial Partial result of the chunk, where the sum is written.
+ */
+static void 
+ble_particle_normalize_chunk(ble_particle_filter_t *pf, float factor, int lo, int hi, 
+    ble_particle_partial_t *partial)
+{
+    ble_particle_set_t *set = &pf->set;
+    float cum = 0;
+    for (int i = lo; i < hi; i++) {
+        float w = PARTICLE_WEIGHT(set, i) * factor;
+        PARTICLE_WEIGHT(set, i) = w;
+        cum += w;
+        pf->cumsum[i] = cum;
+    }
+    partial->sum = cum;
+}
+
+/**
+ * \brief Systematic or stratified resampling for a range of output particles.
+ * The first particle to reproduce is found with a binary search
+ * in the cumulative weights, so every worker can start at its own output range.
+ * 
+ * \param pf Filter.
+ * \param start Offset of the evenly spaced pointers, for systematic resampling.
+ * \param rng Generator for a random pointer per stratum, NULL for systematic resampling.
+ * \param lo First output particle of the range.
+ * \param hi End of the output range (exclusive).
+ */
+static void 
+ble_particle_resample_range(ble_particle_filter_t *pf, float start, ble_rng_t *rng, 
+    int lo, int hi)
+{
+    ble_particle_set_t *set = &pf->set, *spare = &pf->spare;
+    int size = set->size, workers = ble_pool_workers(pf->pool);
+    double step = 1.0 / (double)spare->size;
+    if (lo >= hi)
+        return;
+
+    // find the chunk holding the first pointer of this range
+    double pointer = (rng != NULL) ? (((double)lo + ble_rng_uniform(rng)) * step) : 
+        (start + ((double)lo * step));
+    int c = 0;
+    // only the offsets are read, the other fields are written by the workers
+    while (c < workers - 1 && pf->partial[c + 1].offset < pointer)
+        c++;
+    int c_lo, c_hi;
+    ble_particle_chunk(size, workers, c, &c_lo, &c_hi);
+    // first particle in the chunk of which the cumulative weight reaches the pointer
+    int a = c_lo, b = (c_hi > c_lo) ? (c_hi - 1) : c_lo;
+    while (a < b) {
+        int m = a + ((b - a) / 2);
+        if (pf->partial[c].offset + pf->cumsum[m] < pointer)
+            a = m + 1;
+        else
+            b = m;
+    }
+    int index = a;
+    while (index >= c_hi && c < workers - 1)
+        ble_particle_chunk(size, workers, ++c, &c_lo, &c_hi);
+
+    for (int k = lo; k < hi; k++) {
+        if (k > lo) {
+            pointer = (rng != NULL) ? (((double)k + ble_rng_uniform(rng)) * step) : 
+                (start + ((double)k * step));
+        }
+        // the index is bounded since rounding errors may leave the sum below 1
+        while (index < size - 1 && pf->partial[c].offset + pf->cumsum[index] < pointer) {
+            index++;
+            while (index >= c_hi && c < workers - 1)
+                ble_particle_chunk(size, workers, ++c, &c_lo, &c_hi);
+        }
+        ble_particle_copy(spare, k, set, index);
+    }
+}
+
+/**
+ * \brief Job run by every worker of the pool for one phase of the parallel update.
+ * 
+ * \param arg Job description.
+ * \param worker Index of the worker, selects the chunk of particles.
+ */
+static void 
+ble_particle_parallel_job(void *arg, int worker)
+{
+    ble_particle_job_t *job = arg;
+    ble_particle_filter_t *pf = job->pf;
+    ble_particle_partial_t *partial = &pf->partial[worker];
+    int lo, hi;
+    ble_particle_chunk(pf->set.size, ble_pool_workers(pf->pool), worker, &lo, &hi);
+
+    switch (job->phase) {
+    case PARALLEL_PHASE_WEIGHT:
+        ble_particle_predict_range(pf, &pf->chunk_rng[worker], lo, hi);
+        ble_particle_weight_range(pf, job->aps, job->ap_count, job->scales, 
+            job->inv_max_d_node, job->planes, lo, hi);
+        if (pf->log_weight != NULL)
+            partial->max = ble_particle_log_max(pf, lo, hi);
+        else
+            ble_particle_weight_moments(&pf->set, lo, hi, partial);
+        break;
+    case PARALLEL_PHASE_LOG_EXP:
+        ble_particle_log_exp(pf, job->max, lo, hi, partial);
+        break;
+    case PARALLEL_PHASE_RESCALE:
+        ble_particle_scale_weights(&pf->set, lo, hi, job->factor);
+        ble_particle_weight_moments(&pf->set, lo, hi, partial);
+        break;
+    case PARALLEL_PHASE_NORMALIZE:
+        ble_particle_normalize_chunk(pf, job->factor, lo, hi, partial);
+        break;
+    case PARALLEL_PHASE_RESAMPLE:
+        // the output is split in equal ranges, independent of where the weight is
+        ble_particle_chunk(pf->spare.size, ble_pool_workers(pf->pool), worker, &lo, &hi);
+        if (!job->resampled) {
+            if (pf->cfg.resampler == PARTICLE_RESAMPLE_METROPOLIS)
+                ble_particle_resample_metropolis(pf, &pf->chunk_rng[worker], lo, hi);
+            else if (pf->cfg.resampler == PARTICLE_RESAMPLE_STRATIFIED)
+                ble_particle_resample_range(pf, 0, &pf->chunk_rng[worker], lo, hi);
+            else
+                ble_particle_resample_range(pf, job->start, NULL, lo, hi);
+        }
+        // the new particles are equally likely, as in ble_particle_resample
+        for (int i = lo; i < hi; i++)
+            PARTICLE_WEIGHT(&pf->spare, i) = 1.0F;
+        if (pf->log_weight != NULL)
+            memset(pf->log_weight + lo, 0, (hi - lo) * sizeof(float));
+        ble_particle_weight_moments(&pf->spare, lo, hi, partial);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * \brief Seed the random number stream of every chunk from the filter generator.
+ * 
+ * \param pf Filter with a pool.
+ */
+static void 
+ble_particle_seed_chunks(ble_particle_filter_t *pf)
+{
+    for (int i = 0; i < ble_pool_workers(pf->pool); i++) {
+        uint64_t seed = ((uint64_t)ble_rng_next(&pf->rng) << 32) | ble_rng_next(&pf->rng);
+        ble_rng_seed(&pf->chunk_rng[i], seed);
+    }
+}
+
+/**
+ * \brief Combine the partial sums of all chunks into the sums of the filter.
+ * 
+ * \param pf Filter with a pool.
+ * 
+ * \return Effective sample size.
+ */
+static float 
+ble_particle_reduce(ble_particle_filter_t *pf)
+{
+    double sum_w = 0, sum_sq = 0, sum_x = 0, sum_y = 0;
+    for (int i = 0; i < ble_pool_workers(pf->pool); i++) {
+        sum_w += pf->partial[i].sum;
+        sum_sq += pf->partial[i].sum_sq;
+        sum_x += pf->partial[i].sum_x;
+        sum_y += pf->partial[i].sum_y;
+    }
+    pf->sums.sum = (float)sum_w;
+    pf->sums.sum_sq = (float)sum_sq;
+    pf->sums.sum_x = (float)sum_x;
+    pf->sums.sum_y = (float)sum_y;
+    pf->weight_scale = (float)(1.0 / sum_w);
+    return (float)((sum_w * sum_w) / sum_sq);
+}
+
+/**
+ * \brief Update the filter with the workers of its pool.
+ * Predict, weight and the sums for the ESS and weighted mean run per chunk
+ * in one pass. Only when resampling, the weights are normalized together with
+ * the cumulative weights of every chunk, so every worker fills 
+ * an equal part of the new set.
+ * 
+ * \param pf Filter with a pool.
+ * \param data Pointer to a structure with AP measurements.
+ */
+static void 
+ble_particle_parallel_update(ble_particle_filter_t *pf, ble_particle_data_t *data)
+{
+    int workers = ble_pool_workers(pf->pool);
+    ble_particle_job_t job = {
+        .pf = pf,
+        .aps = data->aps,
+        .ap_count = data->ap_count
+    };
+
+    // the factors and planes are built before the workers read them
+    float scales[NO_OF_APS];
+    job.inv_max_d_node = ble_particle_ap_scales(pf, data->aps, data->ap_count, scales);
+    job.scales = scales;
+    int planes[LUT_MAX_APS];
+    if (ble_particle_lut_planes(pf, data->aps, data->ap_count, planes))
+        job.planes = planes;
+
+    // predict and weight, partial sums
+    job.phase = PARALLEL_PHASE_WEIGHT;
+    ble_pool_run(pf->pool, ble_particle_parallel_job, &job);
+    if (pf->log_weight != NULL) {
+        // exponents of the log-weights shifted by the largest one, partial sums
+        job.phase = PARALLEL_PHASE_LOG_EXP;
+        job.max = pf->partial[0].max;
+        for (int i = 1; i < workers; i++)
+            job.max = (pf->partial[i].max > job.max) ? pf->partial[i].max : job.max;
+        ble_pool_run(pf->pool, ble_particle_parallel_job, &job);
+    }
+    float n_eff = ble_particle_reduce(pf);
+    if (pf->log_weight == NULL && pf->sums.sum > 0 && pf->sums.sum_sq < MOMENTS_MIN_SUM_SQ) {
+        // normalize and sum again, see ble_particle_moments
+        job.phase = PARALLEL_PHASE_RESCALE;
+        job.factor = pf->weight_scale;
+        ble_pool_run(pf->pool, ble_particle_parallel_job, &job);
+        n_eff = ble_particle_reduce(pf);
+    }
+    if (pf->log_weight == NULL && (!(pf->sums.sum > 0) || !isfinite(pf->sums.sum)))
+        n_eff = ble_particle_uniform_weights(pf);
+
+    // check if we need to resample based on effective sample size
+    if (n_eff < (pf->set.size * pf->cfg.ratio_coefficient) || pf->next_size != pf->set.size) {
+        // normalize and cumulative weights
+        job.phase = PARALLEL_PHASE_NORMALIZE;
+        job.factor = pf->weight_scale;
+        ble_pool_run(pf->pool, ble_particle_parallel_job, &job);
+        pf->weight_scale = 1.0F;
+        double offset = 0;
+        for (int i = 0; i < workers; i++) {
+            // exclusive prefix sum over the chunks
+            pf->partial[i].offset = offset;
+            offset += pf->partial[i].sum;
+        }
+
+        job.phase = PARALLEL_PHASE_RESAMPLE;
+        pf->spare.size = pf->next_size;
+        job.start = ble_rng_range(&pf->rng, 0.0F, (1.0F / (float)pf->spare.size));
+        // the copy counts of residual resampling need a prefix sum over all particles,
+        // so it runs on the calling task and the workers only sum the new set
+        if (pf->cfg.resampler == PARTICLE_RESAMPLE_RESIDUAL) {
+            ble_particle_resample_residual(pf);
+            job.resampled = 1;
+        }
+        ble_pool_run(pf->pool, ble_particle_parallel_job, &job);
+        // swap the buffers instead of copying the particles back
+        ble_particle_set_t tmp = pf->set;
+        pf->set = pf->spare;
+        pf->spare = tmp;
+        // the normalization of the new set is deferred as well
+        ble_particle_reduce(pf);
+        ble_particle_kld_adapt(pf);
+    }
+
+    // weighted average of all particles, clamped in our area
+    ble_particle_estimate(pf, &data->node);
+}
+
+/**
+ * \brief Let a pool of workers run the updates of a filter.
+ * Allocates a random number stream and partial results per worker,
+ * and the cumulative weight buffer used for resampling.
+ * The pool is not owned by the filter and may be shared between filters
+ * that do not update at the same time.
+ * 
+ * \param pf Filter.
+ * \param pool Pool, NULL to update on the calling thread again.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_filter_set_pool(ble_particle_filter_t *pf, ble_pool_t *pool)
+{
+    free(pf->chunk_rng);
+    free(pf->partial);
+    free(pf->cumsum);
+    pf->chunk_rng = NULL;
+    pf->partial = NULL;
+    pf->cumsum = NULL;
+    pf->pool = NULL;
+    if (pool == NULL)
+        return 0;
+
+    // every worker needs at least one particle
+    int workers = ble_pool_workers(pool);
+    if (workers > pf->cfg.particles)
+        return -1;
+    pf->chunk_rng = calloc(workers, sizeof(ble_rng_t));
+    pf->partial = calloc(workers, sizeof(ble_particle_partial_t));
+    pf->cumsum = calloc(pf->cfg.particles, sizeof(float));
+    if (pf->chunk_rng == NULL || pf->partial == NULL || pf->cumsum == NULL) {
+        ble_particle_filter_set_pool(pf, NULL);
+        return -1;
+    }
+    pf->pool = pool;
+    ble_particle_seed_chunks(pf);
+
+    return 0;
+}
+
+/**
+ * \brief Let the filter look up AP distances in a table instead of calculating them.
+ * The table is not owned by the filter and may be shared between filters
+ * of the same area that do not update at the same time.
+ * 
+ * \param pf Filter.
+ * \param lut Lookup table, NULL to calculate the distances again.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_filter_set_lut(ble_particle_filter_t *pf, ble_lut_t *lut)
+{
+    if (lut != NULL && (lut->area_x != pf->cfg.area.x || lut->area_y != pf->cfg.area.y))
+        return -1;
+    pf->lut = lut;
+    return 0;
+}
+
+/**
+ * \brief Create a filter and allocate all memory it needs,
+ * so updates do not allocate anymore.
+ * The particles are spread uniformly over the area.
+ * 
+ * \param cfg Filter configuration, see BLE_PARTICLE_CONFIG_DEFAULT.
+ * 
+ * \return Pointer to the filter, NULL on error.
+ */
+ble_particle_filter_t *
+ble_particle_filter_create(const ble_particle_config_t *cfg)
+{
+    if (cfg == NULL || cfg->particles <= 0)
+        return NULL;
+    if (cfg->update_interval <= 0 || cfg->max_dt < 0 || 
+            cfg->ap_age_tau <= 0 || cfg->ap_max_age < 0)
+        return NULL;
+    if (cfg->min_particles > 0 && (cfg->min_particles > cfg->particles || 
+            cfg->kld_bin_size <= 0 || cfg->kld_epsilon <= 0))
+        return NULL;
+
+    ble_particle_filter_t *pf = calloc(1, sizeof(ble_particle_filter_t));
+    if (pf == NULL)
+        return NULL;
+    pf->cfg = *cfg;
+
+    // both sets are allocated for the maximum amount of particles
+    if (ble_particle_set_alloc(&pf->set, cfg->particles) != 0 || 
+        ble_particle_set_alloc(&pf->spare, cfg->particles) != 0) {
+        ble_particle_filter_destroy(pf);
+        return NULL;
+    }
+    if (cfg->min_particles > 0) {
+        pf->kld_cols = (int)ceilf(cfg->area.x / cfg->kld_bin_size);
+        pf->kld_rows = (int)ceilf(cfg->area.y / cfg->kld_bin_size);
+        if (pf->kld_cols < 1)
+            pf->kld_cols = 1;
+        if (pf->kld_rows < 1)
+            pf->kld_rows = 1;
+        pf->kld_bins = calloc((pf->kld_cols * pf->kld_rows + 31) / 32, sizeof(uint32_t));
+    }
+    if (cfg->log_weights)
+        pf->log_weight = calloc(cfg->particles, sizeof(float));
+    if ((cfg->min_particles > 0 && pf->kld_bins == NULL) || 
+            (cfg->log_weights && pf->log_weight == NULL) || 
+            ble_particle_filter_reset(pf) != 0) {
+        ble_particle_filter_destroy(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/**
+ * \brief Reset a filter to its initial state,
+ * reseed the generator and spread the particles uniformly over the area again.
+ * 
+ * \param pf Filter.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_filter_reset(ble_particle_filter_t *pf)
+{
+    ble_rng_seed(&pf->rng, (pf->cfg.seed != 0) ? pf->cfg.seed : ble_rng_entropy());
+    if (pf->pool != NULL)
+        ble_particle_seed_chunks(pf);
+    memset(pf->prev_ap, 0, sizeof(pf->prev_ap));
+    pf->prev_ap_count = 0;
+    pf->warm = 0;
+    pf->last_us = 0;
+    pf->dt_scale = 1.0F;
+    // start with the maximum amount of particles, the prior is uniform
+    pf->set.size = pf->cfg.particles;
+    pf->spare.size = pf->cfg.particles;
+    pf->next_size = pf->cfg.particles;
+    pf->weight_scale = 1.0F;
+    if (pf->log_weight != NULL)
+        memset(pf->log_weight, 0, pf->cfg.particles * sizeof(float));
+    // weights are initalized based on the starting position of the node
+    return ble_particle_generate(pf);
+}
+
+/**
+ * \brief Free all memory of a filter.
+ * 
+ * \param pf Filter, may be NULL.
+ */
+void 
+ble_particle_filter_destroy(ble_particle_filter_t *pf)
+{
+    if (pf == NULL)
+        return;
+    ble_particle_filter_set_pool(pf, NULL);
+    free(pf->kld_bins);
+    free(pf->log_weight);
+    ble_particle_set_free(&pf->set);
+    ble_particle_set_free(&pf->spare);
+    free(pf);
+}
+
+/**
+ * \brief Set the time step of the next predict from the timestamp of the measurements,
+ * relative to the nominal update interval. Without a timestamp, or for the first one,
+ * the nominal interval is assumed. A delayed update catches up with at most max_dt,
+ * the particles would diffuse over the whole area otherwise.
+ * Measurements that are not newer than the previous ones do not move the particles.
+ * 
+ * \param pf Filter.
+ * \param timestamp_us Timestamp of the measurements in microseconds, 0 if unknown.
+ */
+static void 
+ble_particle_set_dt(ble_particle_filter_t *pf, int64_t timestamp_us)
+{
+    if (timestamp_us == 0 || pf->last_us == 0) {
+        pf->dt_scale = 1.0F;
+    } else {
+        float dt = (float)(timestamp_us - pf->last_us) * 1e-6F;
+        dt = (dt < 0) ? 0 : ((dt > pf->cfg.max_dt) ? pf->cfg.max_dt : dt);
+        pf->dt_scale = dt / pf->cfg.update_interval;
+    }
+    if (timestamp_us > pf->last_us)
+        pf->last_us = timestamp_us;
 }
 
 /**
  * \brief Update the weights of each particle
  * once a new set of RSSI measurements is received.
+ * The set holds the APs that reported, without any the particles are only predicted.
+ * The first set of at least 3 APs seeds the particles, see ble_particle_warm_start.
  * Following Monte Carlo's localization model.
  * 
- * \param data Pointer to a structure with AP measurements
+ * \param pf Filter.
+ * \param data Pointer to a structure with AP measurements, their timestamp
  * and the current postion state of the node
  * 
  * \return 0 on succes, -1 on failure.
  */
 int 
-ble_particle_update(ble_particle_data_t *data)
-{
-    static ble_particle_t *particles = NULL;
-    static ble_particle_ap_t *prev_ap = NULL;
-
-    // generate a new set of particles, uniformly distributed over area
-    // only when not yet initialized
-    if (particles == NULL) {
-        // weights are initalized based on the starting position of the node
-        particles = ble_particle_generate(PARTICLE_SET);
-        // allocation error
-        if (particles == NULL)
-            return -1;
+ble_particle_filter_update(ble_particle_filter_t *pf, ble_particle_data_t *data)
+{
+    if (pf == NULL || data == NULL || data->ap_count < 0 || data->ap_count > NO_OF_APS)
+        return -1;
+    ble_particle_set_dt(pf, data->timestamp_us);
+    ble_particle_warm_start(pf, data->aps, data->ap_count);
+
+    if (pf->pool != NULL) {
+        ble_particle_parallel_update(pf, data);
+        memcpy(pf->prev_ap, data->aps, sizeof(pf->prev_ap));
+        pf->prev_ap_count = data->ap_count;
+        data->particles = pf->set.size;
+        return 0;
     }
 
     // predict new state for all particles according to motion models
-    ble_particle_state_predict(particles, PARTICLE_SET);
+    ble_particle_state_predict(pf);
 
     // calculate exact distance from AP to each particle
     // and gain factor according to observation model
-    ble_particle_ap_dist_t **dist; 
-    dist = malloc(PARTICLE_SET * sizeof(ble_particle_ap_dist_t*));
-    if (dist == NULL)
+    ble_particle_weight(pf, data->aps, data->ap_count);
+    // sums for the ESS and the estimate in a single pass,
+    // the weights are normalized once resampling needs them
+    float n_eff = ble_particle_moments(pf);
+
+    // check if we need to resample based on effective sample size,
+    // or to change the amount of particles chosen by KLD-sampling
+    if (n_eff < (pf->set.size * pf->cfg.ratio_coefficient) || pf->next_size != pf->set.size)
+        ble_particle_resample(pf);
+
+    // calculate a weighted average of all particles for a node state estimate
+    ble_particle_estimate(pf, &data->node);
+
+    // overwrite previous state
+    memcpy(pf->prev_ap, data->aps, sizeof(pf->prev_ap));
+    pf->prev_ap_count = data->ap_count;
+    data->particles = pf->set.size;
+
+    return 0;
+}
+
+/**
+ * \brief Predict the particles with the motion model only, for a streaming filter
+ * that runs the motion model on a clock, see ble_particle_filter_observe.
+ * Runs on the calling task, also when the filter has a pool.
+ * 
+ * \param pf Filter.
+ * \param timestamp_us Current time in microseconds, 0 assumes the nominal update interval.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_filter_predict(ble_particle_filter_t *pf, int64_t timestamp_us)
+{
+    if (pf == NULL)
         return -1;
-    for (int i = 0; i < PARTICLE_SET; i++) {
-        dist[i] = malloc(NO_OF_APS * sizeof(ble_particle_ap_dist_t));
-        if (dist[i] == NULL)
-            return -1;
+    ble_particle_set_dt(pf, timestamp_us);
+    ble_particle_state_predict(pf);
+    return 0;
+}
+
+/**
+ * \brief Weight the particles with a single AP measurement as soon as it arrives,
+ * instead of waiting for a set. The ESS is checked after every measurement,
+ * so the filter only resamples once enough measurements sharpened the weights.
+ * The estimate is normalized by the longest recent distance of all APs, as within a set,
+ * and a measurement counts for 1 / sqrt(NO_OF_APS) of the gain of a full set,
+ * so a round of measurements from every AP sharpens the weights about as much as a set.
+ * Once 3 APs reported recently, the particles are seeded around their trilateration.
+ * Runs on the calling task, also when the filter has a pool.
+ * 
+ * \param pf Filter.
+ * \param ap Measurement of a single AP.
+ * \param data Written with the recent measurements, the position estimate 
+ * and the amount of particles.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_particle_filter_observe(ble_particle_filter_t *pf, const ble_particle_ap_t *ap, 
+    ble_particle_data_t *data)
+{
+    if (pf == NULL || ap == NULL || data == NULL)
+        return -1;
+    ble_particle_keep_ap(pf->prev_ap, &pf->prev_ap_count, ap);
+
+    // recent measurements of all APs
+    ble_particle_ap_t fresh[NO_OF_APS];
+    int fresh_count = 0;
+    float max_d_node = 0;
+    for (int j = 0; j < pf->prev_ap_count; j++) {
+        const ble_particle_ap_t *prev = &pf->prev_ap[j];
+        if (ap->timestamp_us != 0 && prev->timestamp_us != 0 && 
+                (float)(ap->timestamp_us - prev->timestamp_us) * 1e-6F > pf->cfg.ap_max_age)
+            continue;
+        fresh[fresh_count++] = *prev;
+        if (prev->node_distance > max_d_node)
+            max_d_node = prev->node_distance;
     }
-    for (int i = 0; i < PARTICLE_SET; i++) {
-        for (int j = 0; j < NO_OF_APS; j++) {
-            // use absolute distance to access point, direction not important here
-            float d_diff_x = fabsf(data->aps[j].pos.x - particles[i].state.pos.x);
-            float d_diff_y = fabsf(data->aps[j].pos.y - particles[i].state.pos.y);
-            // assuming our area is rectangualar
-            // using Pythagorean theorem: a^2 + b^2 = c^2
-            dist[i][j].d_particle = sqrtf(powf(d_diff_x, 2) + powf(d_diff_y, 2));
-            dist[i][j].d_node = data->aps[j].node_distance;
-        } 
-    }
-    for (int i = 0; i < PARTICLE_SET; i++) {
-        float gain = ble_particle_weight_gain(dist[i], NO_OF_APS);
-        // calculate new weight for each particle
-        particles[i].weight = particles[i].weight * gain;
-    }
-    // normalize weights again so that the sum equals 1
-    ble_particle_normalize(particles, PARTICLE_SET);
-
-    // calculate effective sample size (ESS) for normalized weights where
-    // w_i >= 0 and sum(w_i) -> N with i = 1 equals 1
-    // ESS = 1 / sum(w_i)^2 -> N
-    float sum_weights_pow = 0;
-    for (int i = 0; i < PARTICLE_SET; i++)
-        sum_weights_pow += powf(particles[i].weight, 2);
-    float n_eff = 1 / sum_weights_pow;
-    // check if we need to resample based on effective sample size
-    if (n_eff < (PARTICLE_SET * RATIO_COEFFICIENT))
-        ble_particle_resample(particles, PARTICLE_SET);
+    if (max_d_node <= 0)
+        return -1;
+    ble_particle_warm_start(pf, fresh, fresh_count);
 
-    // calculate a weighted average of all particles for a node state estimate
-    float sum_coord_x = 0, sum_coord_y = 0, sum_weights = 0;
-    for (int i = 0; i < PARTICLE_SET; i++) {
-        sum_weights += particles[i].weight;
-        sum_coord_x += (particles[i].weight * particles[i].state.pos.x);
-        sum_coord_y += (particles[i].weight * particles[i].state.pos.y);
+    ble_particle_ap_t meas = *ap;
+    float scale = 1.0F / (sqrtf((float)NO_OF_APS) * pf->cfg.ap_measurement_var);
+    int planes[LUT_MAX_APS];
+    int use_lut = ble_particle_lut_planes(pf, &meas, 1, planes);
+    ble_particle_weight_range(pf, &meas, 1, &scale, 1.0F / max_d_node, 
+        use_lut ? planes : NULL, 0, pf->set.size);
+    pf->weight_scale = 1.0F;
+
+    float n_eff = ble_particle_moments(pf);
+    if (n_eff < (pf->set.size * pf->cfg.ratio_coefficient) || pf->next_size != pf->set.size)
+        ble_particle_resample(pf);
+    ble_particle_estimate(pf, &data->node);
+
+    memcpy(data->aps, pf->prev_ap, sizeof(pf->prev_ap));
+    data->ap_count = pf->prev_ap_count;
+    data->timestamp_us = ap->timestamp_us;
+    data->particles = pf->set.size;
+
+    return 0;
+}
+
+/**
+ * \brief Write the state of a filter to a snapshot: the particles, their weights 
+ * and the generator. The time of the last update and the AP measurements are not kept,
+ * they do not survive a reset of the device.
+ * 
+ * \param pf Filter.
+ * \param s Snapshot to append to.
+ * 
+ * \return 0 on succes, -1 when the snapshot is full.
+ */
+int 
+ble_particle_filter_pack(const ble_particle_filter_t *pf, ble_snapshot_t *s)
+{
+    const ble_particle_set_t *set = &pf->set;
+    // the heading representation and weight domain must match on restore
+    uint8_t format[2] = {PARTICLE_HEADING, pf->log_weight != NULL};
+    int32_t size = set->size, next_size = pf->next_size;
+    ble_snapshot_put(s, format, sizeof(format));
+    ble_snapshot_put(s, &size, sizeof(size));
+    ble_snapshot_put(s, &next_size, sizeof(next_size));
+    ble_snapshot_put(s, &pf->rng, sizeof(pf->rng));
+    ble_snapshot_put(s, &pf->weight_scale, sizeof(pf->weight_scale));
+
+    // field by field, so the particle layout does not matter
+    for (int i = 0; i < set->size; i++) {
+        float state[] = {
+            PARTICLE_X(set, i), 
+            PARTICLE_Y(set, i), 
+            PARTICLE_WEIGHT(set, i), 
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+            PARTICLE_HX(set, i), 
+            PARTICLE_HY(set, i)
+#else
+            PARTICLE_THETA(set, i)
+#endif
+        };
+        uint8_t motion = (uint8_t)PARTICLE_MOTION(set, i);
+        ble_snapshot_put(s, state, sizeof(state));
+        ble_snapshot_put(s, &motion, sizeof(motion));
     }
-    // clamp position in our area
-    data->node.pos.x = clampf((sum_coord_x / sum_weights), 0, AREA_X);
-    data->node.pos.y = clampf((sum_coord_y / sum_weights), 0, AREA_Y);
-
-    if (prev_ap == NULL)
-        prev_ap = malloc(NO_OF_APS * sizeof(ble_particle_ap_t));
-    // overwrite previous state    
-    memcpy(prev_ap, data->aps, NO_OF_APS * sizeof(ble_particle_ap_t));
-    
-    for (int i = 0; i < PARTICLE_SET; i++)
-        free(dist[i]);
-    free(dist);
+    if (pf->log_weight != NULL)
+        ble_snapshot_put(s, pf->log_weight, set->size * sizeof(float));
+
+    return s->error ? -1 : 0;
+}
+
+/**
+ * \brief Restore the state of a filter from a snapshot written by ble_particle_filter_pack.
+ * The particles count as seeded, so the next set does not warm-start the filter.
+ * 
+ * \param pf Filter with the configuration of the snapshot, reset it on failure.
+ * \param s Snapshot to read from.
+ * 
+ * \return 0 on succes, -1 when the snapshot does not fit the filter or is cut short.
+ */
+int 
+ble_particle_filter_unpack(ble_particle_filter_t *pf, ble_snapshot_t *s)
+{
+    ble_particle_set_t *set = &pf->set;
+    uint8_t format[2];
+    int32_t size, next_size;
+    ble_rng_t rng;
+    float weight_scale;
+    ble_snapshot_get(s, format, sizeof(format));
+    ble_snapshot_get(s, &size, sizeof(size));
+    ble_snapshot_get(s, &next_size, sizeof(next_size));
+    ble_snapshot_get(s, &rng, sizeof(rng));
+    ble_snapshot_get(s, &weight_scale, sizeof(weight_scale));
+    if (s->error || format[0] != PARTICLE_HEADING || format[1] != (pf->log_weight != NULL) || 
+            size <= 0 || size > pf->cfg.particles || 
+            next_size <= 0 || next_size > pf->cfg.particles)
+        return -1;
+
+    for (int i = 0; i < size; i++) {
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+        float state[5];
+#else
+        float state[4];
+#endif
+        uint8_t motion;
+        ble_snapshot_get(s, state, sizeof(state));
+        ble_snapshot_get(s, &motion, sizeof(motion));
+        PARTICLE_X(set, i) = state[0];
+        PARTICLE_Y(set, i) = state[1];
+        PARTICLE_WEIGHT(set, i) = state[2];
+#if PARTICLE_HEADING == PARTICLE_HEADING_VECTOR
+        PARTICLE_HX(set, i) = state[3];
+        PARTICLE_HY(set, i) = state[4];
+#else
+        PARTICLE_THETA(set, i) = state[3];
+#endif
+        PARTICLE_MOTION(set, i) = (motion < MOTION_STATE_COUNT) ? motion : MOTION_STATE_STOP;
+    }
+    if (pf->log_weight != NULL)
+        ble_snapshot_get(s, pf->log_weight, size * sizeof(float));
+    if (s->error)
+        return -1;
+
+    set->size = size;
+    pf->spare.size = size;
+    pf->next_size = next_size;
+    pf->rng = rng;
+    if (pf->pool != NULL)
+        ble_particle_seed_chunks(pf);
+    pf->weight_scale = weight_scale;
+    pf->last_us = 0;
+    pf->dt_scale = 1.0F;
+    pf->prev_ap_count = 0;
+    pf->warm = 1;
 
     return 0;
 }
\ No newline at end of file
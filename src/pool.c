@@ -0,0 +1,330 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/pool.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+#ifdef NATIVE
+#include <pthread.h>
+
+typedef struct {
+    ble_pool_t *pool;
+    int index;
+} ble_pool_worker_t;
+
+struct ble_pool {
+    int workers;
+    pthread_t *threads;
+    ble_pool_worker_t *args;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    ble_pool_fn_t fn;
+    void *arg;
+    // incremented for every job, so workers can tell a new job from a spurious wakeup
+    unsigned long generation;
+    int pending;
+    int stop;
+};
+
+/**
+ * \brief Worker thread, waits for a job, runs it and reports back.
+ * 
+ * \param pv_params Worker arguments.
+ * 
+ * \return NULL.
+ */
+static void *
+ble_pool_worker(void *pv_params)
+{
+    ble_pool_worker_t *w = pv_params;
+    ble_pool_t *pool = w->pool;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        ble_pool_fn_t fn = pool->fn;
+        void *arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(arg, w->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Create a pool of worker threads.
+ * The calling thread acts as worker 0, so workers - 1 threads are started.
+ * 
+ * \param workers Amount of workers.
+ * 
+ * \return Pointer to the pool, NULL on error.
+ */
+ble_pool_t *
+ble_pool_create(int workers)
+{
+    if (workers < 1)
+        return NULL;
+
+    ble_pool_t *pool = calloc(1, sizeof(ble_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = workers;
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    pool->args = calloc(workers, sizeof(ble_pool_worker_t));
+    if (pool->threads == NULL || pool->args == NULL) {
+        free(pool->threads);
+        free(pool->args);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 1; i < workers; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, ble_pool_worker, &pool->args[i]) != 0) {
+            // only join the threads that were started
+            pool->workers = i;
+            ble_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * \brief Run a job on every worker and wait until all of them are done.
+ * 
+ * \param pool Pool.
+ * \param fn Job, called once for every worker.
+ * \param arg Argument passed to the job.
+ */
+void 
+ble_pool_run(ble_pool_t *pool, ble_pool_fn_t fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->pending = pool->workers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    fn(arg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief Stop all worker threads and free the pool.
+ * 
+ * \param pool Pool, may be NULL.
+ */
+void 
+ble_pool_destroy(ble_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->workers; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool->args);
+    free(pool);
+}
+#else
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+typedef struct {
+    ble_pool_t *pool;
+    int index;
+} ble_pool_worker_t;
+
+struct ble_pool {
+    int workers;
+    TaskHandle_t *tasks;
+    ble_pool_worker_t *args;
+    // given by every worker when it finished a job
+    SemaphoreHandle_t done;
+    ble_pool_fn_t fn;
+    void *arg;
+    volatile int stop;
+};
+
+/**
+ * \brief Worker task, waits for a notification, runs the job and reports back.
+ * 
+ * \param pv_params Worker arguments, provided to xTaskCreatePinnedToCore.
+ */
+static void 
+ble_pool_worker(void *pv_params)
+{
+    ble_pool_worker_t *w = pv_params;
+    ble_pool_t *pool = w->pool;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (pool->stop)
+            break;
+        pool->fn(pool->arg, w->index);
+        xSemaphoreGive(pool->done);
+    }
+    // let ble_pool_destroy know this task no longer uses the pool
+    xSemaphoreGive(pool->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * \brief Create a pool of worker tasks.
+ * The calling task acts as worker 0 and should run on POOL_CORE,
+ * worker i is pinned to core (POOL_CORE + i) % portNUM_PROCESSORS.
+ * 
+ * \param workers Amount of workers.
+ * 
+ * \return Pointer to the pool, NULL on error.
+ */
+ble_pool_t *
+ble_pool_create(int workers)
+{
+    if (workers < 1)
+        return NULL;
+
+    ble_pool_t *pool = calloc(1, sizeof(ble_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = workers;
+    pool->tasks = calloc(workers, sizeof(TaskHandle_t));
+    pool->args = calloc(workers, sizeof(ble_pool_worker_t));
+    pool->done = xSemaphoreCreateCounting(workers, 0);
+    if (pool->tasks == NULL || pool->args == NULL || pool->done == NULL) {
+        if (pool->done != NULL)
+            vSemaphoreDelete(pool->done);
+        free(pool->tasks);
+        free(pool->args);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 1; i < workers; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].index = i;
+        if (xTaskCreatePinnedToCore(ble_pool_worker, POOL_TASK_NAME, POOL_TASK_SIZE, 
+                &pool->args[i], POOL_TASK_PRIO, &pool->tasks[i], 
+                (POOL_CORE + i) % portNUM_PROCESSORS) != pdPASS) {
+            // only stop the tasks that were started
+            pool->workers = i;
+            ble_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * \brief Run a job on every worker and wait until all of them are done.
+ * 
+ * \param pool Pool.
+ * \param fn Job, called once for every worker.
+ * \param arg Argument passed to the job.
+ */
+void 
+ble_pool_run(ble_pool_t *pool, ble_pool_fn_t fn, void *arg)
+{
+    pool->fn = fn;
+    pool->arg = arg;
+    for (int i = 1; i < pool->workers; i++)
+        xTaskNotifyGive(pool->tasks[i]);
+
+    fn(arg, 0);
+
+    for (int i = 1; i < pool->workers; i++)
+        xSemaphoreTake(pool->done, portMAX_DELAY);
+}
+
+/**
+ * \brief Stop all worker tasks and free the pool.
+ * 
+ * \param pool Pool, may be NULL.
+ */
+void 
+ble_pool_destroy(ble_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pool->stop = 1;
+    for (int i = 1; i < pool->workers; i++)
+        xTaskNotifyGive(pool->tasks[i]);
+    for (int i = 1; i < pool->workers; i++)
+        xSemaphoreTake(pool->done, portMAX_DELAY);
+
+    vSemaphoreDelete(pool->done);
+    free(pool->tasks);
+    free(pool->args);
+    free(pool);
+}
+#endif
+
+/**
+ * \brief Get the amount of workers of a pool.
+ * 
+ * \param pool Pool.
+ * 
+ * \return Amount of workers.
+ */
+int 
+ble_pool_workers(ble_pool_t *pool)
+{
+    return pool->workers;
+}
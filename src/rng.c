@@ -0,0 +1,387 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/rng.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "rng.h"
+#include "util.h"
+
+// 2^-24, converts the upper 24 bits of a random number to a float in [0..1)
+#define RNG_FLOAT_UNIT          (1.0F / 16777216.0F)
+
+// Ziggurat of the standard normal distribution (Marsaglia and Tsang, 2000)
+// 128 layers of equal area, the base layer includes the tail beyond RNG_ZIGGURAT_R
+#define RNG_ZIGGURAT_LAYERS     128
+#define RNG_ZIGGURAT_R          3.442619855899F
+
+// layer i accepts a 32 bit sample |j| < k[i] right away as x = j * w[i],
+// f[i] = exp(-x_i^2 / 2) at the edge of the layer
+// generated for 2^31 with the recursion of the paper, stored in flash on the ESP32
+static const uint32_t ble_rng_zig_k[RNG_ZIGGURAT_LAYERS] = {
+    0x76ad2212U, 0x00000000U, 0x600f1b53U, 0x6ce447a6U, 0x725b46a2U, 0x7560051dU,
+    0x774921ebU, 0x789a25bdU, 0x799045c3U, 0x7a4bce5dU, 0x7adf629fU, 0x7b5682a6U,
+    0x7bb8a8c6U, 0x7c0ae722U, 0x7c50cce7U, 0x7c8cec5bU, 0x7cc12cd6U, 0x7ceefed2U,
+    0x7d177e0bU, 0x7d3b8883U, 0x7d5bce6cU, 0x7d78dd64U, 0x7d932886U, 0x7dab0e57U,
+    0x7dc0dd30U, 0x7dd4d688U, 0x7de73185U, 0x7df81ceaU, 0x7e07c0a3U, 0x7e163efaU,
+    0x7e23b587U, 0x7e303dfdU, 0x7e3beec2U, 0x7e46db77U, 0x7e51155dU, 0x7e5aabb3U,
+    0x7e63abf7U, 0x7e6c222cU, 0x7e741906U, 0x7e7b9a18U, 0x7e82adfaU, 0x7e895c63U,
+    0x7e8fac4bU, 0x7e95a3fbU, 0x7e9b4924U, 0x7ea0a0efU, 0x7ea5b00dU, 0x7eaa7ac3U,
+    0x7eaf04f3U, 0x7eb3522aU, 0x7eb765a5U, 0x7ebb4259U, 0x7ebeeafdU, 0x7ec2620aU,
+    0x7ec5a9c4U, 0x7ec8c441U, 0x7ecbb365U, 0x7ece78edU, 0x7ed11671U, 0x7ed38d62U,
+    0x7ed5df12U, 0x7ed80cb4U, 0x7eda175cU, 0x7edc0005U, 0x7eddc78eU, 0x7edf6ebfU,
+    0x7ee0f647U, 0x7ee25ebeU, 0x7ee3a8a9U, 0x7ee4d473U, 0x7ee5e276U, 0x7ee6d2f5U,
+    0x7ee7a620U, 0x7ee85c10U, 0x7ee8f4cdU, 0x7ee97047U, 0x7ee9ce59U, 0x7eea0ecaU,
+    0x7eea3147U, 0x7eea3568U, 0x7eea1aabU, 0x7ee9e071U, 0x7ee98602U, 0x7ee90a88U,
+    0x7ee86d08U, 0x7ee7ac6aU, 0x7ee6c769U, 0x7ee5bc9cU, 0x7ee48a67U, 0x7ee32efcU,
+    0x7ee1a857U, 0x7edff42fU, 0x7ede0ffaU, 0x7edbf8d9U, 0x7ed9ab94U, 0x7ed7248dU,
+    0x7ed45faeU, 0x7ed1585cU, 0x7ece095fU, 0x7eca6ccbU, 0x7ec67be2U, 0x7ec22eeeU,
+    0x7ebd7d1aU, 0x7eb85c35U, 0x7eb2c075U, 0x7eac9c20U, 0x7ea5df27U, 0x7e9e769fU,
+    0x7e964c16U, 0x7e8d44baU, 0x7e834033U, 0x7e781728U, 0x7e6b9933U, 0x7e5d8a1aU,
+    0x7e4d9dedU, 0x7e3b737aU, 0x7e268c2fU, 0x7e0e3ff5U, 0x7df1aa5dU, 0x7dcf8c72U,
+    0x7da61a1eU, 0x7d72a0fbU, 0x7d30e097U, 0x7cd9b4abU, 0x7c600f1aU, 0x7ba90bdcU,
+    0x7a722176U, 0x77d664e5U
+};
+static const float ble_rng_zig_w[RNG_ZIGGURAT_LAYERS] = {
+    1.729040522e-09F, 1.268092845e-10F, 1.689751777e-10F, 1.986268844e-10F,
+    2.223243179e-10F, 2.424493613e-10F, 2.601613190e-10F, 2.761198871e-10F,
+    2.907396282e-10F, 3.042997041e-10F, 3.169979521e-10F, 3.289802053e-10F,
+    3.403573812e-10F, 3.512160221e-10F, 3.616250995e-10F, 3.716405763e-10F,
+    3.813085643e-10F, 3.906675681e-10F, 3.997501187e-10F, 4.085839862e-10F,
+    4.171930964e-10F, 4.255982353e-10F, 4.338175974e-10F, 4.418672181e-10F,
+    4.497613196e-10F, 4.575125889e-10F, 4.651324048e-10F, 4.726310238e-10F,
+    4.800177347e-10F, 4.873009868e-10F, 4.944884981e-10F, 5.015873466e-10F,
+    5.086040482e-10F, 5.155446229e-10F, 5.224146520e-10F, 5.292193275e-10F,
+    5.359634953e-10F, 5.426516925e-10F, 5.492881800e-10F, 5.558769721e-10F,
+    5.624218613e-10F, 5.689264417e-10F, 5.753941290e-10F, 5.818281786e-10F,
+    5.882317021e-10F, 5.946076818e-10F, 6.009589843e-10F, 6.072883728e-10F,
+    6.135985177e-10F, 6.198920075e-10F, 6.261713578e-10F, 6.324390202e-10F,
+    6.386973906e-10F, 6.449488167e-10F, 6.511956053e-10F, 6.574400293e-10F,
+    6.636843339e-10F, 6.699307434e-10F, 6.761814667e-10F, 6.824387039e-10F,
+    6.887046513e-10F, 6.949815079e-10F, 7.012714804e-10F, 7.075767893e-10F,
+    7.138996747e-10F, 7.202424015e-10F, 7.266072661e-10F, 7.329966016e-10F,
+    7.394127850e-10F, 7.458582428e-10F, 7.523354585e-10F, 7.588469793e-10F,
+    7.653954238e-10F, 7.719834898e-10F, 7.786139632e-10F, 7.852897266e-10F,
+    7.920137693e-10F, 7.987891979e-10F, 8.056192475e-10F, 8.125072942e-10F,
+    8.194568683e-10F, 8.264716694e-10F, 8.335555823e-10F, 8.407126946e-10F,
+    8.479473165e-10F, 8.552640026e-10F, 8.626675754e-10F, 8.701631525e-10F,
+    8.777561764e-10F, 8.854524480e-10F, 8.932581641e-10F, 9.011799601e-10F,
+    9.092249580e-10F, 9.174008206e-10F, 9.257158144e-10F, 9.341788804e-10F,
+    9.427997160e-10F, 9.515888694e-10F, 9.605578494e-10F, 9.697192525e-10F,
+    9.790869128e-10F, 9.886760771e-10F, 9.985036135e-10F, 1.008588259e-09F,
+    1.018950917e-09F, 1.029615015e-09F, 1.040606944e-09F, 1.051956589e-09F,
+    1.063697999e-09F, 1.075870210e-09F, 1.088518296e-09F, 1.101694708e-09F,
+    1.115461010e-09F, 1.129890161e-09F, 1.145069570e-09F, 1.161105243e-09F,
+    1.178127561e-09F, 1.196299505e-09F, 1.215828698e-09F, 1.236985629e-09F,
+    1.260132330e-09F, 1.285769684e-09F, 1.314620185e-09F, 1.347783956e-09F,
+    1.387063532e-09F, 1.435740319e-09F, 1.500865903e-09F, 1.603094794e-09F
+};
+static const float ble_rng_zig_f[RNG_ZIGGURAT_LAYERS] = {
+    1.000000000e+00F, 9.635996931e-01F, 9.362826817e-01F, 9.130436480e-01F,
+    8.922816508e-01F, 8.732430489e-01F, 8.555006079e-01F, 8.387836053e-01F,
+    8.229072114e-01F, 8.077382947e-01F, 7.931770118e-01F, 7.791460859e-01F,
+    7.655841739e-01F, 7.524415592e-01F, 7.396772437e-01F, 7.272569183e-01F,
+    7.151515074e-01F, 7.033360990e-01F, 6.917891434e-01F, 6.804918410e-01F,
+    6.694276673e-01F, 6.585820001e-01F, 6.479418211e-01F, 6.374954773e-01F,
+    6.272324852e-01F, 6.171433708e-01F, 6.072195366e-01F, 5.974531509e-01F,
+    5.878370544e-01F, 5.783646811e-01F, 5.690299911e-01F, 5.598274127e-01F,
+    5.507517931e-01F, 5.417983550e-01F, 5.329626594e-01F, 5.242405727e-01F,
+    5.156282382e-01F, 5.071220511e-01F, 4.987186355e-01F, 4.904148253e-01F,
+    4.822076463e-01F, 4.740943007e-01F, 4.660721527e-01F, 4.581387163e-01F,
+    4.502916437e-01F, 4.425287153e-01F, 4.348478302e-01F, 4.272469983e-01F,
+    4.197243320e-01F, 4.122780401e-01F, 4.049064208e-01F, 3.976078565e-01F,
+    3.903808082e-01F, 3.832238111e-01F, 3.761354695e-01F, 3.691144537e-01F,
+    3.621594954e-01F, 3.552693848e-01F, 3.484429675e-01F, 3.416791412e-01F,
+    3.349768533e-01F, 3.283350984e-01F, 3.217529159e-01F, 3.152293881e-01F,
+    3.087636380e-01F, 3.023548278e-01F, 2.960021568e-01F, 2.897048604e-01F,
+    2.834622082e-01F, 2.772735029e-01F, 2.711380791e-01F, 2.650553023e-01F,
+    2.590245674e-01F, 2.530452985e-01F, 2.471169475e-01F, 2.412389935e-01F,
+    2.354109423e-01F, 2.296323252e-01F, 2.239026994e-01F, 2.182216466e-01F,
+    2.125887731e-01F, 2.070037094e-01F, 2.014661101e-01F, 1.959756531e-01F,
+    1.905320403e-01F, 1.851349970e-01F, 1.797842721e-01F, 1.744796383e-01F,
+    1.692208922e-01F, 1.640078547e-01F, 1.588403711e-01F, 1.537183122e-01F,
+    1.486415742e-01F, 1.436100801e-01F, 1.386237800e-01F, 1.336826526e-01F,
+    1.287867062e-01F, 1.239359802e-01F, 1.191305467e-01F, 1.143705124e-01F,
+    1.096560210e-01F, 1.049872554e-01F, 1.003644410e-01F, 9.578784912e-02F,
+    9.125780083e-02F, 8.677467189e-02F, 8.233889824e-02F, 7.795098251e-02F,
+    7.361150188e-02F, 6.932111739e-02F, 6.508058521e-02F, 6.089077035e-02F,
+    5.675266348e-02F, 5.266740190e-02F, 4.863629586e-02F, 4.466086220e-02F,
+    4.074286807e-02F, 3.688438879e-02F, 3.308788615e-02F, 2.935631744e-02F,
+    2.569329194e-02F, 2.210330462e-02F, 1.859210274e-02F, 1.516729801e-02F,
+    1.183947866e-02F, 8.624484413e-03F, 5.548995221e-03F, 2.669629084e-03F
+};
+
+/**
+ * \brief SplitMix64 generator, used to expand a 64 bit seed into engine state.
+ * https://prng.di.unimi.it/splitmix64.c
+ * 
+ * \param x Pointer to the generator state.
+ * 
+ * \return Next 64 bit value.
+ */
+static uint64_t 
+ble_rng_splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * \brief Seed a random number generator.
+ * The same seed always produces the same sequence.
+ * 
+ * \param rng Generator state.
+ * \param seed Seed value.
+ */
+void 
+ble_rng_seed(ble_rng_t *rng, uint64_t seed)
+{
+#if RNG_ENGINE == RNG_ENGINE_PCG32
+    rng->state = 0;
+    rng->inc = (ble_rng_splitmix64(&seed) << 1) | 1;
+    ble_rng_next(rng);
+    rng->state += ble_rng_splitmix64(&seed);
+    ble_rng_next(rng);
+#else
+    for (int i = 0; i < 4; i += 2) {
+        uint64_t z = ble_rng_splitmix64(&seed);
+        rng->s[i] = (uint32_t)z;
+        rng->s[i+1] = (uint32_t)(z >> 32);
+    }
+#endif
+}
+
+/**
+ * \brief Create a seed from the current time and process id,
+ * for when runs should not be reproducible.
+ * 
+ * \return Seed value.
+ */
+uint64_t 
+ble_rng_entropy(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t hi = ble_util_mix(clock(), (tv.tv_usec ^ tv.tv_sec), getpid());
+    uint64_t lo = ble_util_mix(tv.tv_usec, getpid(), tv.tv_sec);
+    return (hi << 32) ^ lo;
+}
+
+/**
+ * \brief Return the next 32 bit random number.
+ * xoshiro128+: https://prng.di.unimi.it/xoshiro128plus.c
+ * PCG32: https://www.pcg-random.org/download.html
+ * 
+ * \param rng Generator state.
+ * 
+ * \return Random 32 bit value.
+ */
+uint32_t 
+ble_rng_next(ble_rng_t *rng)
+{
+#if RNG_ENGINE == RNG_ENGINE_PCG32
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+#else
+    uint32_t *s = rng->s;
+    uint32_t result = s[0] + s[3];
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 11) | (s[3] >> 21);
+
+    return result;
+#endif
+}
+
+/**
+ * \brief Return a random float in the range [0..1).
+ * Only the upper 24 bits are used, as these are the best quality bits
+ * and fill the mantissa of a float exactly.
+ * 
+ * \param rng Generator state.
+ * 
+ * \return Random float in [0..1).
+ */
+float 
+ble_rng_uniform(ble_rng_t *rng)
+{
+    return (float)(ble_rng_next(rng) >> 8) * RNG_FLOAT_UNIT;
+}
+
+/**
+ * \brief Return a random float value between a range.
+ * 
+ * \param rng Generator state.
+ * \param min Minimum number of the range.
+ * \param max Maximum number of the range.
+ * 
+ * \return Random float between a range.
+ */
+float 
+ble_rng_range(ble_rng_t *rng, float min, float max)
+{
+    return min + ble_rng_uniform(rng) * (max - min);
+}
+
+/**
+ * \brief Return a sample from a given amount of states.
+ * 
+ * \param rng Generator state.
+ * \param state_amount Amount of states to sample from.
+ * 
+ * \return Random state in [0..state_amount).
+ */
+int 
+ble_rng_sample(ble_rng_t *rng, int state_amount)
+{
+    // multiply-shift instead of modulo, avoids a division and the modulo bias
+    return (int)(((uint64_t)ble_rng_next(rng) * (uint32_t)state_amount) >> 32);
+}
+
+/**
+ * \brief Sample the tail or the wedge of a Ziggurat layer,
+ * for the few samples that fall outside the rectangle of their layer.
+ * 
+ * \param rng Generator state.
+ * \param j Signed 32 bit sample.
+ * \param i Layer of the sample.
+ * 
+ * \return Value from the standard normal distribution.
+ */
+static float 
+ble_rng_ziggurat_slow(ble_rng_t *rng, int32_t j, int i)
+{
+    for (;;) {
+        float x = (float)j * ble_rng_zig_w[i];
+        if (i == 0) {
+            // tail beyond r, Marsaglia's method with two exponentials
+            float y;
+            do {
+                x = -logf((float)((ble_rng_next(rng) >> 8) + 1) * RNG_FLOAT_UNIT) * 
+                    (1.0F / RNG_ZIGGURAT_R);
+                y = -logf((float)((ble_rng_next(rng) >> 8) + 1) * RNG_FLOAT_UNIT);
+            } while (y + y < x * x);
+            return (j > 0) ? (RNG_ZIGGURAT_R + x) : -(RNG_ZIGGURAT_R + x);
+        }
+        // wedge between the rectangle and the curve
+        if (ble_rng_zig_f[i] + ble_rng_uniform(rng) * (ble_rng_zig_f[i - 1] - ble_rng_zig_f[i]) 
+                < expf(-0.5F * x * x))
+            return x;
+        // rejected, start over with a new sample
+        uint32_t u = ble_rng_next(rng);
+        i = (int)(u >> 25);
+        j = (int32_t)(u << 7);
+        uint32_t mag = (j < 0) ? -(uint32_t)j : (uint32_t)j;
+        if (mag < ble_rng_zig_k[i])
+            return (float)j * ble_rng_zig_w[i];
+    }
+}
+
+/**
+ * \brief Create a sample from the standard normal distribution with the Ziggurat method.
+ * The upper 7 bits of a random number select the layer, the other bits form
+ * the signed sample, which lies within the rectangle of the layer about 98.8% of the time
+ * and then costs one multiply, no logarithm or trigonometry.
+ * The layer uses the upper bits, as the low bits of xoshiro128+ are weak.
+ * 
+ * \param rng Generator state.
+ * 
+ * \return Value from the standard normal distribution.
+ */
+static inline float 
+ble_rng_ziggurat(ble_rng_t *rng)
+{
+    uint32_t u = ble_rng_next(rng);
+    int i = (int)(u >> 25);
+    int32_t j = (int32_t)(u << 7);
+    // unsigned magnitude, -INT32_MIN does not fit an int32_t
+    uint32_t mag = (j < 0) ? -(uint32_t)j : (uint32_t)j;
+    if (mag < ble_rng_zig_k[i])
+        return (float)j * ble_rng_zig_w[i];
+    return ble_rng_ziggurat_slow(rng, j, i);
+}
+
+/**
+ * \brief Create a sample from Gaussian probability distribution,
+ * using the Ziggurat method.
+ * 
+ * \param rng Generator state.
+ * \param mu Mean of the Gaussian.
+ * \param sigma Standarddeviation.
+ * 
+ * \return Value in Gaussian distribution with given mu and sigma.
+ */
+float 
+ble_rng_normal(ble_rng_t *rng, float mu, float sigma)
+{
+    return ble_rng_ziggurat(rng) * sigma + mu;
+}
+
+/**
+ * \brief Fill a buffer with random floats between a range.
+ * 
+ * \param rng Generator state.
+ * \param buf Buffer to fill.
+ * \param n Amount of values.
+ * \param min Minimum number of the range.
+ * \param max Maximum number of the range.
+ */
+void 
+ble_rng_fill_uniform(ble_rng_t *rng, float *buf, int n, float min, float max)
+{
+    float scale = (max - min) * RNG_FLOAT_UNIT;
+    for (int i = 0; i < n; i++)
+        buf[i] = min + (float)(ble_rng_next(rng) >> 8) * scale;
+}
+
+/**
+ * \brief Fill a buffer with samples from a Gaussian distribution,
+ * using the Ziggurat method.
+ * 
+ * \param rng Generator state.
+ * \param buf Buffer to fill.
+ * \param n Amount of values.
+ * \param mu Mean of the Gaussian.
+ * \param sigma Standarddeviation.
+ */
+void 
+ble_rng_fill_normal(ble_rng_t *rng, float *buf, int n, float mu, float sigma)
+{
+    for (int i = 0; i < n; i++)
+        buf[i] = ble_rng_ziggurat(rng) * sigma + mu;
+}
@@ -24,13 +24,20 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 
 #include "rssi.h"
 #include "util.h"
-#include "mqtt.h"
 #include "particle.h"
+#include "node.h"
 #include "config.h"
+#ifndef NATIVE
+#include "mqtt.h"
+
+// RSSI filter of every node
+static ble_rssi_filter_t filters[NODE_ID_COUNT];
+#endif
 
 /**
  * \brief Calculate a new state from old state & Kalman gain.
@@ -68,56 +75,121 @@ ble_rssi_to_meters(float kalman_rssi, int tx_power)
     // RSSI = -10 * n * log10(d / d0) + A0
     // with d0 measured at 1 meter:
     // d = 10^((A - RSSI) / (10 * n))
-    return pow10f(((float)tx_power - kalman_rssi) / (10.0F * BLE_ENV_FACTOR_IND));
+    return powf(10.0F, ((float)tx_power - kalman_rssi) / (10.0F * BLE_ENV_FACTOR_IND));
 }
 
 /**
  * \brief Filter high frequency parts from the smoothed RSSI data.
  * 
- * \param rssi_state Kalman smoothed RSSI state value.
+ * \param f RSSI filter holding the previous output and timestamp.
+ * \param kalman_rssi Kalman smoothed RSSI state value.
  * 
  * \return Low-pass filtered RSSI value.
  */
 static float 
-ble_rssi_low_pass_filter(float kalman_rssi)
+ble_rssi_low_pass_filter(ble_rssi_filter_t *f, float kalman_rssi)
 {
-    static float prev = 0;
-    static int64_t start_us = 0;
     // initialize
-    if (prev == 0)
-        prev = kalman_rssi;
+    if (f->low_pass.prev == 0)
+        f->low_pass.prev = kalman_rssi;
     
-    float dt = ble_util_timedelta(&start_us);
+    float dt = ble_util_timedelta(&f->low_pass.start_us);
     // smoothing factor (0 < alpha < 1)
-    float new = prev + ((dt / (kalman_rssi + dt)) * (kalman_rssi - prev));
-    prev = new;
+    float new = f->low_pass.prev + 
+        ((dt / (kalman_rssi + dt)) * (kalman_rssi - f->low_pass.prev));
+    f->low_pass.prev = new;
 
     return new;
 }
 
 /**
- * \brief Process a new RSSI measurement.
+ * \brief Initialize an RSSI filter.
+ * The Kalman state is initialized with the first measurement.
  * 
- * \param measurement Measured RSSI value.
+ * \param f RSSI filter.
  */
 void 
-ble_rssi_update(int measurement)
+ble_rssi_filter_init(ble_rssi_filter_t *f)
 {
-    static ble_rssi_state_t kalman_rssi = {0};
+    memset(f, 0, sizeof(ble_rssi_filter_t));
+}
 
+/**
+ * \brief Smooth a new RSSI measurement and convert it to a distance.
+ * 
+ * \param f RSSI filter.
+ * \param measurement Measured RSSI value.
+ * 
+ * \return Filtered distance in meters.
+ */
+float 
+ble_rssi_filter_update(ble_rssi_filter_t *f, int measurement)
+{
     // initialization
-    if (kalman_rssi.m_noise == 0) {
-        kalman_rssi.state = measurement;
-        kalman_rssi.err_v = ERROR_VARIANCE_P;
-        kalman_rssi.m_noise = MEASUREMENT_NOISE_R;
-        kalman_rssi.p_noise = PROCESS_NOISE_Q;
+    if (f->kalman.m_noise == 0) {
+        f->kalman.state = measurement;
+        f->kalman.err_v = ERROR_VARIANCE_P;
+        f->kalman.m_noise = MEASUREMENT_NOISE_R;
+        f->kalman.p_noise = PROCESS_NOISE_Q;
     }
     // smooth value using Kalman filter
-    ble_rssi_kf_estimate(&kalman_rssi, (float)measurement);
+    ble_rssi_kf_estimate(&f->kalman, (float)measurement);
     // distance calculation
-    float rssi_m = ble_rssi_to_meters(kalman_rssi.state, TX_POWER_ONE_METER);
+    float rssi_m = ble_rssi_to_meters(f->kalman.state, TX_POWER_ONE_METER);
     // low pass filter go get rid of high frequency spikes
-    float filtered_rssi_m = ble_rssi_low_pass_filter(rssi_m);
+    return ble_rssi_low_pass_filter(f, rssi_m);
+}
+
+/**
+ * \brief Write the state of an RSSI filter to a snapshot.
+ * 
+ * \param f RSSI filter.
+ * \param s Snapshot to append to.
+ */
+void 
+ble_rssi_filter_pack(const ble_rssi_filter_t *f, ble_snapshot_t *s)
+{
+    float state[] = {f->kalman.state, f->kalman.p_noise, f->kalman.m_noise, f->kalman.err_v, 
+        f->low_pass.prev};
+    ble_snapshot_put(s, state, sizeof(state));
+}
+
+/**
+ * \brief Restore the state of an RSSI filter written by ble_rssi_filter_pack.
+ * 
+ * \param f RSSI filter, unchanged when the snapshot is cut short.
+ * \param s Snapshot to read from.
+ */
+void 
+ble_rssi_filter_unpack(ble_rssi_filter_t *f, ble_snapshot_t *s)
+{
+    float state[5];
+    ble_snapshot_get(s, state, sizeof(state));
+    if (s->error)
+        return;
+    f->kalman.state = state[0];
+    f->kalman.p_noise = state[1];
+    f->kalman.m_noise = state[2];
+    f->kalman.err_v = state[3];
+    f->low_pass.prev = state[4];
+    // the timer restarts on boot, the next measurement starts a new interval
+    f->low_pass.start_us = 0;
+}
+
+#ifndef NATIVE
+/**
+ * \brief Process a new RSSI measurement of a node.
+ * Every node has its own RSSI filter.
+ * 
+ * \param node_id ID of the node that was scanned.
+ * \param measurement Measured RSSI value.
+ */
+void 
+ble_rssi_update(int node_id, int measurement)
+{
+    if (node_id < 0 || node_id >= NODE_ID_COUNT)
+        return;
+    float filtered_rssi_m = ble_rssi_filter_update(&filters[node_id], measurement);
     // store value or publish using MQTT
 #ifdef HOST
     ble_particle_ap_t host_ap = {
@@ -125,15 +197,56 @@ ble_rssi_update(int measurement)
         .node_distance = filtered_rssi_m,
         .pos = {.x = POS_X, .y = POS_Y}
     };
-    ble_mqtt_store_ap_data(host_ap);
+    ble_mqtt_store_ap_data(node_id, host_ap);
 #elif defined(AP)
     // construct payload string
     char *payload;
-    int ret = asprintf(&payload, "%d,%g,%g,%g", ID, filtered_rssi_m, POS_X, POS_Y);
+    int ret = asprintf(&payload, "%d,%g,%g,%g,%d", ID, filtered_rssi_m, POS_X, POS_Y, 
+        node_id);
     if (ret != ESP_FAIL) {
         if (ble_mqtt_get_state() == MQTT_STATE_CONNECTED)
             esp_mqtt_client_publish(ble_mqtt_get_client(), AP_TOPIC, payload, 0, 0, 0);
         free(payload);
     }
 #endif
-}
\ No newline at end of file
+}
+
+/**
+ * \brief Write the RSSI filters of all nodes to a snapshot.
+ * The filters are updated by the scan callback without a lock,
+ * a filter that changes while it is copied may mix two consecutive states.
+ * 
+ * \param s Snapshot to append to.
+ * 
+ * \return 0 on succes, -1 when the snapshot is full.
+ */
+int 
+ble_rssi_pack(ble_snapshot_t *s)
+{
+    int32_t count = NODE_ID_COUNT;
+    ble_snapshot_put(s, &count, sizeof(count));
+    for (int i = 0; i < NODE_ID_COUNT; i++)
+        ble_rssi_filter_pack(&filters[i], s);
+    return s->error ? -1 : 0;
+}
+
+/**
+ * \brief Restore the RSSI filters of all nodes from a snapshot written by ble_rssi_pack.
+ * Call before scanning starts.
+ * 
+ * \param s Snapshot to read from.
+ * 
+ * \return 0 on succes, -1 when the snapshot does not match.
+ */
+int 
+ble_rssi_unpack(ble_snapshot_t *s)
+{
+    int32_t count;
+    ble_snapshot_get(s, &count, sizeof(count));
+    if (s->error || count != NODE_ID_COUNT)
+        return -1;
+    for (int i = 0; i < NODE_ID_COUNT; i++)
+        ble_rssi_filter_unpack(&filters[i], s);
+    return s->error ? -1 : 0;
+}
+#endif
\ No newline at end of file
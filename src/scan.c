@@ -167,6 +167,25 @@ ble_scan_decode_adv(const uint8_t *p_adv_data, uint8_t data_len,
     return 0;
 }
 
+/**
+ * \brief Get the node ID from a decoded advertisement,
+ * which is the number following INSTANCE_PREFIX in the instance id.
+ * 
+ * \param rst Result packet decoded by ble_scan_decode_adv.
+ * 
+ * \return Node ID, -1 on failure.
+ */
+int 
+ble_scan_node_id(const ble_scan_rst_pkt_t *rst)
+{
+    const char *id_p = rst->adv.uid_beacon.instance_id + strlen(INSTANCE_PREFIX);
+    char *end_p;
+    long id = strtol(id_p, &end_p, 10);
+    if (end_p == id_p || id < 0)
+        return -1;
+    return (int)id;
+}
+
 /**
  * \brief Decode scan response data into scan reponse result packet.
  * 
@@ -0,0 +1,245 @@
+/* 
+ * MicroStorm - BLE Tracking
+ * src/snapshot.c
+ *
+ * Copyright (c) 2022 Ricardo Steijn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef NATIVE
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_spiffs.h>
+#endif
+
+#include "snapshot.h"
+
+// longest path of a snapshot file, including the suffix of the temporary file
+#define SNAPSHOT_PATH_MAX       64
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    // wall clock time the snapshot was taken, in seconds
+    int64_t time_s;
+    uint32_t len;
+    // CRC-32 of the payload
+    uint32_t crc;
+} ble_snapshot_header_t;
+
+#ifndef NATIVE
+static const char *TAG = "snapshot";
+#endif
+
+/**
+ * \brief CRC-32 (IEEE 802.3) of a buffer, with a table of 16 entries per nibble.
+ * 
+ * \param buf Buffer.
+ * \param len Length in bytes.
+ * 
+ * \return Checksum.
+ */
+static uint32_t 
+ble_snapshot_crc32(const uint8_t *buf, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ table[(crc ^ buf[i]) & 0xf];
+        crc = (crc >> 4) ^ table[(crc ^ (buf[i] >> 4)) & 0xf];
+    }
+    return ~crc;
+}
+
+/**
+ * \brief Prepare the storage of the snapshots.
+ * On the ESP32 the SPIFFS partition is mounted on SNAPSHOT_DIR, 
+ * and formatted when it holds no file system yet.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_snapshot_init(void)
+{
+#ifndef NATIVE
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = SNAPSHOT_DIR,
+        .partition_label = SNAPSHOT_PARTITION,
+        .max_files = 4,
+        .format_if_mount_failed = true
+    };
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
+    // already mounted
+    if (err == ESP_ERR_INVALID_STATE)
+        return 0;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to mount snapshot partition; %s", esp_err_to_name(err));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * \brief Append bytes to a snapshot payload.
+ * 
+ * \param s Snapshot, error is set when the bytes do not fit.
+ * \param src Bytes to append.
+ * \param n Amount of bytes.
+ */
+void 
+ble_snapshot_put(ble_snapshot_t *s, const void *src, size_t n)
+{
+    if (s->buf != NULL) {
+        if (s->len + n > s->cap) {
+            s->error = 1;
+            return;
+        }
+        memcpy(s->buf + s->len, src, n);
+    }
+    s->len += n;
+}
+
+/**
+ * \brief Read the next bytes of a snapshot payload.
+ * 
+ * \param s Snapshot, error is set when the payload ends first.
+ * \param dst Written with the bytes, zeroed on error.
+ * \param n Amount of bytes.
+ */
+void 
+ble_snapshot_get(ble_snapshot_t *s, void *dst, size_t n)
+{
+    if (s->error || s->pos + n > s->len) {
+        s->error = 1;
+        memset(dst, 0, n);
+        return;
+    }
+    memcpy(dst, s->buf + s->pos, n);
+    s->pos += n;
+}
+
+/**
+ * \brief Write a snapshot payload to a file, behind a versioned header with a checksum.
+ * The file is written under a temporary name first, so a reset while writing
+ * leaves the previous snapshot intact.
+ * 
+ * \param s Snapshot with the payload.
+ * \param kind Kind of payload, checked on load.
+ * \param path Path of the file.
+ * 
+ * \return 0 on succes, -1 on failure.
+ */
+int 
+ble_snapshot_save(const ble_snapshot_t *s, ble_snapshot_kind_t kind, const char *path)
+{
+    if (s->buf == NULL || s->error)
+        return -1;
+    char tmp[SNAPSHOT_PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+
+    ble_snapshot_header_t header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .kind = kind,
+        .time_s = (int64_t)time(NULL),
+        .len = (uint32_t)s->len,
+        .crc = ble_snapshot_crc32(s->buf, s->len)
+    };
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+        return -1;
+    int ok = (fwrite(&header, sizeof(header), 1, f) == 1) && 
+        (s->len == 0 || fwrite(s->buf, s->len, 1, f) == 1);
+    ok = (fclose(f) == 0) && ok;
+#ifndef NATIVE
+    // SPIFFS does not rename over an existing file,
+    // ble_snapshot_load falls back to the temporary file until the rename
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Read a snapshot payload from a file written by ble_snapshot_save.
+ * The snapshot is ignored when its version or kind differs, when it is corrupt,
+ * or when it is older than max_age_s or newer than the current time,
+ * the wall clock is not kept across a power cycle.
+ * 
+ * \param s Snapshot with a buffer of cap bytes, or a NULL buffer to allocate one 
+ * that fits the payload, freed by the caller. len is set to the size of the payload.
+ * \param kind Expected kind of payload.
+ * \param path Path of the file.
+ * \param max_age_s Largest age of the snapshot in seconds.
+ * 
+ * \return 0 on succes, -1 when there is no valid snapshot.
+ */
+int 
+ble_snapshot_load(ble_snapshot_t *s, ble_snapshot_kind_t kind, const char *path, 
+    int64_t max_age_s)
+{
+    char tmp[SNAPSHOT_PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL && (f = fopen(tmp, "rb")) == NULL)
+        return -1;
+
+    ble_snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    int64_t age = (int64_t)time(NULL) - header.time_s;
+    int ok = header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION && 
+        header.kind == kind && age >= 0 && age <= max_age_s;
+    if (ok && s->buf == NULL) {
+        s->buf = malloc(header.len > 0 ? header.len : 1);
+        s->cap = (s->buf != NULL) ? header.len : 0;
+    }
+    ok = ok && s->buf != NULL && header.len <= s->cap;
+    ok = ok && (header.len == 0 || fread(s->buf, header.len, 1, f) == 1);
+    fclose(f);
+    if (!ok || ble_snapshot_crc32(s->buf, header.len) != header.crc)
+        return -1;
+
+    s->len = header.len;
+    s->pos = 0;
+    s->error = 0;
+    return 0;
+}